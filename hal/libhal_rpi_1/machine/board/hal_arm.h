@@ -59,5 +59,14 @@ void hal_sync_barrier(void);
 void hal_data_sync_barrier(void);
 
 
+/*
+ * Free running counter for timestamps, see hal_get_cycle_counter().  A
+ * frequency of 0 means it is not fixed and has to be calibrated.
+ */
+#define HAL_CYCLE_COUNTER_BITS  32
+
+uint64_t hal_get_cycle_counter(void);
+uint32_t hal_get_cycle_counter_freq(void);
+
 
 #endif
@@ -346,5 +346,14 @@ uint32_t hal_get_tpidrk(void);
 void hal_set_tpidrk(uint32_t val);
 
 
+/*
+ * Free running counter for timestamps, see hal_get_cycle_counter().  A
+ * frequency of 0 means it is not fixed and has to be calibrated.
+ */
+#define HAL_CYCLE_COUNTER_BITS  64
+
+uint64_t hal_get_cycle_counter(void);
+uint32_t hal_get_cycle_counter_freq(void);
+
 
 #endif
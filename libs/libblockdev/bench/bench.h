@@ -0,0 +1,119 @@
+/*
+ * Copyright 2023  Marven Gilhespie
+ *
+ * Licensed under the Apache License, segment_id 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/*
+ * Host benchmark of libblockdev
+ *
+ * Runs a block cache against a file-backed device image on a Linux host.
+ * Synthetic workloads and traces recorded with set_block_cache_trace() are
+ * replayed through the public API, the cache's statistics then give the
+ * hit rate and device operations.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/blockdev.h>
+
+
+/*
+ * Workloads
+ */
+#define BENCH_SEQ             0             /* sequential scan with readahead */
+#define BENCH_RAND4K          1             /* random 4K reads and writes */
+#define BENCH_FAT             2             /* FAT-like metadata and file mix */
+#define BENCH_REPLAY          3             /* replay of a recorded trace */
+
+
+/*
+ * @brief   Options of a benchmark run
+ */
+struct bench_opts
+{
+  int workload;                 // BENCH_*
+  const char *image;            // Device image, NULL for a temporary file
+  const char *trace_in;         // Trace to replay
+  const char *trace_out;        // File to record the cache operations to
+  off64_t block_cnt;            // Size of the device in blocks
+  size_t block_size;
+  int buf_cnt;
+  int read_ahead;
+  int policy;                   // BLK_POLICY_*
+  int write_policy;             // BLK_WRITE_*
+  long op_cnt;                  // Operations of a synthetic workload
+  int write_pct;                // Percentage of operations that write
+  uint64_t seed;
+  bool lookup;                  // Time index lookups instead of a workload
+};
+
+
+/*
+ * @brief   A file-backed device image
+ */
+struct bench_dev
+{
+  int fd;
+  char path[256];
+  bool temporary;               // Unlinked when closed
+  off64_t block_cnt;
+  size_t block_size;
+};
+
+
+/* @brief   xorshift64* pseudo-random number generator
+ *
+ * Deterministic for a given seed, so that runs with different cache
+ * settings see the same sequence of operations.
+ */
+static inline uint64_t bench_rand(uint64_t *state)
+{
+  uint64_t x = *state;
+  
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 0x2545f4914f6cdd1dULL;
+}
+
+
+/*
+ * Prototypes
+ */
+
+// bench_dev.c
+int bench_dev_open(struct bench_dev *dev, const char *path, off64_t block_cnt, size_t block_size);
+void bench_dev_close(struct bench_dev *dev);
+
+// bench_index.c
+int bench_lookup(struct bench_dev *dev, struct bench_opts *opts);
+
+// bench_trace.c
+int bench_trace_record(struct block_cache *cache, const char *path);
+void bench_trace_stop(struct block_cache *cache);
+int bench_trace_extent(const char *path, off64_t *block_cnt);
+long bench_replay(struct block_cache *cache, struct bench_opts *opts);
+
+// bench_workload.c
+long bench_seq(struct block_cache *cache, struct bench_opts *opts);
+long bench_rand4k(struct block_cache *cache, struct bench_opts *opts);
+long bench_fat(struct block_cache *cache, struct bench_opts *opts);
+
+#endif
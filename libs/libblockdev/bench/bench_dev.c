@@ -0,0 +1,111 @@
+/*
+ * Copyright 2023  Marven Gilhespie
+ *
+ * Licensed under the Apache License, segment_id 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/*
+ * File-backed device of the libblockdev host benchmark.
+ *
+ * The cache does its I/O with lseek64(), readv() and writev() on the file
+ * descriptor it is given, so a regular file serves as the device.  Reads
+ * are served by the host's page cache, the device operation counts of a
+ * run are exact but its throughput is an upper bound.
+ */
+
+#define LOG_LEVEL_ERROR
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/debug.h>
+#include "bench.h"
+
+
+/* @brief   Open or create a device image of a given size
+ *
+ * @param   dev, device to initialize
+ * @param   path, image file, NULL to create a temporary one in $TMPDIR
+ * @param   block_cnt, number of blocks the image holds at least
+ * @param   block_size, size of a block in bytes
+ * @return  0 on success, negative errno on failure
+ *
+ * An existing image is extended if it is smaller than block_cnt blocks and
+ * otherwise left as it is.
+ */
+int bench_dev_open(struct bench_dev *dev, const char *path, off64_t block_cnt, size_t block_size)
+{
+  struct stat st;
+  const char *tmpdir;
+  off64_t sz;
+  
+  dev->block_cnt = block_cnt;
+  dev->block_size = block_size;
+  dev->temporary = (path == NULL);
+  
+  if (path == NULL) {
+    if ((tmpdir = getenv("TMPDIR")) == NULL) {
+      tmpdir = "/tmp";
+    }
+    
+    snprintf(dev->path, sizeof dev->path, "%s/blkbench.XXXXXX", tmpdir);
+    dev->fd = mkstemp(dev->path);
+  } else {
+    snprintf(dev->path, sizeof dev->path, "%s", path);
+    dev->fd = open(dev->path, O_RDWR | O_CREAT, 0644);
+  }
+  
+  if (dev->fd < 0) {
+    log_error("blkbench: cannot open %s: %s", dev->path, strerror(errno));
+    return -errno;
+  }
+  
+  if (fstat(dev->fd, &st) != 0) {
+    goto fail;
+  }
+  
+  sz = block_cnt * (off64_t)block_size;
+
+  if (st.st_size < sz && ftruncate(dev->fd, sz) != 0) {
+    goto fail;
+  }
+  
+  return 0;
+
+fail:
+  log_error("blkbench: cannot size %s: %s", dev->path, strerror(errno));
+  bench_dev_close(dev);
+  return -EIO;
+}
+
+
+/* @brief   Close a device image, removing it if it was temporary
+ */
+void bench_dev_close(struct bench_dev *dev)
+{
+  if (dev->fd < 0) {
+    return;
+  }
+  
+  close(dev->fd);
+  dev->fd = -1;
+  
+  if (dev->temporary == true) {
+    unlink(dev->path);
+  }
+}
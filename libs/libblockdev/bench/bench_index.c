@@ -0,0 +1,163 @@
+/*
+ * Copyright 2023  Marven Gilhespie
+ *
+ * Licensed under the Apache License, segment_id 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/*
+ * Microbenchmark of the buf index of libblockdev.
+ *
+ * For caches of a range of sizes the index is filled with as many blocks
+ * as the cache has bufs, at random block numbers, then find_buf() is timed
+ * for blocks in random order that are cached and that are not.  The cost of
+ * a lookup should stay nearly flat as the cache grows, apart from the cache
+ * misses of the CPU once the index no longer fits in its caches.
+ */
+
+#define LOG_LEVEL_ERROR
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/debug.h>
+#include "../block_cache_priv.h"
+#include "bench.h"
+
+// Number of lookups timed of each kind
+#define LOOKUP_CNT          (1 << 22)
+
+// Range of the random block numbers
+#define LOOKUP_BLOCK_RANGE  (1LL << 31)
+
+
+static int fill_cache(struct block_cache *cache, int buf_cnt, uint64_t *rs, off64_t *cached);
+static double time_lookups(struct block_cache *cache, off64_t *block, int cnt);
+
+
+/* @brief   Time hits and misses of find_buf() against the size of the cache
+ *
+ * @param   dev, device the caches are created on, it is not read
+ * @param   opts, the block size and seed are used
+ * @return  0 on success, negative errno on failure
+ */
+int bench_lookup(struct bench_dev *dev, struct bench_opts *opts)
+{
+  static const int buf_cnts[] = { 64, 256, 1024, 4096, 16384, 65536 };
+  struct block_cache *cache;
+  uint64_t rs = opts->seed;
+  off64_t *cached;
+  off64_t *block;
+  double hit_ns, miss_ns;
+  int buf_cnt;
+  
+  cached = malloc(buf_cnts[5] * sizeof *cached);
+  block = malloc(LOOKUP_CNT * sizeof *block);
+  
+  if (cached == NULL || block == NULL) {
+    free(cached);
+    free(block);
+    return -ENOMEM;
+  }
+  
+  printf("%8s  %10s  %10s\n", "bufs", "hit ns", "miss ns");
+  
+  for (size_t t = 0; t < sizeof buf_cnts / sizeof buf_cnts[0]; t++) {
+    buf_cnt = buf_cnts[t];
+    
+    if ((cache = init_block_cache(dev->fd, buf_cnt, opts->block_size, 1)) == NULL) {
+      log_error("blkbench: cannot create a cache of %d bufs", buf_cnt);
+      break;
+    }
+    
+    if (fill_cache(cache, buf_cnt, &rs, cached) != 0) {
+      free_cache(cache);
+      break;
+    }
+    
+    for (int l = 0; l < LOOKUP_CNT; l++) {
+      block[l] = cached[bench_rand(&rs) % buf_cnt];
+    }
+    
+    hit_ns = time_lookups(cache, block, LOOKUP_CNT);
+    
+    for (int l = 0; l < LOOKUP_CNT; l++) {
+      do {
+        block[l] = bench_rand(&rs) % LOOKUP_BLOCK_RANGE;
+      } while (find_buf(cache, block[l]) != NULL);
+    }
+    
+    miss_ns = time_lookups(cache, block, LOOKUP_CNT);
+    printf("%8d  %10.2f  %10.2f\n", buf_cnt, hit_ns, miss_ns);
+    free_cache(cache);
+  }
+  
+  free(cached);
+  free(block);
+  return 0;
+}
+
+
+/* @brief   Fill every buf of a cache with a distinct random block
+ *
+ * The blocks are got without reading the device and are clean, so that
+ * nothing is written when the cache is freed.
+ */
+static int fill_cache(struct block_cache *cache, int buf_cnt, uint64_t *rs, off64_t *cached)
+{
+  struct buf *buf;
+  
+  for (int t = 0; t < buf_cnt; t++) {
+    do {
+      cached[t] = bench_rand(rs) % LOOKUP_BLOCK_RANGE;
+    } while (find_buf(cache, cached[t]) != NULL);
+    
+    if ((buf = get_block(cache, cached[t], BLK_NO_READ)) == NULL) {
+      return -EIO;
+    }
+    
+    put_block(cache, buf);
+  }
+  
+  return 0;
+}
+
+
+/* @brief   Time a sequence of lookups
+ *
+ * @return  mean time of a lookup in nanoseconds
+ */
+static double time_lookups(struct block_cache *cache, off64_t *block, int cnt)
+{
+  struct timespec start_ts, end_ts;
+  volatile uintptr_t sink = 0;
+  uintptr_t sum = 0;
+  
+  // Once untimed, to fault in the index and the blocks
+  for (int t = 0; t < cnt; t++) {
+    sum += (uintptr_t)find_buf(cache, block[t]);
+  }
+  
+  clock_gettime(CLOCK_MONOTONIC, &start_ts);
+  
+  for (int t = 0; t < cnt; t++) {
+    sum += (uintptr_t)find_buf(cache, block[t]);
+  }
+  
+  clock_gettime(CLOCK_MONOTONIC, &end_ts);
+  sink = sum;
+  (void)sink;
+  
+  return ((end_ts.tv_sec - start_ts.tv_sec) * 1e9 + (end_ts.tv_nsec - start_ts.tv_nsec)) / cnt;
+}
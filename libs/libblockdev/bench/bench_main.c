@@ -0,0 +1,303 @@
+/*
+ * Copyright 2023  Marven Gilhespie
+ *
+ * Licensed under the Apache License, segment_id 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/*
+ * Host benchmark of libblockdev
+ *
+ * Usage: blkbench [options]
+ *
+ *   -w workload   seq, rand4k or fat (default fat)
+ *   -r trace      replay a trace recorded with set_block_cache_trace()
+ *   -t trace      record the operations of the run to a trace file
+ *   -i image      device image, a temporary file by default
+ *   -d blocks     size of the device image in blocks (default 65536)
+ *   -b size       block size in bytes (default 512)
+ *   -n bufs       number of bufs in the cache (default 1024)
+ *   -a blocks     maximum readahead in blocks (default 8)
+ *   -p policy     lru or 2q (default 2q)
+ *   -m mode       write-through or write-back (default write-back)
+ *   -o ops        operations of a synthetic workload (default 100000)
+ *   -x percent    percentage of operations that write (default 20)
+ *   -s seed       seed of the synthetic workloads (default 1)
+ *   -l            time index lookups against the number of bufs instead
+ *
+ * The report gives the throughput in blocks accessed per second, the hit
+ * rate of the cache and the operations it performed on the device.  The
+ * cache is synced at the end of the run and the sync is part of its time.
+ */
+
+#define LOG_LEVEL_ERROR
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/debug.h>
+#include "bench.h"
+
+
+static int parse_args(int argc, char **argv, struct bench_opts *opts);
+static void report(struct bench_opts *opts, struct block_cache_stats *stats,
+                   long blocks, double sec);
+static double pct(uint64_t n, uint64_t total);
+
+static const char *workload_name[] = { "seq", "rand4k", "fat", "replay" };
+
+
+/* @brief   Run a workload on a cache of a file-backed device and report
+ */
+int main(int argc, char **argv)
+{
+  struct bench_opts opts;
+  struct block_cache_stats stats;
+  struct bench_dev dev;
+  struct block_cache *cache;
+  struct timespec start_ts, end_ts;
+  off64_t trace_blocks;
+  long blocks;
+  int rc;
+  
+  if (parse_args(argc, argv, &opts) != 0) {
+    return EXIT_FAILURE;
+  }
+
+  if (opts.workload == BENCH_REPLAY) {
+    if (bench_trace_extent(opts.trace_in, &trace_blocks) < 0) {
+      return EXIT_FAILURE;
+    }
+    
+    if (trace_blocks > opts.block_cnt) {
+      opts.block_cnt = trace_blocks;
+    }
+  }
+  
+  // The cache does not know the size of the device and may read up to two
+  // readahead windows past the last block a workload uses
+  if (bench_dev_open(&dev, opts.image, opts.block_cnt + 2 * opts.read_ahead, opts.block_size) != 0) {
+    return EXIT_FAILURE;
+  }
+  
+  if (opts.lookup == true) {
+    rc = bench_lookup(&dev, &opts);
+    bench_dev_close(&dev);
+    return (rc == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  
+  if ((cache = init_block_cache(dev.fd, opts.buf_cnt, opts.block_size, opts.read_ahead)) == NULL) {
+    log_error("blkbench: cannot create a cache of %d bufs", opts.buf_cnt);
+    bench_dev_close(&dev);
+    return EXIT_FAILURE;
+  }
+  
+  set_block_cache_policy(cache, opts.policy);
+  set_block_cache_writeback(cache, opts.write_policy, 0);
+  
+  if (opts.trace_out != NULL && bench_trace_record(cache, opts.trace_out) != 0) {
+    free_cache(cache);
+    bench_dev_close(&dev);
+    return EXIT_FAILURE;
+  }
+
+  block_cache_reset_stats(cache);
+  clock_gettime(CLOCK_MONOTONIC, &start_ts);
+  
+  switch (opts.workload) {
+    case BENCH_SEQ:
+      blocks = bench_seq(cache, &opts);
+      break;
+    case BENCH_RAND4K:
+      blocks = bench_rand4k(cache, &opts);
+      break;
+    case BENCH_FAT:
+      blocks = bench_fat(cache, &opts);
+      break;
+    default:
+      blocks = bench_replay(cache, &opts);
+      break;
+  }
+  
+  rc = sync_block_cache(cache);
+  clock_gettime(CLOCK_MONOTONIC, &end_ts);
+  
+  bench_trace_stop(cache);
+  block_cache_get_stats(cache, &stats);
+  
+  if (blocks >= 0 && rc == 0) {
+    report(&opts, &stats, blocks, (end_ts.tv_sec - start_ts.tv_sec)
+           + (end_ts.tv_nsec - start_ts.tv_nsec) / 1e9);
+  } else {
+    log_error("blkbench: %s workload failed", workload_name[opts.workload]);
+  }
+  
+  free_cache(cache);
+  bench_dev_close(&dev);
+  return (blocks >= 0 && rc == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+/* @brief   Parse the command line into opts, see the usage above
+ *
+ * @return  0 on success, -EINVAL if an option is invalid
+ */
+static int parse_args(int argc, char **argv, struct bench_opts *opts)
+{
+  int c;
+  
+  memset(opts, 0, sizeof *opts);
+  opts->workload = BENCH_FAT;
+  opts->block_cnt = 65536;
+  opts->block_size = 512;
+  opts->buf_cnt = 1024;
+  opts->read_ahead = 8;
+  opts->policy = BLK_POLICY_2Q;
+  opts->write_policy = BLK_WRITE_BACK;
+  opts->op_cnt = 100000;
+  opts->write_pct = 20;
+  opts->seed = 1;
+  
+  while ((c = getopt(argc, argv, "w:r:t:i:d:b:n:a:p:m:o:x:s:l")) != -1) {
+    switch (c) {
+      case 'w':
+        for (opts->workload = 0; opts->workload < BENCH_REPLAY; opts->workload++) {
+          if (strcmp(optarg, workload_name[opts->workload]) == 0) {
+            break;
+          }
+        }
+        
+        if (opts->workload == BENCH_REPLAY) {
+          goto usage;
+        }
+        break;
+      case 'r':
+        opts->workload = BENCH_REPLAY;
+        opts->trace_in = optarg;
+        break;
+      case 't':
+        opts->trace_out = optarg;
+        break;
+      case 'i':
+        opts->image = optarg;
+        break;
+      case 'd':
+        opts->block_cnt = strtoll(optarg, NULL, 0);
+        break;
+      case 'b':
+        opts->block_size = strtoul(optarg, NULL, 0);
+        break;
+      case 'n':
+        opts->buf_cnt = atoi(optarg);
+        break;
+      case 'a':
+        opts->read_ahead = atoi(optarg);
+        break;
+      case 'p':
+        if (strcmp(optarg, "lru") == 0) {
+          opts->policy = BLK_POLICY_LRU;
+        } else if (strcmp(optarg, "2q") == 0) {
+          opts->policy = BLK_POLICY_2Q;
+        } else {
+          goto usage;
+        }
+        break;
+      case 'm':
+        if (strcmp(optarg, "write-through") == 0) {
+          opts->write_policy = BLK_WRITE_THROUGH;
+        } else if (strcmp(optarg, "write-back") == 0) {
+          opts->write_policy = BLK_WRITE_BACK;
+        } else {
+          goto usage;
+        }
+        break;
+      case 'o':
+        opts->op_cnt = atol(optarg);
+        break;
+      case 'x':
+        opts->write_pct = atoi(optarg);
+        break;
+      case 's':
+        opts->seed = strtoull(optarg, NULL, 0);
+        break;
+      case 'l':
+        opts->lookup = true;
+        break;
+      default:
+        goto usage;
+    }
+  }
+  
+  // xorshift has a fixed point at 0
+  if (opts->seed == 0) {
+    opts->seed = 1;
+  }
+  
+  if (optind == argc && opts->block_cnt >= 1024 && opts->block_size >= 512
+      && (opts->block_size & (opts->block_size - 1)) == 0
+      && opts->buf_cnt >= 16 && opts->op_cnt > 0
+      && opts->write_pct >= 0 && opts->write_pct <= 100) {
+    return 0;
+  }
+
+usage:
+  fprintf(stderr, "usage: %s [-w seq|rand4k|fat] [-r trace] [-t trace] [-i image]\n"
+                  "       [-d blocks] [-b block_size] [-n bufs] [-a readahead]\n"
+                  "       [-p lru|2q] [-m write-through|write-back] [-o ops]\n"
+                  "       [-x write_pct] [-s seed] [-l]\n", argv[0]);
+  return -EINVAL;
+}
+
+
+/* @brief   Print the results of a run
+ */
+static void report(struct bench_opts *opts, struct block_cache_stats *stats,
+                   long blocks, double sec)
+{
+  uint64_t lookups = stats->hit_cnt + stats->miss_cnt;
+  
+  printf("workload    %s, %s, %s\n", workload_name[opts->workload],
+         (opts->policy == BLK_POLICY_2Q) ? "2q" : "lru",
+         (opts->write_policy == BLK_WRITE_BACK) ? "write-back" : "write-through");
+  printf("cache       %d bufs of %zu bytes, device %lld blocks\n",
+         stats->buf_cnt, opts->block_size, (long long)opts->block_cnt);
+  printf("time        %.3f s\n", sec);
+  printf("throughput  %.0f blocks/s, %.2f MB/s\n", blocks / sec,
+         blocks * (double)opts->block_size / sec / (1024 * 1024));
+  printf("hits        %llu of %llu lookups, %.2f%%\n", (unsigned long long)stats->hit_cnt,
+         (unsigned long long)lookups, pct(stats->hit_cnt, lookups));
+  printf("ghost hits  %llu\n", (unsigned long long)stats->ghost_hit_cnt);
+  printf("evictions   %llu\n", (unsigned long long)stats->evict_cnt);
+  printf("readahead   %llu issued, %llu used, %llu wasted\n",
+         (unsigned long long)stats->ra_issued_cnt, (unsigned long long)stats->ra_hit_cnt,
+         (unsigned long long)stats->ra_wasted_cnt);
+  printf("dev reads   %llu ops, %llu blocks\n", (unsigned long long)stats->read_lat.cnt,
+         (unsigned long long)stats->read_cnt);
+  printf("dev writes  %llu ops, %llu blocks\n", (unsigned long long)stats->write_lat.cnt,
+         (unsigned long long)stats->writeback_cnt);
+  printf("dev syncs   %llu\n", (unsigned long long)stats->sync_lat.cnt);
+  printf("io queue    %llu requests, %llu dispatched, %llu merged\n",
+         (unsigned long long)stats->io_req_cnt, (unsigned long long)stats->io_dispatch_cnt,
+         (unsigned long long)stats->io_merge_cnt);
+}
+
+
+/* @brief   Percentage of n in total, 0 if total is 0
+ */
+static double pct(uint64_t n, uint64_t total)
+{
+  return (total == 0) ? 0.0 : (100.0 * n) / total;
+}
@@ -0,0 +1,310 @@
+/*
+ * Copyright 2023  Marven Gilhespie
+ *
+ * Licensed under the Apache License, segment_id 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/*
+ * Recording and replay of cache operation traces.
+ *
+ * A trace file is a sequence of struct blk_trace_rec in the byte order and
+ * layout of the host that recorded it, exactly as passed to the function
+ * set with set_block_cache_trace().  A file system server on CheviotOS can
+ * record one with a trace function that writes each record to a file.
+ *
+ * Replay performs each operation on the cache in turn.  Blocks got are held
+ * until the put record of the same block, which is how a multithreaded or
+ * nested caller would have used them.  A put of a block that is not held,
+ * because it was got before recording started, is skipped.
+ */
+
+#define LOG_LEVEL_ERROR
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/debug.h>
+#include "bench.h"
+
+
+static void trace_write(void *arg, struct blk_trace_rec *rec);
+static int hold_buf(struct buf *buf);
+static struct buf *release_buf(off64_t block);
+
+static FILE *trace_out;
+static struct buf **held;
+static int held_cnt;
+static int held_max;
+static long skipped_put_cnt;
+
+
+/* @brief   Record the operations on a cache to a file
+ *
+ * @return  0 on success, negative errno if the file cannot be created
+ */
+int bench_trace_record(struct block_cache *cache, const char *path)
+{
+  if ((trace_out = fopen(path, "wb")) == NULL) {
+    log_error("blkbench: cannot create %s: %s", path, strerror(errno));
+    return -errno;
+  }
+  
+  set_block_cache_trace(cache, trace_write, trace_out);
+  return 0;
+}
+
+
+/* @brief   Stop recording and close the trace file
+ */
+void bench_trace_stop(struct block_cache *cache)
+{
+  if (trace_out == NULL) {
+    return;
+  }
+  
+  set_block_cache_trace(cache, NULL, NULL);
+  
+  if (fclose(trace_out) != 0) {
+    log_error("blkbench: error writing trace: %s", strerror(errno));
+  }
+  
+  trace_out = NULL;
+}
+
+
+/* @brief   Find the number of blocks a device needs for a trace to be replayed
+ *
+ * @param   path, trace file
+ * @param   block_cnt, set to one more than the highest block of the trace
+ * @return  number of records, or negative errno on failure
+ */
+int bench_trace_extent(const char *path, off64_t *block_cnt)
+{
+  struct blk_trace_rec rec;
+  FILE *fp;
+  int cnt = 0;
+  
+  if ((fp = fopen(path, "rb")) == NULL) {
+    log_error("blkbench: cannot open %s: %s", path, strerror(errno));
+    return -errno;
+  }
+  
+  *block_cnt = 0;
+  
+  while (fread(&rec, sizeof rec, 1, fp) == 1) {
+    if (rec.block + ((rec.count > 0) ? rec.count : 1) > *block_cnt) {
+      *block_cnt = rec.block + ((rec.count > 0) ? rec.count : 1);
+    }
+    
+    cnt++;
+  }
+  
+  fclose(fp);
+  return cnt;
+}
+
+
+/* @brief   Replay a trace on a cache
+ *
+ * @return  number of blocks accessed, or negative errno on failure
+ */
+long bench_replay(struct block_cache *cache, struct bench_opts *opts)
+{
+  struct buf *bufs[BLK_MAX_IOV];
+  struct blk_trace_rec rec;
+  struct buf *buf;
+  void *data = NULL;
+  size_t data_sz = 0;
+  long blocks = 0;
+  long rc = 0;
+  FILE *fp;
+  
+  if ((fp = fopen(opts->trace_in, "rb")) == NULL) {
+    log_error("blkbench: cannot open %s: %s", opts->trace_in, strerror(errno));
+    return -errno;
+  }
+  
+  skipped_put_cnt = 0;
+  
+  while (rc == 0 && fread(&rec, sizeof rec, 1, fp) == 1) {
+    switch (rec.op) {
+      case BLK_TRACE_GET:
+      case BLK_TRACE_READAHEAD:
+        if (rec.op == BLK_TRACE_GET) {
+          buf = get_block(cache, rec.block, rec.opt);
+        } else {
+          buf = get_block_readahead(cache, rec.block);
+        }
+        
+        if (buf == NULL || hold_buf(buf) != 0) {
+          rc = -EIO;
+          break;
+        }
+        
+        blocks++;
+        break;
+        
+      case BLK_TRACE_RANGE:
+        if (rec.count < 1 || rec.count > BLK_MAX_IOV
+            || get_block_range(cache, rec.block, rec.count, rec.opt, bufs) == NULL) {
+          rc = -EIO;
+          break;
+        }
+        
+        for (int t = 0; t < rec.count && rc == 0; t++) {
+          rc = hold_buf(bufs[t]);
+        }
+        
+        blocks += rec.count;
+        break;
+        
+      case BLK_TRACE_PREFETCH:
+        prefetch_blocks(cache, rec.block, rec.count);
+        break;
+        
+      case BLK_TRACE_PUT:
+        if ((buf = release_buf(rec.block)) == NULL) {
+          skipped_put_cnt++;
+          break;
+        }
+        
+        if (rec.opt == 1) {
+          block_markdirty(buf);
+        }
+        
+        put_block(cache, buf);
+        break;
+        
+      case BLK_TRACE_INVALIDATE:
+        invalidate_block(cache, rec.block);
+        break;
+        
+      case BLK_TRACE_SYNC:
+        if (rec.count == 0) {
+          rc = sync_block_cache(cache);
+        } else {
+          rc = sync_block_range(cache, rec.block, rec.count);
+        }
+        break;
+        
+      case BLK_TRACE_BARRIER:
+        rc = block_cache_barrier(cache);
+        break;
+        
+      case BLK_TRACE_READ:
+      case BLK_TRACE_WRITE:
+        if (rec.count < 1) {
+          break;
+        }
+        
+        if (data_sz < rec.count * opts->block_size) {
+          free(data);
+          data_sz = rec.count * opts->block_size;
+          
+          if ((data = calloc(1, data_sz)) == NULL) {
+            rc = -ENOMEM;
+            break;
+          }
+        }
+        
+        if (rec.op == BLK_TRACE_READ) {
+          rc = block_cache_read(cache, rec.block, rec.count, data);
+        } else {
+          rc = block_cache_write(cache, rec.block, rec.count, data);
+        }
+        
+        blocks += rec.count;
+        break;
+        
+      case BLK_TRACE_DISCARD:
+        rc = discard_block_range(cache, rec.block, rec.count);
+        break;
+        
+      default:
+        log_error("blkbench: unknown trace operation %d", rec.op);
+        rc = -EINVAL;
+        break;
+    }
+  }
+  
+  if (rc != 0) {
+    log_error("blkbench: replay failed at block %lld, op %d", (long long)rec.block, rec.op);
+  }
+  
+  if (held_cnt != 0 || skipped_put_cnt != 0) {
+    log_warn("blkbench: %d blocks never put, %ld puts of blocks not held",
+             held_cnt, skipped_put_cnt);
+  }
+  
+  while (held_cnt > 0) {
+    put_block(cache, held[--held_cnt]);
+  }
+  
+  free(held);
+  held = NULL;
+  held_max = 0;
+  free(data);
+  fclose(fp);
+  return (rc == 0) ? blocks : rc;
+}
+
+
+/* @brief   Trace function writing records to the trace file
+ */
+static void trace_write(void *arg, struct blk_trace_rec *rec)
+{
+  fwrite(rec, sizeof *rec, 1, (FILE *)arg);
+}
+
+
+/* @brief   Add a buf to those held by the replay
+ */
+static int hold_buf(struct buf *buf)
+{
+  struct buf **new_held;
+  
+  if (held_cnt == held_max) {
+    held_max = (held_max == 0) ? 64 : held_max * 2;
+    
+    if ((new_held = realloc(held, held_max * sizeof *held)) == NULL) {
+      return -ENOMEM;
+    }
+    
+    held = new_held;
+  }
+  
+  held[held_cnt++] = buf;
+  return 0;
+}
+
+
+/* @brief   Remove the most recently got buf of a block from those held
+ *
+ * @return  the buf, or NULL if the block is not held
+ */
+static struct buf *release_buf(off64_t block)
+{
+  struct buf *buf;
+  
+  for (int t = held_cnt - 1; t >= 0; t--) {
+    if (held[t]->block == block) {
+      buf = held[t];
+      held[t] = held[--held_cnt];
+      return buf;
+    }
+  }
+  
+  return NULL;
+}
@@ -0,0 +1,281 @@
+/*
+ * Copyright 2023  Marven Gilhespie
+ *
+ * Licensed under the Apache License, segment_id 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/*
+ * Synthetic workloads of the libblockdev host benchmark.
+ *
+ * Each workload runs opts->op_cnt operations through the public API of the
+ * cache and returns the number of blocks it accessed, from which the
+ * throughput of a run is calculated.
+ */
+
+#define LOG_LEVEL_ERROR
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/debug.h>
+#include "bench.h"
+
+// Blocks holding the boot sector of the FAT-like layout
+#define FAT_RESERVED_BLOCKS   1
+
+// Bytes per FAT entry, one entry per cluster of one block
+#define FAT_ENTRY_SZ          4
+
+// Number of copies of the FAT that are written
+#define FAT_COPIES            2
+
+// Longest file, in blocks, of the FAT-like workload
+#define FAT_FILE_MAX          32
+
+
+static int touch_block(struct block_cache *cache, off64_t block, int opt, bool write);
+static int touch_fat(struct block_cache *cache, off64_t *fat_start, off64_t cluster,
+                     size_t block_size, bool write);
+
+
+/* @brief   Sequential scan of the device with readahead
+ *
+ * Blocks are read in ascending order with get_block_readahead(), wrapping
+ * at the end of the device.  Writes dirty the block that was read.
+ */
+long bench_seq(struct block_cache *cache, struct bench_opts *opts)
+{
+  uint64_t rs = opts->seed;
+  struct buf *buf;
+  
+  for (long t = 0; t < opts->op_cnt; t++) {
+    if ((buf = get_block_readahead(cache, t % opts->block_cnt)) == NULL) {
+      return -EIO;
+    }
+    
+    if ((int)(bench_rand(&rs) % 100) < opts->write_pct) {
+      ((uint32_t *)buf->data)[0] = (uint32_t)t;
+      block_markdirty(buf);
+    }
+    
+    put_block(cache, buf);
+  }
+  
+  return opts->op_cnt;
+}
+
+
+/* @brief   Random 4K reads and writes
+ *
+ * Each operation reads or overwrites a 4K aligned extent at a uniformly
+ * random position, as a database or swap file would.  Extents of more than
+ * one block are transferred with get_block_range().  Overwrites do not read
+ * the blocks first.
+ */
+long bench_rand4k(struct block_cache *cache, struct bench_opts *opts)
+{
+  struct buf *bufs[BLK_MAX_IOV];
+  uint64_t rs = opts->seed;
+  off64_t extent_cnt;
+  off64_t start;
+  int count;
+  bool write;
+  
+  count = (opts->block_size < 4096) ? 4096 / opts->block_size : 1;
+  extent_cnt = opts->block_cnt / count;
+  
+  for (long t = 0; t < opts->op_cnt; t++) {
+    start = (bench_rand(&rs) % extent_cnt) * count;
+    write = (int)(bench_rand(&rs) % 100) < opts->write_pct;
+    
+    if (count == 1) {
+      if (touch_block(cache, start, (write) ? BLK_NO_READ : BLK_READ, write) != 0) {
+        return -EIO;
+      }
+      
+      continue;
+    }
+    
+    if (get_block_range(cache, start, count, (write) ? BLK_NO_READ : BLK_READ, bufs) == NULL) {
+      return -EIO;
+    }
+    
+    if (write == true) {
+      for (int b = 0; b < count; b++) {
+        memset(bufs[b]->data, (int)t, opts->block_size);
+        block_markdirty(bufs[b]);
+      }
+    }
+    
+    put_block_range(cache, bufs, count);
+  }
+  
+  return opts->op_cnt * count;
+}
+
+
+/* @brief   FAT-like mix of metadata and file data
+ *
+ * The device is laid out as a FAT file system with one block clusters: a
+ * boot sector, FAT_COPIES copies of the FAT, a root directory of 1/256th of
+ * the device and the data area.  Each operation looks up a file in a
+ * directory block, biased towards the start of the directory, then walks its
+ * cluster chain in the FAT while reading the file's data with readahead.
+ *
+ * Writes overwrite the file's data without reading it, then after a barrier
+ * update the FAT entries in every copy and the directory entry, the order a
+ * FAT driver uses to keep the file system consistent.  Metadata is small and
+ * hot, file data large and mostly cold, which is what the replacement
+ * policy has to tell apart.
+ */
+long bench_fat(struct block_cache *cache, struct bench_opts *opts)
+{
+  off64_t fat_start[FAT_COPIES];
+  off64_t fat_blocks, dir_start, dir_blocks, data_start, data_blocks;
+  off64_t dir, start, cluster;
+  uint64_t rs = opts->seed;
+  long blocks = 0;
+  int len;
+  bool write;
+  
+  fat_blocks = (opts->block_cnt * FAT_ENTRY_SZ + opts->block_size - 1) / opts->block_size;
+  
+  for (int c = 0; c < FAT_COPIES; c++) {
+    fat_start[c] = FAT_RESERVED_BLOCKS + c * fat_blocks;
+  }
+  
+  dir_start = FAT_RESERVED_BLOCKS + FAT_COPIES * fat_blocks;
+  dir_blocks = (opts->block_cnt / 256 > 8) ? opts->block_cnt / 256 : 8;
+  data_start = dir_start + dir_blocks;
+  data_blocks = opts->block_cnt - data_start;
+  
+  if (data_blocks < FAT_FILE_MAX) {
+    log_error("blkbench: device too small for the fat workload");
+    return -EINVAL;
+  }
+  
+  for (long t = 0; t < opts->op_cnt; t++) {
+    // Product of two uniform numbers, low directory blocks are the hottest
+    dir = dir_start + ((bench_rand(&rs) % dir_blocks) * (bench_rand(&rs) % dir_blocks)) / dir_blocks;
+    len = 1 << (bench_rand(&rs) % 6);
+    start = bench_rand(&rs) % (data_blocks - len + 1);
+    write = (int)(bench_rand(&rs) % 100) < opts->write_pct;
+    
+    if (touch_block(cache, dir, BLK_READ, false) != 0) {
+      return -EIO;
+    }
+    
+    blocks++;
+    
+    for (int b = 0; b < len; b++) {
+      cluster = start + b;
+      
+      if (write == true) {
+        if (touch_block(cache, data_start + cluster, BLK_NO_READ | BLK_HINT_DATA, true) != 0) {
+          return -EIO;
+        }
+      } else {
+        // The FAT block holding the cluster's entry, once per FAT block
+        if (b == 0 || (cluster * FAT_ENTRY_SZ) % opts->block_size == 0) {
+          if (touch_fat(cache, fat_start, cluster, opts->block_size, false) != 0) {
+            return -EIO;
+          }
+          
+          blocks++;
+        }
+        
+        if (touch_block(cache, data_start + cluster, -1, false) != 0) {
+          return -EIO;
+        }
+      }
+      
+      blocks++;
+    }
+    
+    if (write == false) {
+      continue;
+    }
+    
+    if (block_cache_barrier(cache) != 0) {
+      return -EIO;
+    }
+    
+    for (int b = 0; b < len; b++) {
+      cluster = start + b;
+      
+      if (b == 0 || (cluster * FAT_ENTRY_SZ) % opts->block_size == 0) {
+        if (touch_fat(cache, fat_start, cluster, opts->block_size, true) != 0) {
+          return -EIO;
+        }
+        
+        blocks += FAT_COPIES;
+      }
+    }
+    
+    if (touch_block(cache, dir, BLK_READ, true) != 0) {
+      return -EIO;
+    }
+    
+    blocks++;
+  }
+  
+  return blocks;
+}
+
+
+/* @brief   Get and put a block, dirtying it if written
+ *
+ * @param   opt, as for get_block(), or -1 to get the block with readahead
+ * @return  0 on success, -EIO if the block could not be got
+ */
+static int touch_block(struct block_cache *cache, off64_t block, int opt, bool write)
+{
+  struct buf *buf;
+  
+  if (opt == -1) {
+    buf = get_block_readahead(cache, block);
+  } else {
+    buf = get_block(cache, block, opt);
+  }
+  
+  if (buf == NULL) {
+    return -EIO;
+  }
+  
+  if (write == true) {
+    ((uint32_t *)buf->data)[0] = (uint32_t)block;
+    block_markdirty(buf);
+  }
+  
+  put_block(cache, buf);
+  return 0;
+}
+
+
+/* @brief   Read the FAT block of a cluster, or update it in every copy
+ */
+static int touch_fat(struct block_cache *cache, off64_t *fat_start, off64_t cluster,
+                     size_t block_size, bool write)
+{
+  off64_t offset = (cluster * FAT_ENTRY_SZ) / block_size;
+  int copies = (write) ? FAT_COPIES : 1;
+  
+  for (int c = 0; c < copies; c++) {
+    if (touch_block(cache, fat_start[c] + offset, BLK_READ, write) != 0) {
+      return -EIO;
+    }
+  }
+  
+  return 0;
+}
@@ -0,0 +1,236 @@
+/*
+ * Copyright 2023  Marven Gilhespie
+ *
+ * Licensed under the Apache License, segment_id 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/*
+ * Regression checks of libblockdev, run on the host by "make check".
+ *
+ * Each check runs a cache against a temporary file-backed device image and
+ * returns 0 if it passed.  A failed condition is reported with its line.
+ */
+
+#define LOG_LEVEL_ERROR
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/debug.h>
+#include "bench.h"
+
+#define CHECK(cond)                                                           \
+  do {                                                                        \
+    if (!(cond)) {                                                            \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      return -1;                                                              \
+    }                                                                         \
+  } while (0)
+
+
+static int check_held_dirty_flush(struct bench_dev *dev);
+static int check_flush_error(struct bench_dev *dev);
+static int check_redirty_after_barrier(struct bench_dev *dev);
+static void write_block(struct block_cache *cache, off64_t block, const char *data, bool put);
+static bool disk_has(struct bench_dev *dev, off64_t block, const char *data);
+
+
+static const struct
+{
+  const char *name;
+  int (*fn)(struct bench_dev *dev);
+} checks[] = {
+  { "held dirty block across a watermark flush", check_held_dirty_flush },
+  { "failed flush reported by the next sync", check_flush_error },
+  { "block dirtied again after a barrier", check_redirty_after_barrier },
+};
+
+
+/* @brief   Run every check on a fresh device image
+ */
+int main(void)
+{
+  struct bench_dev dev;
+  int failed = 0;
+  
+  for (int t = 0; t < (int)(sizeof checks / sizeof checks[0]); t++) {
+    if (bench_dev_open(&dev, NULL, 1024, 512) != 0) {
+      return EXIT_FAILURE;
+    }
+    
+    if (checks[t].fn(&dev) != 0) {
+      printf("FAIL: %s\n", checks[t].name);
+      failed++;
+    } else {
+      printf("PASS: %s\n", checks[t].name);
+    }
+    
+    bench_dev_close(&dev);
+  }
+  
+  return (failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+/* @brief   A block held and dirtied while a watermark flush runs keeps the
+ *          changes its holder makes afterwards
+ */
+static int check_held_dirty_flush(struct bench_dev *dev)
+{
+  struct block_cache *cache;
+  struct buf *held;
+  
+  cache = init_block_cache(dev->fd, 16, dev->block_size, 1);
+  CHECK(cache != NULL);
+  set_block_cache_writeback(cache, BLK_WRITE_BACK, 2);
+  
+  // Dirty and on the dirty list, then held again and partly rewritten
+  write_block(cache, 1, "o B", true);
+  held = get_block(cache, 1, BLK_READ);
+  memcpy(held->data, "x A", 4);
+  block_markdirty(held);
+  
+  for (int t = 0; t < 4; t++) {
+    write_block(cache, 10 + t, "new", true);
+  }
+  
+  memcpy(held->data, "x y", 4);
+  put_block(cache, held);
+  CHECK(sync_block_cache(cache) == 0);
+  CHECK(disk_has(dev, 1, "x y"));
+
+  // Held across a barrier, written ahead of the newer epoch but kept dirty
+  held = get_block(cache, 1, BLK_READ);
+  memcpy(held->data, "p Q", 4);
+  block_markdirty(held);
+  put_block(cache, held);
+  held = get_block(cache, 1, BLK_READ);
+  block_cache_barrier(cache);
+  
+  for (int t = 0; t < 4; t++) {
+    write_block(cache, 20 + t, "new", true);
+  }
+  
+  CHECK(disk_has(dev, 1, "p Q"));
+  memcpy(held->data, "p q", 4);
+  put_block(cache, held);
+  CHECK(sync_block_cache(cache) == 0);
+  CHECK(disk_has(dev, 1, "p q"));
+  
+  free_cache(cache);
+  return 0;
+}
+
+
+/* @brief   A write that fails in a watermark flush is reported by the next
+ *          barrier or sync, once
+ */
+static int check_flush_error(struct bench_dev *dev)
+{
+  struct block_cache *cache;
+  int fd;
+  
+  // Writes to a read-only descriptor fail
+  fd = open(dev->path, O_RDONLY);
+  CHECK(fd >= 0);
+  cache = init_block_cache(fd, 16, dev->block_size, 1);
+  CHECK(cache != NULL);
+  set_block_cache_writeback(cache, BLK_WRITE_BACK, 2);
+  
+  for (int t = 0; t < 4; t++) {
+    write_block(cache, t, "lost", true);
+  }
+  
+  CHECK(block_cache_barrier(cache) == -EIO);
+  CHECK(block_cache_barrier(cache) == 0);
+  
+  for (int t = 0; t < 4; t++) {
+    write_block(cache, 10 + t, "lost", true);
+  }
+
+  CHECK(sync_block_cache(cache) == -EIO);
+  CHECK(sync_block_cache(cache) == 0);
+  free_cache(cache);
+  close(fd);
+  return 0;
+}
+
+
+/* @brief   A dirty block changed again after a barrier is not written before
+ *          the blocks dirtied ahead of the barrier
+ */
+static int check_redirty_after_barrier(struct bench_dev *dev)
+{
+  struct block_cache *cache;
+  struct buf *buf;
+  
+  cache = init_block_cache(dev->fd, 16, dev->block_size, 1);
+  CHECK(cache != NULL);
+  set_block_cache_writeback(cache, BLK_WRITE_BACK, 12);
+  
+  write_block(cache, 1, "old", true);
+  write_block(cache, 2, "pre", true);
+  CHECK(block_cache_barrier(cache) == 0);
+  write_block(cache, 1, "new", true);
+  CHECK(disk_has(dev, 2, "pre"));
+  CHECK(disk_has(dev, 1, "new") == false);
+  
+  // Only read after a barrier, the block stays in its older epoch
+  write_block(cache, 3, "old", true);
+  CHECK(block_cache_barrier(cache) == 0);
+  buf = get_block(cache, 3, BLK_READ);
+  put_block(cache, buf);
+  CHECK(disk_has(dev, 3, "old") == false);
+  
+  CHECK(sync_block_cache(cache) == 0);
+  CHECK(disk_has(dev, 1, "new"));
+  CHECK(disk_has(dev, 3, "old"));
+  
+  free_cache(cache);
+  return 0;
+}
+
+
+/* @brief   Set the start of a block and mark it dirty, releasing it if put
+ */
+static void write_block(struct block_cache *cache, off64_t block, const char *data, bool put)
+{
+  struct buf *buf;
+  
+  buf = get_block(cache, block, BLK_READ);
+  memcpy(buf->data, data, strlen(data) + 1);
+  block_markdirty(buf);
+  
+  if (put == true) {
+    put_block(cache, buf);
+  }
+}
+
+
+/* @brief   Check the start of a block on the device image
+ */
+static bool disk_has(struct bench_dev *dev, off64_t block, const char *data)
+{
+  char buf[64];
+  size_t len = strlen(data) + 1;
+  
+  if (pread(dev->fd, buf, len, block * dev->block_size) != (ssize_t)len) {
+    return false;
+  }
+  
+  return memcmp(buf, data, len) == 0;
+}
@@ -0,0 +1,112 @@
+/*
+ * Copyright 2023  Marven Gilhespie
+ *
+ * Licensed under the Apache License, segment_id 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/*
+ * Host shim of the CheviotOS <sys/lists.h> for the libblockdev benchmark.
+ *
+ * Doubly linked lists with head and tail pointers, the links are embedded
+ * in the entries.  LIST_TYPE(type, list_t, link_t) declares the list and
+ * link types of a struct.
+ */
+
+#ifndef BENCH_SHIM_SYS_LISTS_H
+#define BENCH_SHIM_SYS_LISTS_H
+
+#include <stddef.h>
+
+#define LIST_TYPE(type, list_t, link_t)                                       \
+  typedef struct { struct type *head; struct type *tail; } list_t;            \
+  typedef struct { struct type *next; struct type *prev; } link_t;
+
+#define LIST_INIT(list)         do { (list)->head = NULL; (list)->tail = NULL; } while (0)
+#define LIST_HEAD(list)         ((list)->head)
+#define LIST_TAIL(list)         ((list)->tail)
+#define LIST_EMPTY(list)        ((list)->head == NULL)
+#define LIST_NEXT(entry, link)  ((entry)->link.next)
+#define LIST_PREV(entry, link)  ((entry)->link.prev)
+
+#define LIST_ADD_HEAD(list, entry, link)                                      \
+  do {                                                                        \
+    (entry)->link.prev = NULL;                                                \
+    (entry)->link.next = (list)->head;                                        \
+    if ((list)->head != NULL)                                                 \
+      (list)->head->link.prev = (entry);                                      \
+    else                                                                      \
+      (list)->tail = (entry);                                                 \
+    (list)->head = (entry);                                                   \
+  } while (0)
+
+#define LIST_ADD_TAIL(list, entry, link)                                      \
+  do {                                                                        \
+    (entry)->link.next = NULL;                                                \
+    (entry)->link.prev = (list)->tail;                                        \
+    if ((list)->tail != NULL)                                                 \
+      (list)->tail->link.next = (entry);                                      \
+    else                                                                      \
+      (list)->head = (entry);                                                 \
+    (list)->tail = (entry);                                                   \
+  } while (0)
+
+#define LIST_REM_ENTRY(list, entry, link)                                     \
+  do {                                                                        \
+    if ((entry)->link.prev != NULL)                                           \
+      (entry)->link.prev->link.next = (entry)->link.next;                     \
+    else                                                                      \
+      (list)->head = (entry)->link.next;                                      \
+    if ((entry)->link.next != NULL)                                           \
+      (entry)->link.next->link.prev = (entry)->link.prev;                     \
+    else                                                                      \
+      (list)->tail = (entry)->link.prev;                                      \
+    (entry)->link.next = NULL;                                                \
+    (entry)->link.prev = NULL;                                                \
+  } while (0)
+
+#define LIST_REM_HEAD(list, link)                                             \
+  do {                                                                        \
+    __typeof__((list)->head) _rem = (list)->head;                             \
+    LIST_REM_ENTRY(list, _rem, link);                                         \
+  } while (0)
+
+#define LIST_REM_TAIL(list, link)                                             \
+  do {                                                                        \
+    __typeof__((list)->tail) _rem = (list)->tail;                             \
+    LIST_REM_ENTRY(list, _rem, link);                                         \
+  } while (0)
+
+#define LIST_INSERT_BEFORE(list, before, entry, link)                         \
+  do {                                                                        \
+    (entry)->link.next = (before);                                            \
+    (entry)->link.prev = (before)->link.prev;                                 \
+    if ((before)->link.prev != NULL)                                          \
+      (before)->link.prev->link.next = (entry);                               \
+    else                                                                      \
+      (list)->head = (entry);                                                 \
+    (before)->link.prev = (entry);                                            \
+  } while (0)
+
+#define LIST_INSERT_AFTER(list, after, entry, link)                           \
+  do {                                                                        \
+    (entry)->link.prev = (after);                                             \
+    (entry)->link.next = (after)->link.next;                                  \
+    if ((after)->link.next != NULL)                                           \
+      (after)->link.next->link.prev = (entry);                                \
+    else                                                                      \
+      (list)->tail = (entry);                                                 \
+    (after)->link.next = (entry);                                             \
+  } while (0)
+
+#endif
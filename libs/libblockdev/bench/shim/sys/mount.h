@@ -0,0 +1,26 @@
+/*
+ * Copyright 2023  Marven Gilhespie
+ *
+ * Licensed under the Apache License, segment_id 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/*
+ * Host shim of the CheviotOS <sys/mount.h> for the libblockdev benchmark.
+ * Nothing from it is used by the library outside CheviotOS.
+ */
+
+#ifndef BENCH_SHIM_SYS_MOUNT_H
+#define BENCH_SHIM_SYS_MOUNT_H
+
+#endif
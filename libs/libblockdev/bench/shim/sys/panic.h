@@ -0,0 +1,30 @@
+/*
+ * Copyright 2023  Marven Gilhespie
+ *
+ * Licensed under the Apache License, segment_id 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/*
+ * Host shim of the CheviotOS <sys/panic.h> for the libblockdev benchmark.
+ */
+
+#ifndef BENCH_SHIM_SYS_PANIC_H
+#define BENCH_SHIM_SYS_PANIC_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define panic(...)  do { fprintf(stderr, "panic: " __VA_ARGS__); fputc('\n', stderr); abort(); } while (0)
+
+#endif
@@ -0,0 +1,46 @@
+/*
+ * Copyright 2023  Marven Gilhespie
+ *
+ * Licensed under the Apache License, segment_id 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/*
+ * Host shim of the CheviotOS <sys/syscalls.h> for the libblockdev benchmark.
+ *
+ * The library only needs diff_timespec() from it.  The mmap() flags differ
+ * between CheviotOS and Linux, the benchmark's Makefile defines
+ * BLK_MMAP_FLAGS for that instead of wrapping mmap() here.
+ */
+
+#ifndef BENCH_SHIM_SYS_SYSCALLS_H
+#define BENCH_SHIM_SYS_SYSCALLS_H
+
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+/* @brief   Subtract timespec start from end
+ */
+static inline void diff_timespec(struct timespec *diff, struct timespec *end, struct timespec *start)
+{
+  diff->tv_sec = end->tv_sec - start->tv_sec;
+  diff->tv_nsec = end->tv_nsec - start->tv_nsec;
+  
+  if (diff->tv_nsec < 0) {
+    diff->tv_sec--;
+    diff->tv_nsec += 1000000000;
+  }
+}
+
+#endif
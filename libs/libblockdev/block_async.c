@@ -0,0 +1,324 @@
+/*
+ * Copyright 2023  Marven Gilhespie
+ *
+ * Licensed under the Apache License, segment_id 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/* Asynchronous requests for the block cache.
+ *
+ * set_block_cache_async() starts an I/O worker thread that services queued
+ * requests so that a caller can overlap the latency of the media with other
+ * work.  prefetch_blocks() queues a range of blocks to be read into the
+ * cache and returns immediately.  get_block_async() queues a get_block() of
+ * a single block and completes it by calling a callback from the worker,
+ * or by the caller polling block_async_done() or blocking in
+ * wait_block_async().
+ *
+ * get_block_async() requests are serviced before prefetches, in the order
+ * they were queued.  Prefetching is only a hint, a prefetch that does not
+ * fit in the queue is dropped.
+ *
+ * The async_lock protects the queues and the done flag of requests.  It is
+ * never held while taking another lock of the cache.
+ */
+
+#define LOG_LEVEL_ERROR
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/blockdev.h>
+#include <sys/panic.h>
+#include <sys/debug.h>
+#include "block_cache_priv.h"
+
+
+static void *async_worker(void *arg);
+static void complete_async(struct block_cache *cache, struct blk_async *req);
+
+
+/* @brief   Start or stop the I/O worker of the cache
+ *
+ * @param   cache, the cache to configure
+ * @param   async, true to start the worker, false to stop it
+ * @return  0 on success, negative errno on failure
+ *
+ * Starting the worker makes the cache concurrent, see
+ * set_block_cache_concurrent().  Stopping it waits for queued requests to
+ * complete.
+ */
+int set_block_cache_async(struct block_cache *cache, bool async)
+{
+  if (async == cache->async) {
+    return 0;
+  }
+  
+  if (async == true) {
+    cache->concurrent = true;
+    cache->async_exit = false;
+    
+    if (pthread_create(&cache->async_thread, NULL, async_worker, cache) != 0) {
+      log_error("libblockdev: failed to start I/O worker");
+      return -ENOMEM;
+    }
+    
+    cache->async = true;
+    return 0;
+  }
+  
+  pthread_mutex_lock(&cache->async_lock);
+  cache->async_exit = true;
+  pthread_cond_signal(&cache->async_cond);
+  pthread_mutex_unlock(&cache->async_lock);
+
+  pthread_join(cache->async_thread, NULL);
+  cache->async = false;
+  return 0;
+}
+
+
+/* @brief   Queue a range of blocks to be read into the cache
+ *
+ * @param   cache, the cache to read blocks into
+ * @param   start_block, first block of the range
+ * @param   count, number of blocks, limited to half the cache
+ * @return  0 if queued, -EAGAIN if the queue is full or -EINVAL if the
+ *          I/O worker is not running
+ *
+ * Blocks of the range that are already cached are not read again.  Does not
+ * wait for the blocks to be read.
+ */
+int prefetch_blocks(struct block_cache *cache, off64_t start_block, int count)
+{
+  struct blk_prefetch *pf;
+  
+  if (cache->async == false || count <= 0) {
+    return -EINVAL;
+  }
+  
+  if (count > cache->buf_cnt / 2) {
+    count = cache->buf_cnt / 2;
+  }
+  
+  trace_op(cache, BLK_TRACE_PREFETCH, start_block, count, 0);
+  
+  pthread_mutex_lock(&cache->async_lock);
+  
+  if (cache->prefetch_cnt == BLK_PREFETCH_QUEUE_SZ) {
+    pthread_mutex_unlock(&cache->async_lock);
+    return -EAGAIN;
+  }
+  
+  pf = &cache->prefetch_queue[(cache->prefetch_head + cache->prefetch_cnt) % BLK_PREFETCH_QUEUE_SZ];
+  pf->start_block = start_block;
+  pf->count = count;
+  cache->prefetch_cnt++;
+  
+  pthread_cond_signal(&cache->async_cond);
+  pthread_mutex_unlock(&cache->async_lock);
+  return 0;
+}
+
+
+/* @brief   Queue a request to get a block
+ *
+ * @param   cache, the cache the block belongs to
+ * @param   req, request with the block, opt and optional callback filled in
+ * @return  0 on success
+ *
+ * When the block has been got the request's buf field is set and the block
+ * is in use by the caller, who must release it with put_block().  The
+ * callback, if any, is then called from the I/O worker before the request
+ * is marked as done.
+ *
+ * If the I/O worker is not running the request is completed before
+ * returning.  A block that is in use by the caller must not be requested,
+ * the worker would wait for it to be released.
+ */
+int get_block_async(struct block_cache *cache, struct blk_async *req)
+{
+  req->buf = NULL;
+  req->done = false;
+  
+  if (cache->async == false) {
+    req->buf = get_block(cache, req->block, req->opt);
+    complete_async(cache, req);
+    return 0;
+  }
+  
+  pthread_mutex_lock(&cache->async_lock);
+  LIST_ADD_TAIL(&cache->async_list, req, link);
+  pthread_cond_signal(&cache->async_cond);
+  pthread_mutex_unlock(&cache->async_lock);
+  return 0;
+}
+
+
+/* @brief   Check if an asynchronous request has completed
+ *
+ * @return  true if the request's buf is ready for use
+ */
+bool block_async_done(struct block_cache *cache, struct blk_async *req)
+{
+  bool done;
+  
+  if (cache->async == false) {
+    return req->done;
+  }
+  
+  pthread_mutex_lock(&cache->async_lock);
+  done = req->done;
+  pthread_mutex_unlock(&cache->async_lock);
+  return done;
+}
+
+
+/* @brief   Wait for an asynchronous request to complete
+ *
+ * @return  the requested block, in use by the caller
+ */
+struct buf *wait_block_async(struct block_cache *cache, struct blk_async *req)
+{
+  if (cache->async == false) {
+    return req->buf;
+  }
+  
+  pthread_mutex_lock(&cache->async_lock);
+  
+  while (req->done == false) {
+    pthread_cond_wait(&cache->async_done_cond, &cache->async_lock);
+  }
+  
+  pthread_mutex_unlock(&cache->async_lock);
+  return req->buf;
+}
+
+
+/* @brief   Initialize the request queues of a cache
+ */
+void init_async(struct block_cache *cache)
+{
+  cache->async = false;
+  cache->async_exit = false;
+  pthread_mutex_init(&cache->async_lock, NULL);
+  pthread_cond_init(&cache->async_cond, NULL);
+  pthread_cond_init(&cache->async_done_cond, NULL);
+  LIST_INIT(&cache->async_list);
+  cache->prefetch_head = 0;
+  cache->prefetch_cnt = 0;
+  cache->prewarm_block = NULL;
+  cache->prewarm_cnt = 0;
+  cache->prewarm_pos = 0;
+}
+
+
+/* @brief   Stop the I/O worker and free the request queues of a cache
+ */
+void free_async(struct block_cache *cache)
+{
+  set_block_cache_async(cache, false);
+  pthread_cond_destroy(&cache->async_done_cond);
+  pthread_cond_destroy(&cache->async_cond);
+  pthread_mutex_destroy(&cache->async_lock);
+  free(cache->prewarm_block);
+}
+
+
+/* @brief   Main loop of the I/O worker thread
+ *
+ * Services get_block_async() requests, then prefetches, until asked to exit
+ * with both queues empty.  A prewarm is read a run at a time while the
+ * queues are empty, it is abandoned if the worker is stopped.
+ */
+static void *async_worker(void *arg)
+{
+  struct block_cache *cache = arg;
+  struct blk_async *req;
+  struct blk_prefetch pf;
+  off64_t start_block;
+  int issued;
+  int count;
+  int run;
+  
+  pthread_mutex_lock(&cache->async_lock);
+  
+  for (;;) {
+    if ((req = LIST_HEAD(&cache->async_list)) != NULL) {
+      LIST_REM_HEAD(&cache->async_list, link);
+      pthread_mutex_unlock(&cache->async_lock);
+      
+      req->buf = get_block(cache, req->block, req->opt);
+      complete_async(cache, req);
+
+      pthread_mutex_lock(&cache->async_lock);
+    } else if (cache->prefetch_cnt > 0) {
+      pf = cache->prefetch_queue[cache->prefetch_head];
+      cache->prefetch_head = (cache->prefetch_head + 1) % BLK_PREFETCH_QUEUE_SZ;
+      cache->prefetch_cnt--;
+      pthread_mutex_unlock(&cache->async_lock);
+      
+      issued = read_block_range(cache, pf.start_block, pf.count, NULL, BLK_RA_STREAM_CNT);
+
+      lock_cache(cache);
+      cache->stats.ra_issued_cnt += issued;
+      unlock_cache(cache);
+
+      pthread_mutex_lock(&cache->async_lock);
+    } else if (cache->async_exit == true) {
+      break;
+    } else if (cache->prewarm_pos < cache->prewarm_cnt) {
+      run = prewarm_run(&cache->prewarm_block[cache->prewarm_pos],
+                        cache->prewarm_cnt - cache->prewarm_pos);
+      start_block = cache->prewarm_block[cache->prewarm_pos];
+      count = prewarm_run_blocks(&cache->prewarm_block[cache->prewarm_pos], run);
+      cache->prewarm_pos += run;
+      pthread_mutex_unlock(&cache->async_lock);
+      
+      issued = read_block_range(cache, start_block, count, NULL, BLK_RA_STREAM_CNT);
+
+      lock_cache(cache);
+      cache->stats.ra_issued_cnt += issued;
+      unlock_cache(cache);
+
+      pthread_mutex_lock(&cache->async_lock);
+    } else {
+      pthread_cond_wait(&cache->async_cond, &cache->async_lock);
+    }
+  }
+  
+  pthread_mutex_unlock(&cache->async_lock);
+  return NULL;
+}
+
+
+/* @brief   Call a completed request's callback and mark it as done
+ */
+static void complete_async(struct block_cache *cache, struct blk_async *req)
+{
+  if (req->callback != NULL) {
+    req->callback(cache, req);
+  }
+  
+  if (cache->async == false) {
+    req->done = true;
+    return;
+  }
+  
+  pthread_mutex_lock(&cache->async_lock);
+  req->done = true;
+  pthread_cond_broadcast(&cache->async_done_cond);
+  pthread_mutex_unlock(&cache->async_lock);
+}
+
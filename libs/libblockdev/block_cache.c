@@ -29,6 +29,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <sys/blockdev.h>
 #include <sys/mount.h>
 #include <sys/panic.h>
@@ -37,6 +38,11 @@
 #include <sys/debug.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include "block_cache_priv.h"
+
+
+static struct buf *reuse_buf(struct block_cache *cache);
 
 
 /* @brief   Initialize the block cache
@@ -44,6 +50,8 @@
  * @param   dev_fd, handle to block device to read and write from
  * @param   buf_cnt, number of blocks to hold in cache
  * @param   block_size, size of blocks used by file system
+ * @param   read_ahead_blocks, maximum number of blocks get_block_readahead
+ *          reads at a time, limited to half of buf_cnt
  * @return  pointer to block_cache structure or NULL on failure
  */
 struct block_cache *init_block_cache(int dev_fd, int buf_cnt, size_t block_size, int read_ahead_blocks)
@@ -51,53 +59,20 @@ struct block_cache *init_block_cache(int dev_fd, int buf_cnt, size_t block_size,
   struct block_cache *cache;
   
   if (buf_cnt == 0 || block_size < 512) {
-		panic("bad params to init_block_cache, buf_cnt:%d blk_size:%d", buf_cnt, block_size);
+		panic("bad params to init_block_cache, buf_cnt:%d blk_size:%zu", buf_cnt, block_size);
 	}
 
   if (read_ahead_blocks > buf_cnt) {
     panic("read_ahead_blocks > buf_cnt");    
   }
 	
-	if (read_ahead_blocks < 1) {
-	  read_ahead_blocks = 1;
-	}
-	
-	if (read_ahead_blocks > 8) {
-	  read_ahead_blocks = 8;
-	}
-	
-	if ((cache = malloc(sizeof (struct block_cache))) != NULL) {
-		if ((cache->buf_table = mmap(NULL, buf_cnt * sizeof (struct buf), PROT_READ | PROT_WRITE, 0, -1, 0)) != MAP_FAILED) {
-			if ((cache->mem_pool = mmap(NULL, buf_cnt * block_size, PROT_READ | PROT_WRITE, 0, -1, 0)) != MAP_FAILED) {			
-				cache->dev_fd = dev_fd;
-				
-				
-				cache->buf_cnt = buf_cnt;
-				cache->avail_buf_cnt = buf_cnt;
-				cache->block_size = block_size;
-
-        cache->read_ahead_blocks = read_ahead_blocks;
-				
-				LIST_INIT (&cache->lru_list);
-												
-				for (int t=0; t < BUF_HASH_CNT; t++) {
-					LIST_INIT (&cache->hash_list[t]);
-				}
-					
-				for (int t=0; t < buf_cnt; t++) {
-					cache->buf_table[t].block = 0;
-					cache->buf_table[t].data = (uint8_t *)cache->mem_pool + (t * block_size);
-					cache->buf_table[t].valid = false;
-					cache->buf_table[t].dirty = false;
-					cache->buf_table[t].in_use = true;
-													
-					LIST_ADD_TAIL(&cache->lru_list, &cache->buf_table[t], lru_link);
-				}
-				
-				return cache;
-			}
-		}
-	}
+  if ((cache = alloc_cache(dev_fd, buf_cnt, block_size, read_ahead_blocks)) != NULL) {
+    if (map_chunks(cache, buf_cnt) == 0) {
+      return cache;
+    }
+    
+    destroy_cache(cache);
+  }
 
   log_error("libblockdev: failed to initialize cache");	
 	return NULL;
@@ -106,15 +81,159 @@ struct block_cache *init_block_cache(int dev_fd, int buf_cnt, size_t block_size,
 
 /* @brief   Free the resources associated with this block cache
  *
+ * Any dirty blocks held in write-back mode are written to disk first.
+ * No other thread may be using the cache.
  */
 void free_cache(struct block_cache *cache)
 {
-	munmap(cache->mem_pool, cache->buf_cnt * cache->block_size);
-	munmap(cache->buf_table, cache->buf_cnt * sizeof (struct buf));
+  free_async(cache);
+  sync_block_cache(cache);
+  destroy_cache(cache);
+}
+
+
+/* @brief   Allocate and initialize a cache with no bufs
+ *
+ * @param   dev_fd, handle to block device to read and write from
+ * @param   buf_cnt, number of bufs the cache is expected to hold
+ * @param   block_size, size of blocks used by file system
+ * @param   read_ahead_blocks, as passed to init_block_cache()
+ * @return  the cache or NULL on failure
+ *
+ * Bufs are then added to the cache in chunks with add_chunk().
+ */
+struct block_cache *alloc_cache(int dev_fd, int buf_cnt, size_t block_size, int read_ahead_blocks)
+{
+  struct block_cache *cache;
+  
+	if ((cache = malloc(sizeof (struct block_cache))) == NULL) {
+	  return NULL;
+	}
+
+  if (init_index(cache, buf_cnt) != 0) {
+    free(cache);
+    return NULL;
+  }
+  
+  cache->dev_fd = dev_fd;
+  cache->block_size = block_size;
+  cache->chunk = NULL;
+  cache->chunk_cnt = 0;
+  cache->chunk_max = 0;
+  cache->buf_cnt = 0;
+  cache->avail_buf_cnt = 0;
+  cache->extent_chunk = 0;
+  cache->extent_pos = 0;
+  cache->wb_bufs = NULL;
+  cache->wb_bufs_max = 0;
+  cache->direct_threshold = BLK_DIRECT_THRESHOLD;
+
+  cache->read_ahead_max = read_ahead_blocks;
+  cache->read_ahead_blocks = 1;
+  init_ra_streams(cache);
+  cache->vtier = NULL;
+  cache->discard_fn = NULL;
+  cache->discard_arg = NULL;
+  cache->discard_ext_cnt = 0;
+  block_cache_reset_stats(cache);
+  cache->prof_read = NULL;
+  cache->prof_write = NULL;
+  cache->trace_fn = NULL;
+  cache->trace_arg = NULL;
+
+  cache->write_policy = BLK_WRITE_THROUGH;
+  cache->dirty_cnt = 0;
+  cache->dirty_high_watermark = 0;
+  cache->dirty_low_watermark = 0;
+  cache->dirty_watermark_auto = false;
+  cache->barrier_epoch = 0;
+  cache->last_write_epoch = 0;
+  cache->unsynced_writes = false;
+  cache->write_error = 0;
+
+  init_policy(cache);
+  LIST_INIT (&cache->dirty_list);
+
+  init_async(cache);
+
+  cache->concurrent = false;
+  pthread_mutex_init(&cache->lock, NULL);
+  pthread_mutex_init(&cache->write_lock, NULL);
+  init_io_queue(cache);
+  pthread_mutex_init(&cache->resize_lock, NULL);
+  cache->min_buf_cnt = 0;
+
+  for (int t=0; t < BLK_SHARD_CNT; t++) {
+    pthread_mutex_init(&cache->shard[t].lock, NULL);
+    pthread_cond_init(&cache->shard[t].cond, NULL);
+  }
+
+  cache->pool = NULL;
+  cache->pool_min_chunks = 0;
+  cache->pool_miss_cnt = 0;
+  cache->pool_cost_mark = 0;
+  cache->pool_cost = 0;
+  return cache;
+}
+
+
+/* @brief   Free a cache and its chunks without writing any dirty blocks
+ *
+ * Chunks drawn from a pool are returned to it.
+ */
+void destroy_cache(struct block_cache *cache)
+{
+  if (cache->pool != NULL) {
+    detach_pool(cache);
+  }
+  
+  for (int t=0; t < cache->chunk_cnt; t++) {
+    free_chunk(cache, cache->chunk[t]);
+  }
+  
+  for (int t=0; t < BLK_SHARD_CNT; t++) {
+    pthread_mutex_destroy(&cache->shard[t].lock);
+    pthread_cond_destroy(&cache->shard[t].cond);
+  }
+  
+  pthread_mutex_destroy(&cache->resize_lock);
+  free_io_queue(cache);
+  pthread_mutex_destroy(&cache->write_lock);
+  pthread_mutex_destroy(&cache->lock);
+  
+	free_victim_tier(cache);
+	free_policy(cache);
+	free_index(cache);
+	free(cache->chunk);
+	free(cache->wb_bufs);
 	free(cache);
 }
 
 
+/* @brief   Allow the cache to be used by multiple threads
+ *
+ * @param   cache, the cache to configure
+ * @param   concurrent, true to take locks on every cache operation
+ * @return  0 on success, -EBUSY if the I/O worker is running or the cache
+ *          draws its bufs from a pool
+ *
+ * Must be called before any other thread uses the cache.  In a concurrent
+ * cache a thread that gets a block that is in use by another thread waits
+ * for it to be released instead of panicking.  A dirty block in use may
+ * have its contents written by a flush in another thread to keep the order
+ * of a barrier, it stays dirty and is written again once released.
+ */
+int set_block_cache_concurrent(struct block_cache *cache, bool concurrent)
+{
+  if (concurrent == false && (cache->async == true || cache->pool != NULL)) {
+    return -EBUSY;
+  }
+  
+  cache->concurrent = concurrent;
+  return 0;
+}
+
+
 /* @brief   Get a block from the cache, reading it from media if necessary
  *
  * @param   cache, the cache the block belongs to 
@@ -126,6 +245,8 @@ void free_cache(struct block_cache *cache)
  *                        full block of data for writing or will clear the
  *                        entire buffer of the block.
  *          BLK_CLEAR   = allocate the buffer and clear it. Do not read from disk.
+ *          The option can be or'd with BLK_HINT_DATA if the block holds
+ *          file data, so that it does not displace metadata in the cache.
  * @return  pointer to a buf structure or NULL on failure.
  *
  * TODO: Limit block number to partition bounds
@@ -133,59 +254,20 @@ void free_cache(struct block_cache *cache)
 struct buf *get_block(struct block_cache *cache, off64_t block, int opt)
 {
 	struct buf *buf;
-	uint32_t hash;
-	int rc;
-
-	hash = block % BUF_HASH_CNT;
-	buf = LIST_HEAD (&cache->hash_list[hash]);
-
-	while (buf != NULL) {		
-		if (buf->block == block) {			
-			break;
-		}
-		
-		buf = LIST_NEXT (buf, hash_link);
-	}
+	bool hit;
+
+  trace_op(cache, BLK_TRACE_GET, block, 1, opt);
+
+  buf = acquire_buf(cache, block, opt & BLK_HINT_MASK, true, &hit);
 						
-	if (buf != NULL) {
-	  if (buf->in_use == true) {
-	    panic("libblockdev: get_block %u, in use", (uint32_t)buf->block);
-	  }
-		LIST_REM_ENTRY (&cache->lru_list, buf, lru_link);
-		buf->valid = true;
-	  buf->in_use = true;
+	if (hit == true) {
 		return buf;
   }
   
-	buf = LIST_HEAD (&cache->lru_list);
-	
-	if (buf == NULL) {
-	  panic("libblockdev: get_block no available bufs");
-	}
-
-	LIST_REM_HEAD (&cache->lru_list, lru_link);
-  			
-  if (buf->valid == true) {
-	  hash = buf->block % BUF_HASH_CNT;
-	  LIST_REM_ENTRY (&cache->hash_list[hash], buf, hash_link);
-  }
-  
-	buf->block = block;
-	buf->dirty = false;
-	buf->valid = true;
-	buf->in_use = true;
+  opt &= BLK_OPT_MASK;
   
-	hash = buf->block % BUF_HASH_CNT;
-	LIST_ADD_HEAD (&cache->hash_list[hash], buf, hash_link);
-
   if (opt == BLK_READ) {
-    lseek64(cache->dev_fd, (uint64_t)block * cache->block_size, SEEK_SET);
-    rc = read(cache->dev_fd, buf->data, cache->block_size);
-
-		if (rc != cache->block_size) {
-			panic("libblockdev: get_block read rc:%d != sz:%d", rc, cache->block_size);
-		}
-
+    read_blocks(cache, &buf, 1);
   } else if (opt == BLK_NO_READ) {
     /* Returning a buf without reading its contents and without clearing
      * it first. */
@@ -199,185 +281,379 @@ struct buf *get_block(struct block_cache *cache, off64_t block, int opt)
 }
 
 
-/* @brief   Get a block and read-ahead additional blocks
- *
- * Gets a block and reads ahead in anticipation that consecutive blocks will
- * be needed soon.  If the start block is already in the cache, no further reads
- * are done.
+/* @brief   Release a cached block, depending oo flags write block if dirty
  *
- * TODO: Limit block numbers to partition bounds
+ * @param   cache, the cache the block belongs to 
+ * @param   buf, cached block to release
  */
-struct buf *get_block_readahead(struct block_cache *cache, off64_t start_block)
+void put_block(struct block_cache *cache, struct buf *buf)
 {
-  off64_t block;
-	struct buf *buf[8];
-	uint32_t hash;
-	int rc;
-
-  int count = cache->read_ahead_blocks;
-
-  for (int t=0; t<count; t++) {
-  	block = start_block + t;  	
-  	hash = block % BUF_HASH_CNT;
-	  buf[t] = LIST_HEAD (&cache->hash_list[hash]);
-
-	  while (buf[t] != NULL) {		
-		  if (buf[t]->block == block) {
-			  break;
-		  }
-		  
-		  buf[t] = LIST_NEXT (buf[t], hash_link);
-	  }
-	  
-    if (t == 0 && buf[0] != NULL) {
-      if (buf[0]->in_use == true) {
-        panic("buf[0] is in use, block %u", (uint32_t)start_block);
-      }
-      
- 		  LIST_REM_ENTRY (&cache->lru_list, buf[0], lru_link);
+  trace_op(cache, BLK_TRACE_PUT, buf->block, 1, (buf->dirty == true) ? 1 : 0);
+  put_buf(cache, buf);
+}
 
-	    buf[0]->dirty = false;
-		  buf[0]->valid = true;
-	    buf[0]->in_use = true;
-      cache->avail_buf_cnt--;
 
-      return buf[0];
-    }
-    
-	  if (buf[t] != NULL) {
-	    if(buf[t]->valid == true) {
-	      buf[t] = NULL;
-	    } else {
-		    LIST_REM_ENTRY (&cache->lru_list, buf[t], lru_link);
-	      buf[t]->dirty = false;
-		    buf[t]->valid = true;
-	      buf[t]->in_use = true;
-	    }
-	  } else {
-		  buf[t] = LIST_HEAD (&cache->lru_list);
-
-		  if (buf[t] == NULL) {
-			  panic("libblockdev: get_block_readahead, no bufs on free or lru list");
-		  }
-		  
-		  // Put block should immediately write buffer, so it should never be dirty.
-		  assert(buf[t]->dirty == false);
-
-		  LIST_REM_HEAD (&cache->lru_list, lru_link);
-
-      if(buf[t]->valid == true) {
-  		  hash = buf[t]->block % BUF_HASH_CNT;
-  		  LIST_REM_ENTRY (&cache->hash_list[hash], buf[t], hash_link);
+/* @brief   Release a buf, as put_block() without tracing
+ */
+void put_buf(struct block_cache *cache, struct buf *buf)
+{
+  struct blk_shard *shard;
+  bool redirty = false;
+  bool flush;
+  
+	if (buf->in_use == false) {
+		panic("libblockdev: put_block of 'not in use' blk:%u, buf:%p", 
+		          (uint32_t)buf->block, (void *)buf);
+	}
+
+  if (block_isclean(buf) == false) {  
+    if (cache->write_policy == BLK_WRITE_BACK) {
+      lock_cache(cache);
+      
+      if (buf->dirty == true && buf->on_dirty_list == false) {
+        LIST_ADD_TAIL (&cache->dirty_list, buf, dirty_link);
+        buf->on_dirty_list = true;
+        buf->dirty_epoch = cache->barrier_epoch;
+        cache->dirty_cnt++;
+      } else if (buf->on_dirty_list == true && buf->marked_dirty == true
+                  && buf->dirty_epoch != cache->barrier_epoch) {
+        redirty = true;
       }
-	  
-	    buf[t]->block = block;
-	    buf[t]->dirty = false;
-	    buf[t]->valid = false;
-      buf[t]->in_use = true;
-	  }
-  }  
 
-  for (int t=0; t<count; t++) {
-    if (buf[t] == NULL) {
-      continue;
+      unlock_cache(cache);
+      
+      if (redirty == true) {
+        redirty_buf(cache, buf);
+      }
+    } else {
+      writeback_buf(cache, buf);
     }
-        
-    lseek64(cache->dev_fd, (uint64_t)buf[t]->block * cache->block_size, SEEK_SET);
-    rc = read(cache->dev_fd, buf[t]->data, cache->block_size);
+  }
+  
+  buf->marked_dirty = false;
+  
+  shard = buf_shard(cache, buf->block);
+  lock_shard(cache, shard);
+  lock_cache(cache);
+	buf->in_use = false;  
+	policy_insert(cache, buf);
+	cache->avail_buf_cnt++;
+  flush = (cache->dirty_cnt > cache->dirty_high_watermark);
+  unlock_cache(cache);
+  wake_shard(cache, shard);
+  unlock_shard(cache, shard);
+
+  if (flush == true) {
+    flush_dirty_bufs(cache, cache->dirty_low_watermark);
+  }
+}
 
-	  if (rc != cache->block_size) {
-		  panic("libblockdev: get_block_readahead read rc:%d != sz:%d", rc, cache->block_size);
-	  }
 
-    hash = buf[t]->block % BUF_HASH_CNT;
-    LIST_ADD_HEAD (&cache->hash_list[hash], buf[t], hash_link);
-    buf[t]->valid = true;
-	    
-	  cache->avail_buf_cnt--;
+/* @brief   Remove block from cache but do not flush it to disk
+ *
+ * @param   block, block to invalidate
+ *
+ * If the block is in use it remains with the caller until put_block().  If
+ * a discard function is set the block is queued to be discarded, see
+ * set_block_cache_discard().
+ */
+void invalidate_block(struct block_cache *cache, off64_t block)
+{
+  trace_op(cache, BLK_TRACE_INVALIDATE, block, 1, 0);
+  drop_block(cache, block);
+  queue_discard(cache, block, 1);
+}
+
+
+/* @brief   Remove a block from the cache, as invalidate_block() without tracing
+ *
+ * @param   cache, the cache the block belongs to
+ * @param   block, block to remove, also dropped from the victim tier
+ */
+void drop_block(struct block_cache *cache, off64_t block)
+{
+  struct blk_shard *shard;
+  struct buf *buf;
+  
+  shard = buf_shard(cache, block);
+  lock_shard(cache, shard);
+  buf = find_buf(cache, block);
+  
+  if (buf == NULL) {
+    victim_invalidate(cache, block);
+    unlock_shard(cache, shard);
+    return;
+  }
+
+  assert(buf->valid == true);
+
+  lock_cache(cache);
+  index_remove(cache, buf);
+  victim_invalidate(cache, block);
+  
+  if (buf->on_dirty_list) {
+    LIST_REM_ENTRY (&cache->dirty_list, buf, dirty_link);
+    buf->on_dirty_list = false;
+    cache->dirty_cnt--;
   }
+  
+  buf->dirty = false;
+  buf->prefetched = false;
+  buf->valid = false;
+
+  /* A buf that is in use is put on the free list when it is released, one
+   * that is busy stays on its queue until it is reused.
+   */
+  if (buf->in_use == false && buf->busy == false) {
+    policy_remove(cache, buf);
+    policy_insert(cache, buf);
+  }
+  
+  unlock_cache(cache);
+  unlock_shard(cache, shard);
+}
+
+
+/* @brief   Find a block in the cache or assign a buf to it
+ *
+ * @param   cache, the cache the block belongs to
+ * @param   block, block to find
+ * @param   flags, BLK_HINT_* flags of the caller
+ * @param   wait, if true and the block is in use by another thread wait for
+ *          it to be released.  If false return NULL if the block is cached,
+ *          used to read ahead, which is not counted as a hit or miss.
+ * @param   hit, set to true if the block was found in the cache
+ * @return  buf in use by the caller, or NULL if wait is false and the block
+ *          is cached.  On a miss the buf is assigned to the block and it is
+ *          up to the caller to read or initialize its data.
+ */
+struct buf *acquire_buf(struct block_cache *cache, off64_t block, int flags, bool wait, bool *hit)
+{
+  struct blk_shard *shard;
+	struct buf *buf;
 
-  for (int t=1;t<count; t++) {
-    if (buf[t] != NULL) {
-      put_block(cache, buf[t]);
+  shard = buf_shard(cache, block);
+  
+  for (;;) {
+    lock_shard(cache, shard);
+    buf = find_buf(cache, block);
+    
+    if (buf != NULL) {
+      *hit = true;
+      
+      if (wait == false) {
+        unlock_shard(cache, shard);
+        return NULL;
+      }
+      
+      lock_cache(cache);
+      
+      if (buf->in_use == true || buf->busy == true) {
+        unlock_cache(cache);
+        wait_shard(cache, shard, buf);
+        unlock_shard(cache, shard);
+        continue;
+      }
+      
+      policy_use(cache, buf);
+      ra_note_hit(cache, buf);
+      buf->flags = flags;
+      buf->in_use = true;
+      cache->avail_buf_cnt--;
+      cache->stats.hit_cnt++;
+      unlock_cache(cache);
+      unlock_shard(cache, shard);
+      return buf;
+    }
+
+    unlock_shard(cache, shard);
+    
+    buf = reuse_buf(cache);
+
+    lock_shard(cache, shard);
+    
+    if (find_buf(cache, block) == NULL) {
+      break;
     }
+    
+    // Another thread assigned a buf to the block while this one was evicting 
+    unlock_shard(cache, shard);
+    lock_cache(cache);
+    buf->in_use = false;
+    policy_insert(cache, buf);
+    cache->avail_buf_cnt++;
+    unlock_cache(cache);
   }
   
+	buf->block = block;
+	buf->flags = flags;
+	buf->dirty = false;
+	buf->valid = true;
+	index_insert(cache, buf);
+	
+	lock_cache(cache);
+  policy_admit(cache, buf);
   
-  if (buf[0] == NULL) {
-    log_error("libblockdev: get_block returning NULL");
-    return NULL;
+  if (wait == true) {
+    cache->stats.miss_cnt++;
   }
   
-  return buf[0];
+  unlock_cache(cache);
+  unlock_shard(cache, shard);
+  
+  *hit = false;
+  return buf;
 }
 
 
-/* @brief   Release a cached block, depending oo flags write block if dirty
+/* @brief   Take a buf for reuse
  *
- * @param   cache, the cache the block belongs to 
- * @param   buf, cached block to release
+ * A pooled cache first gives its pool the chance to add bufs to it.  A free
+ * buf is used if there is one, otherwise the replacement policy chooses a
+ * victim.
  *
- * TODO: File blocks shouldn't be reused again soon as they will be cached
- * by the VFS.  We don't want them to expunge system blocks from the cache.
+ * @param   cache, the cache to take a buf from
+ * @return  buf in use by the caller, with its valid field cleared
  */
-void put_block(struct block_cache *cache, struct buf *buf)
+static struct buf *reuse_buf(struct block_cache *cache)
 {
-	if (buf->in_use == false) {
-		panic("libblockdev: put_block of 'not in use' blk:%u, buf:%08x", 
-		          (uint32_t)buf->block, (uint32_t)buf);
+	struct buf *buf;
+	bool write;
+	
+  pool_note_miss(cache);
+  
+  lock_cache(cache);
+  buf = policy_victim(cache);
+	
+	if (buf == NULL) {
+	  panic("libblockdev: no available bufs");
 	}
 
-  if (block_isclean(buf) == false) {  
-    lseek64(cache->dev_fd, (uint64_t)buf->block * cache->block_size, SEEK_SET);
-		write(cache->dev_fd, buf->data, cache->block_size);
+  write = claim_victim(cache, buf);
+  unlock_cache(cache);
+  
+  evict_buf(cache, buf, write);
+  return buf;
+}
+
+
+/* @brief   Mark a buf taken off the policy queues as in use for reuse
+ *
+ * @param   cache, the cache the buf belongs to
+ * @param   buf, buf that is not in use or busy
+ * @return  true if the buf's block must be written before it is reused
+ *
+ * Called with the cache lock held.
+ */
+bool claim_victim(struct block_cache *cache, struct buf *buf)
+{
+  buf->in_use = true;
+  cache->avail_buf_cnt--;
+  
+  if (buf->valid == true) {
+    cache->stats.evict_cnt++;
   }
   
-  block_markclean(buf);
+  if (buf->prefetched == true) {
+    ra_note_evict(cache, buf);
+  }
+  
+  // A busy buf may have been claimed by a flush after it became the victim
+  return (buf->dirty == true || buf->busy == true);
+}
 
-	LIST_ADD_TAIL (&cache->lru_list, buf, lru_link);
-	buf->in_use = false;  
-	cache->avail_buf_cnt++;
+
+/* @brief   Evict the block held by a buf claimed with claim_victim()
+ *
+ * @param   cache, the cache the buf belongs to
+ * @param   buf, buf in use by the caller
+ * @param   write, value returned by claim_victim()
+ *
+ * A dirty block is written to disk and the buf is removed from the index.
+ * A clean block is offered to the victim tier.
+ */
+void evict_buf(struct block_cache *cache, struct buf *buf, bool write)
+{
+  struct blk_shard *shard;
+
+  if (write == true) {
+    writeback_buf(cache, buf);
+  }
+  
+  shard = buf_shard(cache, buf->block);
+  lock_shard(cache, shard);
+  			
+  if (buf->valid == true) {
+    if (buf->dirty == false) {
+      victim_store(cache, buf);
+    }
+    
+	  index_remove(cache, buf);
+	  buf->valid = false;
+	  wake_shard(cache, shard);
+  }
+
+  unlock_shard(cache, shard);
 }
 
 
-/* @brief   Remove block from cache but do not flush it to disk
+/* @brief   Read a run of consecutive blocks from the device
  *
- * @param   block, block to invalidate
+ * @param   cache, the cache the bufs belong to
+ * @param   bufs, array of bufs for consecutive blocks starting at bufs[0]->block
+ * @param   cnt, number of bufs in the array
+ *
+ * The run is read with as few readv calls as the BLK_MAX_IOV limit allows,
+ * each block being read directly into its buf's data.  Blocks held by the
+ * victim tier are loaded from it instead, splitting the run.
  */
-void invalidate_block(struct block_cache *cache, off64_t block)
+void read_blocks(struct block_cache *cache, struct buf **bufs, int cnt)
 {
-  struct buf *buf;
-  uint32_t hash;
+  struct iovec iov[BLK_MAX_IOV];
+  int iov_cnt;
+  int next;
+  ssize_t rc;
   
-	hash = block % BUF_HASH_CNT;
-	buf = LIST_HEAD (&cache->hash_list[hash]);
-		
-	while (buf != NULL) {		
-		if (buf->block == block) {
-      // Remove from cache
-      assert(buf->valid == true);
+  for (int t = 0; t < cnt; t = next) {
+    iov_cnt = 0;
+    
+    for (next = t; next < cnt && iov_cnt < BLK_MAX_IOV; next++) {
+      if (victim_load(cache, bufs[next]) == true) {
+        next++;
+        break;
+      }
       
-	    LIST_REM_ENTRY (&cache->lru_list, buf, lru_link);
-	    LIST_REM_ENTRY (&cache->hash_list[hash], buf, hash_link);
-	    LIST_ADD_HEAD (&cache->lru_list, buf, lru_link);
-      buf->dirty = false;
-      buf->in_use = false;
-      buf->valid = false;
-	    return;
-		}
-		
-		buf = LIST_NEXT (buf, hash_link);
-	}
+      iov[iov_cnt].iov_base = bufs[next]->data;
+      iov[iov_cnt].iov_len = cache->block_size;
+      iov_cnt++;
+    }
+
+    if (iov_cnt == 0) {
+      continue;
+    }
+    
+    rc = dev_readv(cache, bufs[t]->block, iov, iov_cnt);
+
+	  if (rc != (ssize_t)(iov_cnt * cache->block_size)) {
+		  panic("libblockdev: read_blocks rc:%d != sz:%zu", (int)rc, iov_cnt * cache->block_size);
+	  }
+  }
 }
 
 
-/* @brief   Mark as block in the cache as dirty, write out in put_block
+/* @brief   Mark as block in the cache as dirty
+ *
+ * The block is written out in put_block, or in write-back mode when it is
+ * evicted or synced.  In write-back mode a block still dirty from before a
+ * barrier joins the current epoch when put, after the dirty blocks of older
+ * epochs have been written.
  *
  * @param   buf, buffer to mark as dirty
  */
 void block_markdirty(struct buf *bp)
 {
   bp->dirty = true;  
+  bp->marked_dirty = true;
 }
 
 
@@ -0,0 +1,262 @@
+/*
+ * Copyright 2023  Marven Gilhespie
+ *
+ * Licensed under the Apache License, segment_id 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef BLOCK_CACHE_PRIV_H
+#define BLOCK_CACHE_PRIV_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/blockdev.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <sys/panic.h>
+
+
+/*
+ * Flags passed to mmap() to allocate the memory of chunks and pools.  CheviotOS
+ * returns anonymous memory with no flags set, a build of the library for
+ * another host defines this as MAP_PRIVATE | MAP_ANONYMOUS.
+ */
+#ifndef BLK_MMAP_FLAGS
+#define BLK_MMAP_FLAGS  0
+#endif
+
+
+/*
+ * Locking in a concurrent cache
+ *
+ * Locks are only taken once set_block_cache_concurrent() has been called, a
+ * single threaded file system server pays nothing for them.  The order in
+ * which locks are acquired is:
+ *
+ *   resize_lock or pool->lock  ->  cache->write_lock  ->  shard->lock  ->  cache->lock
+ *
+ * The io_lock is only held around a use of the I/O request queue, the
+ * lock of the victim tier around a use of the tier.  The
+ * async_lock protecting the I/O worker's queues is never held while taking
+ * another lock.
+ *
+ * Device reads and writes are done with no locks held other than the
+ * write_lock.  A buf being read is in_use by the reading thread, a buf
+ * being written by a flush is busy.  Any change that could let a waiting
+ * thread make progress is followed by wake_shard() on the buf's shard,
+ * with the shard lock held.
+ */
+
+/* @brief   Mix the bits of a block number
+ *
+ * The finalizer of MurmurHash3, every bit of the block number affects every
+ * bit of the hash so that neither consecutive nor strided block numbers
+ * collide.  The low bits select an index slot, the high bits a shard.
+ */
+static inline uint64_t block_hash(off64_t block)
+{
+  uint64_t h = (uint64_t)block;
+  
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static inline struct blk_shard *buf_shard(struct block_cache *cache, off64_t block)
+{
+  return &cache->shard[(block_hash(block) >> 32) % BLK_SHARD_CNT];
+}
+
+static inline void trace_op(struct block_cache *cache, int op, off64_t block, int count, int opt)
+{
+  struct blk_trace_rec rec;
+  
+  if (cache->trace_fn != NULL) {
+    rec.block = block;
+    rec.count = count;
+    rec.op = op;
+    rec.opt = opt;
+    cache->trace_fn(cache->trace_arg, &rec);
+  }
+}
+
+static inline void lock_cache(struct block_cache *cache)
+{
+  if (cache->concurrent) {
+    pthread_mutex_lock(&cache->lock);
+  }
+}
+
+static inline void unlock_cache(struct block_cache *cache)
+{
+  if (cache->concurrent) {
+    pthread_mutex_unlock(&cache->lock);
+  }
+}
+
+static inline void lock_shard(struct block_cache *cache, struct blk_shard *shard)
+{
+  if (cache->concurrent) {
+    pthread_mutex_lock(&shard->lock);
+  }
+}
+
+static inline void unlock_shard(struct block_cache *cache, struct blk_shard *shard)
+{
+  if (cache->concurrent) {
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
+
+static inline void wake_shard(struct block_cache *cache, struct blk_shard *shard)
+{
+  if (cache->concurrent) {
+    pthread_cond_broadcast(&shard->cond);
+  }
+}
+
+static inline void wait_shard(struct block_cache *cache, struct blk_shard *shard, struct buf *buf)
+{
+  if (cache->concurrent == false) {
+    panic("libblockdev: block %u in use", (uint32_t)buf->block);
+  }
+  
+  pthread_cond_wait(&shard->cond, &shard->lock);
+}
+
+static inline void lock_resize(struct block_cache *cache)
+{
+  if (cache->concurrent) {
+    pthread_mutex_lock(&cache->resize_lock);
+  }
+}
+
+static inline void unlock_resize(struct block_cache *cache)
+{
+  if (cache->concurrent) {
+    pthread_mutex_unlock(&cache->resize_lock);
+  }
+}
+
+static inline void lock_writes(struct block_cache *cache)
+{
+  if (cache->concurrent) {
+    pthread_mutex_lock(&cache->write_lock);
+  }
+}
+
+static inline void unlock_writes(struct block_cache *cache)
+{
+  if (cache->concurrent) {
+    pthread_mutex_unlock(&cache->write_lock);
+  }
+}
+
+
+/*
+ * Internal prototypes shared between the libblockdev source files
+ */
+
+// block_async.c
+void init_async(struct block_cache *cache);
+void free_async(struct block_cache *cache);
+
+// block_cache.c
+struct block_cache *alloc_cache(int dev_fd, int buf_cnt, size_t block_size, int read_ahead_blocks);
+void destroy_cache(struct block_cache *cache);
+struct buf *acquire_buf(struct block_cache *cache, off64_t block, int flags, bool wait, bool *hit);
+void put_buf(struct block_cache *cache, struct buf *buf);
+void drop_block(struct block_cache *cache, off64_t block);
+bool claim_victim(struct block_cache *cache, struct buf *buf);
+void evict_buf(struct block_cache *cache, struct buf *buf, bool write);
+void read_blocks(struct block_cache *cache, struct buf **bufs, int cnt);
+
+// block_chunk.c
+struct blk_chunk *alloc_chunk(struct block_cache *cache, int buf_cnt, struct blk_pool *pool, void *mem);
+int chunk_buf_cnt(struct block_cache *cache);
+void free_chunk(struct block_cache *cache, struct blk_chunk *chunk);
+int add_chunk(struct block_cache *cache, struct blk_chunk *chunk);
+struct blk_chunk *remove_chunk(struct block_cache *cache, int idx);
+int map_chunks(struct block_cache *cache, int buf_cnt);
+void update_cache_limits(struct block_cache *cache);
+
+// block_discard.c
+void queue_discard(struct block_cache *cache, off64_t block, off64_t count);
+void cancel_discard(struct block_cache *cache, off64_t block, off64_t count);
+void issue_discards(struct block_cache *cache);
+
+// block_index.c
+int init_index(struct block_cache *cache, int buf_cnt);
+void free_index(struct block_cache *cache);
+struct buf *find_buf(struct block_cache *cache, off64_t block);
+void index_insert(struct block_cache *cache, struct buf *buf);
+void index_remove(struct block_cache *cache, struct buf *buf);
+
+// block_ioqueue.c
+void init_io_queue(struct block_cache *cache);
+void free_io_queue(struct block_cache *cache);
+ssize_t dev_readv(struct block_cache *cache, off64_t block, struct iovec *iov, int iov_cnt);
+ssize_t dev_writev(struct block_cache *cache, off64_t block, struct iovec *iov, int iov_cnt);
+
+// block_pool.c
+void pool_note_miss(struct block_cache *cache);
+void detach_pool(struct block_cache *cache);
+
+// block_lz.c
+int lz_compress(const uint8_t *src, int src_len, uint8_t *dst, int dst_max, uint32_t *table);
+int lz_decompress(const uint8_t *src, int src_len, uint8_t *dst, int dst_len);
+
+// block_policy.c
+void init_policy(struct block_cache *cache);
+void free_policy(struct block_cache *cache);
+void policy_admit(struct block_cache *cache, struct buf *buf);
+void policy_insert(struct block_cache *cache, struct buf *buf);
+void policy_use(struct block_cache *cache, struct buf *buf);
+void policy_remove(struct block_cache *cache, struct buf *buf);
+struct buf *policy_victim(struct block_cache *cache);
+void policy_resize(struct block_cache *cache);
+
+// block_prewarm.c
+int prewarm_run(off64_t *block, int cnt);
+int prewarm_run_blocks(off64_t *block, int run);
+
+// block_readahead.c
+void init_ra_streams(struct block_cache *cache);
+void ra_note_hit(struct block_cache *cache, struct buf *buf);
+void ra_note_evict(struct block_cache *cache, struct buf *buf);
+int read_block_range(struct block_cache *cache, off64_t start_block, int count, struct buf *first, int ra_stream);
+
+// block_stats.c
+void note_io_latency(struct block_cache *cache, struct blk_lat_hist *hist, struct profiling_samples *ps, struct timespec *start_ts);
+
+// block_victim.c
+void free_victim_tier(struct block_cache *cache);
+void victim_store(struct block_cache *cache, struct buf *buf);
+bool victim_load(struct block_cache *cache, struct buf *buf);
+void victim_invalidate(struct block_cache *cache, off64_t block);
+void victim_get_stats(struct block_cache *cache, struct block_cache_stats *stats);
+void victim_reset_stats(struct block_cache *cache);
+
+// block_writeback.c
+int writeback_buf(struct block_cache *cache, struct buf *buf);
+void redirty_buf(struct block_cache *cache, struct buf *buf);
+int flush_dirty_bufs(struct block_cache *cache, int target_dirty_cnt);
+int flush_block_range(struct block_cache *cache, off64_t start_block, off64_t block_cnt);
+int write_uncached(struct block_cache *cache, off64_t block, const void *data, int count);
+
+
+#endif
+
@@ -0,0 +1,470 @@
+/*
+ * Copyright 2023  Marven Gilhespie
+ *
+ * Licensed under the Apache License, segment_id 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+
+/* Chunks of bufs.
+ *
+ * The bufs of a cache are held in chunks, each a table of bufs whose data is
+ * held in one contiguous region of memory.  A cache created with
+ * init_block_cache() maps its bufs in chunks of BLK_CHUNK_SZ bytes, or of
+ * BLK_MAX_IOV bufs if that is larger, so that it can be resized while in use
+ * a chunk at a time.  A pooled cache has a chunk for each piece of the pool
+ * it holds, added and removed by the pool, see block_pool.c.
+ *
+ * resize_block_cache() grows a cache by mapping new chunks.  It shrinks it
+ * by removing chunks from the end of the chunk directory, evicting their
+ * blocks and writing those that are dirty.  If the new size falls within
+ * the last chunk that chunk is replaced by a smaller one.  Memory pressure
+ * only removes whole chunks, so that shrinking never maps more memory.
+ *
+ * The chunk directory of a cache is protected by the cache lock, resizing
+ * is serialized by the resize_lock.  A chunk is only removed when none of
+ * its bufs are in use or busy.
+ */
+
+#define LOG_LEVEL_ERROR
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/blockdev.h>
+#include <sys/panic.h>
+#include <sys/debug.h>
+#include <sys/mman.h>
+#include <sys/syscalls.h>
+#include "block_cache_priv.h"
+
+
+static int shrink_cache(struct block_cache *cache, int buf_cnt, bool exact);
+
+
+/* @brief   Change the number of bufs in a cache
+ *
+ * @param   cache, the cache to resize
+ * @param   buf_cnt, new number of bufs
+ * @return  0 on success, -EINVAL if buf_cnt is out of range or the cache
+ *          draws its bufs from a pool, -ENOMEM if memory could not be
+ *          mapped, -EBUSY if bufs in use prevented the cache from shrinking
+ *          to buf_cnt
+ *
+ * Can be called while the cache is in use by other threads.  On failure the
+ * cache is left with the bufs it had when the failure occurred.
+ */
+int resize_block_cache(struct block_cache *cache, int buf_cnt)
+{
+  int sc;
+  
+  if (buf_cnt < 1 || cache->pool != NULL) {
+    return -EINVAL;
+  }
+  
+  lock_resize(cache);
+  
+  if (buf_cnt > cache->buf_cnt) {
+    sc = map_chunks(cache, buf_cnt - cache->buf_cnt);
+  } else {
+    sc = shrink_cache(cache, buf_cnt, true);
+  }
+  
+  unlock_resize(cache);
+  return sc;
+}
+
+
+/* @brief   Set the number of bufs memory pressure does not shrink a cache below
+ *
+ * @param   cache, the cache to configure
+ * @param   min_buf_cnt, minimum number of bufs
+ * @return  0 on success, -EINVAL if min_buf_cnt is negative
+ */
+int set_block_cache_min_bufs(struct block_cache *cache, int min_buf_cnt)
+{
+  if (min_buf_cnt < 0) {
+    return -EINVAL;
+  }
+  
+  lock_resize(cache);
+  cache->min_buf_cnt = min_buf_cnt;
+  unlock_resize(cache);
+  return 0;
+}
+
+
+/* @brief   Shrink a cache in response to memory pressure
+ *
+ * @param   cache, the cache to shrink
+ * @param   level, BLK_PRESSURE_LOW to release half of the bufs above the
+ *          cache's minimum, BLK_PRESSURE_CRITICAL to release all of them
+ * @return  number of bufs released, or negative errno on failure
+ *
+ * This is the hook a file system server calls when notified of memory
+ * pressure.  Only whole chunks are released, so the cache may be left
+ * somewhat above the target, and chunks with bufs in use are skipped.  The
+ * first chunk of a cache is never released.  Caches drawing their bufs
+ * from a pool are not shrunk.
+ */
+int block_cache_memory_pressure(struct block_cache *cache, int level)
+{
+  int old_cnt;
+  int target;
+  
+  if (level != BLK_PRESSURE_LOW && level != BLK_PRESSURE_CRITICAL) {
+    return -EINVAL;
+  }
+  
+  if (cache->pool != NULL) {
+    return 0;
+  }
+  
+  lock_resize(cache);
+  old_cnt = cache->buf_cnt;
+  target = cache->min_buf_cnt;
+  
+  if (level == BLK_PRESSURE_LOW && old_cnt > target) {
+    target += (old_cnt - target) / 2;
+  }
+  
+  if (target < 1) {
+    target = 1;
+  }
+  
+  if (old_cnt > target) {
+    shrink_cache(cache, target, false);
+  }
+
+  unlock_resize(cache);
+  return old_cnt - cache->buf_cnt;
+}
+
+
+/* @brief   Allocate a chunk of bufs
+ *
+ * @param   cache, the cache the chunk is for
+ * @param   buf_cnt, number of bufs in the chunk
+ * @param   pool, pool that mem belongs to, or NULL to map memory for the chunk
+ * @param   mem, buf_cnt * block_size bytes of memory from the pool
+ * @return  the chunk or NULL on failure
+ */
+struct blk_chunk *alloc_chunk(struct block_cache *cache, int buf_cnt, struct blk_pool *pool, void *mem)
+{
+  struct blk_chunk *chunk;
+  struct buf *buf;
+  
+  if ((chunk = malloc(sizeof (struct blk_chunk) + buf_cnt * sizeof (struct buf))) == NULL) {
+    return NULL;
+  }
+  
+  if (pool == NULL) {
+    mem = mmap(NULL, buf_cnt * cache->block_size, PROT_READ | PROT_WRITE, BLK_MMAP_FLAGS, -1, 0);
+    
+    if (mem == MAP_FAILED) {
+      free(chunk);
+      return NULL;
+    }
+  }
+  
+  chunk->pool = pool;
+  chunk->mem = mem;
+  chunk->buf_cnt = buf_cnt;
+  
+  for (int t = 0; t < buf_cnt; t++) {
+    buf = &chunk->buf[t];
+    buf->block = 0;
+    buf->data = (uint8_t *)mem + (t * cache->block_size);
+    buf->chunk = chunk;
+    buf->valid = false;
+    buf->dirty = false;
+    buf->busy = false;
+    buf->on_dirty_list = false;
+    buf->dirty_epoch = 0;
+    buf->marked_dirty = false;
+    buf->prefetched = false;
+    buf->on_a1in = false;
+    buf->flags = 0;
+    buf->in_use = false;
+  }
+  
+  return chunk;
+}
+
+
+/* @brief   Number of bufs in the chunks mapped by a cache not in a pool
+ */
+int chunk_buf_cnt(struct block_cache *cache)
+{
+  int buf_cnt;
+  
+  buf_cnt = BLK_CHUNK_SZ / cache->block_size;
+  return (buf_cnt > BLK_MAX_IOV) ? buf_cnt : BLK_MAX_IOV;
+}
+
+
+/* @brief   Free a chunk that is not part of a cache
+ *
+ * The memory of a chunk from a pool must already have been returned to it.
+ */
+void free_chunk(struct block_cache *cache, struct blk_chunk *chunk)
+{
+  if (chunk->pool == NULL) {
+    munmap(chunk->mem, chunk->buf_cnt * cache->block_size);
+  }
+  
+  free(chunk);
+}
+
+
+/* @brief   Add a chunk's bufs to a cache
+ *
+ * @param   cache, the cache to add bufs to
+ * @param   chunk, chunk allocated with alloc_chunk()
+ * @return  0 on success, -ENOMEM on failure
+ */
+int add_chunk(struct block_cache *cache, struct blk_chunk *chunk)
+{
+  struct blk_chunk **dir;
+  struct buf **wb_bufs;
+  int buf_cnt;
+  int chunk_max;
+  
+  lock_writes(cache);
+  lock_cache(cache);
+  buf_cnt = cache->buf_cnt + chunk->buf_cnt;
+  unlock_cache(cache);
+  
+  // wb_bufs is only used with the write_lock held
+  if (buf_cnt > cache->wb_bufs_max) {
+    if ((wb_bufs = realloc(cache->wb_bufs, buf_cnt * sizeof (struct buf *))) == NULL) {
+      unlock_writes(cache);
+      return -ENOMEM;
+    }
+    
+    cache->wb_bufs = wb_bufs;
+    cache->wb_bufs_max = buf_cnt;
+  }
+  
+  lock_cache(cache);
+  
+  if (cache->chunk_cnt == cache->chunk_max) {
+    chunk_max = (cache->chunk_max == 0) ? 4 : cache->chunk_max * 2;
+    
+    if ((dir = realloc(cache->chunk, chunk_max * sizeof (struct blk_chunk *))) == NULL) {
+      unlock_cache(cache);
+      unlock_writes(cache);
+      return -ENOMEM;
+    }
+    
+    cache->chunk = dir;
+    cache->chunk_max = chunk_max;
+  }
+  
+  cache->chunk[cache->chunk_cnt++] = chunk;
+
+  for (int t = 0; t < chunk->buf_cnt; t++) {
+    policy_insert(cache, &chunk->buf[t]);
+  }
+  
+  cache->buf_cnt += chunk->buf_cnt;
+  cache->avail_buf_cnt += chunk->buf_cnt;
+  update_cache_limits(cache);
+  unlock_cache(cache);
+  unlock_writes(cache);
+  return 0;
+}
+
+
+/* @brief   Remove a chunk from a cache
+ *
+ * @param   cache, the cache to remove bufs from, holding more than one chunk
+ * @param   idx, index of the chunk in the chunk directory
+ * @return  the chunk, to be freed by the caller, or NULL if any of its bufs
+ *          are in use or busy
+ *
+ * The blocks held by the chunk are evicted, dirty blocks being written first.
+ */
+struct blk_chunk *remove_chunk(struct block_cache *cache, int idx)
+{
+  struct blk_chunk *chunk;
+  struct buf *buf;
+  bool write;
+  
+  lock_cache(cache);
+  chunk = cache->chunk[idx];
+  
+  for (int t = 0; t < chunk->buf_cnt; t++) {
+    if (chunk->buf[t].in_use == true || chunk->buf[t].busy == true) {
+      unlock_cache(cache);
+      return NULL;
+    }
+  }
+  
+  for (int t = 0; t < chunk->buf_cnt; t++) {
+    policy_remove(cache, &chunk->buf[t]);
+    claim_victim(cache, &chunk->buf[t]);
+  }
+  
+  for (int t = idx + 1; t < cache->chunk_cnt; t++) {
+    cache->chunk[t - 1] = cache->chunk[t];
+  }
+  
+  cache->chunk_cnt--;
+  cache->buf_cnt -= chunk->buf_cnt;
+  update_cache_limits(cache);
+  unlock_cache(cache);
+  
+  /* A dirty block can still be claimed by a flush in another thread, so
+   * whether to write it is decided as for any other victim.
+   */
+  for (int t = 0; t < chunk->buf_cnt; t++) {
+    buf = &chunk->buf[t];
+    lock_cache(cache);
+    write = (buf->dirty == true || buf->busy == true);
+    unlock_cache(cache);
+    evict_buf(cache, buf, write);
+  }
+  
+  return chunk;
+}
+
+
+/* @brief   Update the limits that depend on the number of bufs in a cache
+ *
+ * Called with the cache lock held whenever the number of bufs changes.
+ */
+void update_cache_limits(struct block_cache *cache)
+{
+  // Leave at least half the cache for blocks that are not read ahead
+  cache->read_ahead_blocks = cache->read_ahead_max;
+  
+  if (cache->read_ahead_blocks > cache->buf_cnt / 2) {
+    cache->read_ahead_blocks = cache->buf_cnt / 2;
+  }
+
+  if (cache->read_ahead_blocks < 1) {
+    cache->read_ahead_blocks = 1;
+  }
+  
+  cache->a1in_max = cache->buf_cnt / 4;
+  
+  if (cache->a1in_max < 1) {
+    cache->a1in_max = 1;
+  }
+  
+  policy_resize(cache);
+  
+  if (cache->write_policy == BLK_WRITE_THROUGH) {
+    cache->dirty_high_watermark = cache->buf_cnt;
+    cache->dirty_low_watermark = cache->buf_cnt;
+  } else {
+    if (cache->dirty_watermark_auto == true) {
+      cache->dirty_high_watermark = (cache->buf_cnt * 3) / 4;
+    } else if (cache->dirty_high_watermark > cache->buf_cnt) {
+      cache->dirty_high_watermark = cache->buf_cnt;
+    }
+    
+    cache->dirty_low_watermark = cache->dirty_high_watermark / 2;
+  }
+  
+  if (cache->extent_chunk >= cache->chunk_cnt) {
+    cache->extent_chunk = 0;
+    cache->extent_pos = 0;
+  }
+}
+
+
+/* @brief   Map new chunks holding a number of bufs and add them to a cache
+ *
+ * @param   cache, the cache to grow, with the resize_lock held
+ * @param   buf_cnt, number of bufs to add
+ * @return  0 on success, -ENOMEM on failure
+ */
+int map_chunks(struct block_cache *cache, int buf_cnt)
+{
+  struct blk_chunk *chunk;
+  int cnt;
+  
+  for (int t = 0; t < buf_cnt; t += cnt) {
+    cnt = (buf_cnt - t < chunk_buf_cnt(cache)) ? buf_cnt - t : chunk_buf_cnt(cache);
+
+    if ((chunk = alloc_chunk(cache, cnt, NULL, NULL)) == NULL) {
+      return -ENOMEM;
+    }
+    
+    if (add_chunk(cache, chunk) != 0) {
+      free_chunk(cache, chunk);
+      return -ENOMEM;
+    }
+  }
+  
+  return 0;
+}
+
+
+/* @brief   Remove chunks from the end of a cache
+ *
+ * @param   cache, the cache to shrink, with the resize_lock held
+ * @param   buf_cnt, number of bufs to shrink the cache to, at least 1
+ * @param   exact, if true replace the last chunk with a smaller one when
+ *          buf_cnt falls within it, otherwise leave it.  If false chunks
+ *          with bufs in use are skipped and the chunks before them tried,
+ *          down to the second chunk.
+ * @return  0 on success, -ENOMEM or -EBUSY on failure
+ */
+static int shrink_cache(struct block_cache *cache, int buf_cnt, bool exact)
+{
+  struct blk_chunk *chunk;
+  int last;
+  int keep;
+  int sc;
+  
+  // Only a resize changes the chunks of a cache that is not in a pool
+  if (exact == false) {
+    for (int t = cache->chunk_cnt - 1; t > 0 && cache->buf_cnt > buf_cnt; t--) {
+      if (cache->buf_cnt - cache->chunk[t]->buf_cnt >= buf_cnt
+            && (chunk = remove_chunk(cache, t)) != NULL) {
+        free_chunk(cache, chunk);
+      }
+    }
+    
+    return 0;
+  }
+  
+  while (cache->buf_cnt > buf_cnt) {
+    last = cache->chunk_cnt - 1;
+    keep = cache->buf_cnt - cache->chunk[last]->buf_cnt;
+    
+    if (keep < buf_cnt) {
+      if ((sc = map_chunks(cache, buf_cnt - keep)) != 0) {
+        return sc;
+      }
+    }
+    
+    if ((chunk = remove_chunk(cache, last)) == NULL) {
+      // Undo the replacement of the last chunk if it is still unused
+      if (keep < buf_cnt && (chunk = remove_chunk(cache, cache->chunk_cnt - 1)) != NULL) {
+        free_chunk(cache, chunk);
+      }
+      
+      return -EBUSY;
+    }
+    
+    free_chunk(cache, chunk);
+  }
+  
+  return 0;
+}
+
@@ -0,0 +1,216 @@
+/*
+ * Copyright 2023  Marven Gilhespie
+ *
+ * Licensed under the Apache License, segment_id 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+
+/* Direct I/O for large transfers.
+ *
+ * block_cache_read() and block_cache_write() copy a range of blocks between
+ * the device and a caller's buffer.  A transfer of fewer blocks than the
+ * cache's direct threshold goes through the cache as file data, see
+ * BLK_HINT_DATA.  A larger transfer is read or written straight between the
+ * caller's buffer and the device with a single request, without taking any
+ * bufs, so that streaming a large file does not evict the metadata held in
+ * the cache.
+ *
+ * Direct transfers stay coherent with the cache.  Dirty cached copies of the
+ * blocks of a direct read are written to the device before it is read.  A
+ * direct write holds the write_lock, so that no flush of a cached copy can
+ * overtake it, and drops cached copies of its blocks, including those held
+ * by the victim tier, once written.  A direct write belongs to the current
+ * barrier epoch like any block dirtied with put_block().
+ *
+ * Blocks that are in use and dirtied by another caller during a direct
+ * transfer of the same blocks are not ordered with it.
+ */
+
+#define LOG_LEVEL_ERROR
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/blockdev.h>
+#include <sys/panic.h>
+#include <sys/debug.h>
+#include <sys/uio.h>
+#include "block_cache_priv.h"
+
+
+static void read_cached(struct block_cache *cache, off64_t start_block, int count, void *data);
+static void write_cached(struct block_cache *cache, off64_t start_block, int count, const void *data);
+
+
+/* @brief   Set the size of transfers that bypass the cache
+ *
+ * @param   cache, the cache to configure
+ * @param   block_cnt, transfers of at least this many blocks are read or
+ *          written directly, 0 to always go through the cache
+ * @return  0 on success, -EINVAL if block_cnt is negative
+ */
+int set_block_cache_direct_threshold(struct block_cache *cache, int block_cnt)
+{
+  if (block_cnt < 0) {
+    return -EINVAL;
+  }
+  
+  lock_cache(cache);
+  cache->direct_threshold = block_cnt;
+  unlock_cache(cache);
+  return 0;
+}
+
+
+/* @brief   Read a range of blocks into a caller's buffer
+ *
+ * @param   cache, the cache of the device
+ * @param   start_block, first block of the range
+ * @param   count, number of blocks
+ * @param   data, buffer of count blocks to read into
+ * @return  0 on success, -EINVAL if count is not positive or -EIO on failure
+ *
+ * Ranges of at least the direct threshold are read from the device without
+ * being cached.
+ */
+int block_cache_read(struct block_cache *cache, off64_t start_block, int count, void *data)
+{
+  struct iovec iov;
+  bool direct;
+  ssize_t rc;
+  int sc = 0;
+  
+  if (count <= 0) {
+    return -EINVAL;
+  }
+  
+  lock_cache(cache);
+  direct = (cache->direct_threshold > 0 && count >= cache->direct_threshold);
+  unlock_cache(cache);
+
+  trace_op(cache, BLK_TRACE_READ, start_block, count, (direct) ? 1 : 0);
+  
+  if (direct == false) {
+    read_cached(cache, start_block, count, data);
+    return 0;
+  }
+
+  if (flush_block_range(cache, start_block, count) != 0) {
+    sc = -EIO;
+  }
+  
+  iov.iov_base = data;
+  iov.iov_len = (size_t)count * cache->block_size;
+  rc = dev_readv(cache, start_block, &iov, 1);
+
+  if (rc != (ssize_t)iov.iov_len) {
+    log_error("libblockdev: direct read of blocks %u-%u failed, rc:%d", (uint32_t)start_block,
+                (uint32_t)(start_block + count - 1), (int)rc);
+    return -EIO;
+  }
+  
+  lock_cache(cache);
+  cache->stats.direct_read_cnt += count;
+  unlock_cache(cache);
+  return sc;
+}
+
+
+/* @brief   Write a range of blocks from a caller's buffer
+ *
+ * @param   cache, the cache of the device
+ * @param   start_block, first block of the range
+ * @param   count, number of blocks
+ * @param   data, buffer of count blocks to write
+ * @return  0 on success, -EINVAL if count is not positive or -EIO on failure
+ *
+ * Ranges of at least the direct threshold are written to the device before
+ * returning and any cached copies are dropped.  Smaller ranges are written
+ * as put_block() would write a dirty block, according to the write policy.
+ */
+int block_cache_write(struct block_cache *cache, off64_t start_block, int count, const void *data)
+{
+  bool direct;
+  int sc;
+  
+  if (count <= 0) {
+    return -EINVAL;
+  }
+  
+  lock_cache(cache);
+  direct = (cache->direct_threshold > 0 && count >= cache->direct_threshold);
+  unlock_cache(cache);
+
+  trace_op(cache, BLK_TRACE_WRITE, start_block, count, (direct) ? 1 : 0);
+  
+  if (direct == false) {
+    write_cached(cache, start_block, count, data);
+    return 0;
+  }
+  
+  lock_writes(cache);
+  sc = write_uncached(cache, start_block, data, count);
+
+  // Also drops copies read from the device while the write was in progress
+  for (int t = 0; t < count; t++) {
+    drop_block(cache, start_block + t);
+  }
+  
+  unlock_writes(cache);
+  
+  lock_cache(cache);
+  cache->stats.direct_write_cnt += count;
+  unlock_cache(cache);
+  return sc;
+}
+
+
+/* @brief   Read a range of blocks through the cache
+ */
+static void read_cached(struct block_cache *cache, off64_t start_block, int count, void *data)
+{
+  struct buf *buf;
+  bool hit;
+  
+  for (int t = 0; t < count; t++) {
+    buf = acquire_buf(cache, start_block + t, BLK_HINT_DATA, true, &hit);
+    
+    if (hit == false) {
+      read_blocks(cache, &buf, 1);
+    }
+    
+    memcpy((uint8_t *)data + (size_t)t * cache->block_size, buf->data, cache->block_size);
+    put_buf(cache, buf);
+  }
+}
+
+
+/* @brief   Write a range of blocks through the cache
+ *
+ * Whole blocks are written so a block that is not cached is not read first.
+ */
+static void write_cached(struct block_cache *cache, off64_t start_block, int count, const void *data)
+{
+  struct buf *buf;
+  bool hit;
+  
+  for (int t = 0; t < count; t++) {
+    buf = acquire_buf(cache, start_block + t, BLK_HINT_DATA, true, &hit);
+    memcpy(buf->data, (const uint8_t *)data + (size_t)t * cache->block_size, cache->block_size);
+    block_markdirty(buf);
+    put_buf(cache, buf);
+  }
+}
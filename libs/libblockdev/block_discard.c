@@ -0,0 +1,341 @@
+/*
+ * Copyright 2023  Marven Gilhespie
+ *
+ * Licensed under the Apache License, segment_id 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+
+/* Discarding freed blocks.
+ *
+ * A flash device such as an SD card or eMMC has to preserve every block it
+ * has been written unless it is told the block is free, so its write
+ * amplification grows as it fills.  Once a discard function is set with
+ * set_block_cache_discard(), blocks freed with invalidate_block() or
+ * discard_block_range() are queued as extents of consecutive blocks,
+ * coalesced with any extents already queued.  The extents are passed to the
+ * discard function when the queue fills, when a block is freed
+ * BLK_DISCARD_DELAY_MS or more after the oldest extent was queued, and on
+ * sync_block_cache() or sync_block_range().
+ *
+ * A queued block that is written to the device is taken off the queue
+ * before the write is issued, and the queue is issued with the write_lock
+ * held, so a discard can never reach the device after a later write of the
+ * same block.
+ *
+ * Without a discard function freed blocks are only dropped from the cache.
+ * A function that reports the device does not support discarding is not
+ * called again.
+ *
+ * The queue is protected by the cache lock.
+ */
+
+#define LOG_LEVEL_ERROR
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/blockdev.h>
+#include <sys/panic.h>
+#include <sys/syscalls.h>
+#include <sys/debug.h>
+#include "block_cache_priv.h"
+
+
+static void flush_discards(struct block_cache *cache);
+static bool add_discard_ext(struct block_cache *cache, off64_t block, off64_t count);
+
+
+/* @brief   Set the function used to discard freed blocks
+ *
+ * @param   cache, the cache to configure
+ * @param   discard_fn, function called with each extent of freed blocks, or
+ *          NULL to stop discarding
+ * @param   arg, argument passed to discard_fn
+ * @return  0 on success
+ *
+ * Blocks queued for the previous function are passed to it first.  The
+ * function is called with the cache's write_lock held and must not use the
+ * cache.
+ */
+int set_block_cache_discard(struct block_cache *cache, blk_discard_fn_t discard_fn, void *arg)
+{
+  lock_writes(cache);
+  issue_discards(cache);
+  
+  lock_cache(cache);
+  cache->discard_fn = discard_fn;
+  cache->discard_arg = arg;
+  unlock_cache(cache);
+  
+  unlock_writes(cache);
+  return 0;
+}
+
+
+/* @brief   Free a range of blocks
+ *
+ * @param   cache, the cache the blocks belong to
+ * @param   start_block, first block of the range
+ * @param   block_cnt, number of blocks
+ * @return  0 on success, -EINVAL if block_cnt is not positive
+ *
+ * The blocks are removed from the cache as by invalidate_block() and
+ * queued to be discarded.
+ */
+int discard_block_range(struct block_cache *cache, off64_t start_block, off64_t block_cnt)
+{
+  if (block_cnt <= 0) {
+    return -EINVAL;
+  }
+  
+  trace_op(cache, BLK_TRACE_DISCARD, start_block, (int)block_cnt, 0);
+  
+  for (off64_t t = 0; t < block_cnt; t++) {
+    drop_block(cache, start_block + t);
+  }
+  
+  queue_discard(cache, start_block, block_cnt);
+  return 0;
+}
+
+
+/* @brief   Queue freed blocks to be discarded
+ *
+ * @param   cache, the cache the blocks belong to
+ * @param   block, first block freed
+ * @param   count, number of blocks
+ *
+ * Does nothing if no discard function is set.  Called with no locks held.
+ */
+void queue_discard(struct block_cache *cache, off64_t block, off64_t count)
+{
+  struct timespec now;
+  struct timespec age;
+  bool was_empty;
+  bool flush;
+  
+  lock_cache(cache);
+  
+  if (cache->discard_fn == NULL) {
+    unlock_cache(cache);
+    return;
+  }
+  
+  clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+  was_empty = (cache->discard_ext_cnt == 0);
+  
+  while (add_discard_ext(cache, block, count) == false) {
+    unlock_cache(cache);
+    flush_discards(cache);
+    lock_cache(cache);
+    was_empty = (cache->discard_ext_cnt == 0);
+  }
+  
+  // The age of the queue is that of its oldest extent, blocks merged into
+  // an existing extent do not restart it
+  if (was_empty == true) {
+    cache->discard_since = now;
+  }
+  
+  cache->stats.discard_queued_cnt += count;
+  
+  diff_timespec(&age, &now, &cache->discard_since);
+  flush = (cache->discard_ext_cnt == BLK_DISCARD_EXTENT_MAX
+            || (uint64_t)age.tv_sec * 1000 + age.tv_nsec / 1000000 >= BLK_DISCARD_DELAY_MS);
+  unlock_cache(cache);
+  
+  if (flush == true) {
+    flush_discards(cache);
+  }
+}
+
+
+/* @brief   Take blocks about to be written off the discard queue
+ *
+ * @param   cache, the cache of the device
+ * @param   block, first block to be written
+ * @param   count, number of blocks
+ *
+ * An extent partly covered by the blocks is trimmed or split.  If the queue
+ * has no room to split an extent the part after the blocks is not
+ * discarded.
+ */
+void cancel_discard(struct block_cache *cache, off64_t block, off64_t count)
+{
+  struct blk_discard_ext *ext = cache->discard_ext;
+  off64_t end = block + count;
+  off64_t ext_end;
+  off64_t cancelled = 0;
+  int t = 0;
+  
+  lock_cache(cache);
+  
+  while (t < cache->discard_ext_cnt && ext[t].block < end) {
+    ext_end = ext[t].block + ext[t].count;
+    
+    if (ext_end <= block) {
+      t++;
+    } else if (ext[t].block >= block && ext_end <= end) {
+      cancelled += ext[t].count;
+      cache->discard_ext_cnt--;
+      memmove(&ext[t], &ext[t + 1], (cache->discard_ext_cnt - t) * sizeof *ext);
+    } else if (ext[t].block < block && ext_end > end) {
+      cancelled += count;
+      
+      if (cache->discard_ext_cnt < BLK_DISCARD_EXTENT_MAX) {
+        memmove(&ext[t + 2], &ext[t + 1], (cache->discard_ext_cnt - t - 1) * sizeof *ext);
+        ext[t + 1].block = end;
+        ext[t + 1].count = ext_end - end;
+        cache->discard_ext_cnt++;
+      } else {
+        cancelled += ext_end - end;
+      }
+      
+      ext[t].count = block - ext[t].block;
+      break;
+    } else if (ext[t].block < block) {
+      cancelled += ext_end - block;
+      ext[t].count = block - ext[t].block;
+      t++;
+    } else {
+      cancelled += end - ext[t].block;
+      ext[t].count = ext_end - end;
+      ext[t].block = end;
+      t++;
+    }
+  }
+  
+  cache->stats.discard_cancel_cnt += cancelled;
+  unlock_cache(cache);
+}
+
+
+/* @brief   Pass the queued extents to the discard function
+ *
+ * Called with the write_lock held.  A failure to discard is logged but not
+ * returned, discarding is only a hint to the device.
+ */
+void issue_discards(struct block_cache *cache)
+{
+  struct blk_discard_ext ext[BLK_DISCARD_EXTENT_MAX];
+  blk_discard_fn_t discard_fn;
+  void *arg;
+  off64_t block_cnt = 0;
+  int req_cnt = 0;
+  int cnt;
+  int sc;
+  
+  lock_cache(cache);
+  discard_fn = cache->discard_fn;
+  arg = cache->discard_arg;
+  cnt = cache->discard_ext_cnt;
+  memcpy(ext, cache->discard_ext, cnt * sizeof *ext);
+  cache->discard_ext_cnt = 0;
+  unlock_cache(cache);
+  
+  if (discard_fn == NULL) {
+    return;
+  }
+  
+  for (int t = 0; t < cnt; t++) {
+    sc = discard_fn(arg, ext[t].block, ext[t].count);
+    
+    if (sc == -ENOSYS || sc == -EOPNOTSUPP) {
+      log_info("libblockdev: device does not support discard");
+
+      lock_cache(cache);
+      
+      if (cache->discard_fn == discard_fn) {
+        cache->discard_fn = NULL;
+        cache->discard_ext_cnt = 0;
+      }
+      
+      unlock_cache(cache);
+      break;
+    }
+    
+    if (sc != 0) {
+      log_error("libblockdev: discard of blocks %u-%u failed, sc:%d", (uint32_t)ext[t].block,
+                  (uint32_t)(ext[t].block + ext[t].count - 1), sc);
+      continue;
+    }
+    
+    block_cnt += ext[t].count;
+    req_cnt++;
+  }
+  
+  lock_cache(cache);
+  cache->stats.discard_cnt += block_cnt;
+  cache->stats.discard_req_cnt += req_cnt;
+  unlock_cache(cache);
+}
+
+
+/* @brief   Issue the queued extents, taking the write_lock
+ */
+static void flush_discards(struct block_cache *cache)
+{
+  lock_writes(cache);
+  issue_discards(cache);
+  unlock_writes(cache);
+}
+
+
+/* @brief   Add an extent to the sorted discard queue, merging it with any
+ *          extents it overlaps or adjoins
+ *
+ * @return  false if the queue is full and the extent could not be merged
+ *
+ * Called with the cache lock held.
+ */
+static bool add_discard_ext(struct block_cache *cache, off64_t block, off64_t count)
+{
+  struct blk_discard_ext *ext = cache->discard_ext;
+  int cnt = cache->discard_ext_cnt;
+  off64_t end = block + count;
+  int first;
+  int last;
+  
+  for (first = 0; first < cnt && ext[first].block + ext[first].count < block; first++);
+  
+  for (last = first; last < cnt && ext[last].block <= end; last++) {
+    if (ext[last].block < block) {
+      block = ext[last].block;
+    }
+    
+    if (ext[last].block + ext[last].count > end) {
+      end = ext[last].block + ext[last].count;
+    }
+  }
+  
+  if (last == first) {
+    if (cnt == BLK_DISCARD_EXTENT_MAX) {
+      return false;
+    }
+    
+    memmove(&ext[first + 1], &ext[first], (cnt - first) * sizeof *ext);
+    cnt++;
+  } else {
+    memmove(&ext[first + 1], &ext[last], (cnt - last) * sizeof *ext);
+    cnt -= last - first - 1;
+  }
+  
+  ext[first].block = block;
+  ext[first].count = end - block;
+  cache->discard_ext_cnt = cnt;
+  return true;
+}
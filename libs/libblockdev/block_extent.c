@@ -0,0 +1,307 @@
+/*
+ * Copyright 2023  Marven Gilhespie
+ *
+ * Licensed under the Apache License, segment_id 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/* Extents of consecutive blocks held in contiguous memory.
+ *
+ * The data of the bufs of a chunk is laid out in the same order in the
+ * chunk's memory, so a run of adjacent bufs of a chunk holds its blocks in
+ * one contiguous region.  get_block_range() claims such a run for a range of blocks and
+ * returns a pointer to its data, which can be passed to a read or write
+ * reply as a single iovec without copying block by block.
+ *
+ * The run is chosen to be the one already holding the first block of the
+ * range if that run is free, so repeated access to the same range finds its
+ * blocks in place.  Otherwise the first run of bufs that are neither in use
+ * nor busy is taken, searching each chunk in turn from where the last search
+ * ended.  A block
+ * of the range that is cached in a buf outside the run is copied into it,
+ * after being written to disk if it is dirty.
+ */
+
+#define LOG_LEVEL_ERROR
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/blockdev.h>
+#include <sys/panic.h>
+#include <sys/debug.h>
+#include "block_cache_priv.h"
+
+
+static int claim_run(struct block_cache *cache, off64_t start_block, int count, struct buf **bufs, bool *evict, bool *write);
+static bool run_is_free(struct blk_chunk *chunk, int first, int count);
+static bool assign_buf(struct block_cache *cache, struct buf *buf, off64_t block, int flags);
+
+
+/* @brief   Get a range of blocks held in contiguous memory
+ *
+ * @param   cache, the cache the blocks belong to
+ * @param   start_block, first block of the range
+ * @param   count, number of blocks, at most BLK_MAX_IOV and half the cache
+ * @param   opt, as for get_block()
+ * @param   bufs, array of count entries set to the bufs of the blocks
+ * @return  pointer to the count * block_size bytes of the blocks, or NULL
+ *          if count is out of range or no run of free bufs was found
+ *
+ * The bufs are in use by the caller and are released with put_block_range()
+ * or individually with put_block().  Blocks of the range are acquired in
+ * ascending order, the caller must not hold any of them.
+ */
+void *get_block_range(struct block_cache *cache, off64_t start_block, int count, int opt, struct buf **bufs)
+{
+  bool evict[BLK_MAX_IOV];
+  bool write[BLK_MAX_IOV];
+  int run;
+
+  if (count < 1 || count > BLK_MAX_IOV || count > cache->buf_cnt / 2) {
+    return NULL;
+  }
+  
+  trace_op(cache, BLK_TRACE_RANGE, start_block, count, opt);
+  
+  if (claim_run(cache, start_block, count, bufs, evict, write) != 0) {
+    log_error("libblockdev: no free run of %d bufs", count);
+    return NULL;
+  }
+  
+  for (int t = 0; t < count; t++) {
+    if (evict[t] == true) {
+      evict_buf(cache, bufs[t], write[t]);
+    }
+  }
+
+  for (int t = 0; t < count; t++) {
+    if (evict[t] == true) {
+      evict[t] = assign_buf(cache, bufs[t], start_block + t, opt & BLK_HINT_MASK);
+    }
+  }
+  
+  // evict[] now marks the bufs that need their block read or cleared
+  opt &= BLK_OPT_MASK;
+  
+  for (int t = 0; t < count; t += run) {
+    if (evict[t] == false) {
+      run = 1;
+      continue;
+    }
+    
+    for (run = 1; t + run < count && evict[t + run] == true; run++);
+    
+    if (opt == BLK_READ) {
+      read_blocks(cache, &bufs[t], run);
+    } else if (opt == BLK_CLEAR) {
+      memset(bufs[t]->data, 0, run * cache->block_size);
+    }
+  }
+  
+  return bufs[0]->data;
+}
+
+
+/* @brief   Release a range of blocks got with get_block_range()
+ *
+ * @param   cache, the cache the blocks belong to
+ * @param   bufs, bufs of the range
+ * @param   count, number of bufs
+ */
+void put_block_range(struct block_cache *cache, struct buf **bufs, int count)
+{
+  for (int t = 0; t < count; t++) {
+    put_block(cache, bufs[t]);
+  }
+}
+
+
+/* @brief   Claim a run of adjacent bufs for a range of blocks
+ *
+ * @param   cache, the cache to claim bufs from
+ * @param   start_block, first block of the range
+ * @param   count, number of bufs in the run
+ * @param   bufs, set to the bufs of the run, in use by the caller
+ * @param   evict, set to true for each buf whose current block must be
+ *          evicted with evict_buf()
+ * @param   write, set to the write argument of evict_buf() for each buf
+ * @return  0 on success, -EAGAIN if no run of free bufs was found
+ *
+ * Only the leading bufs of the run that already hold their blocks are kept,
+ * the rest are evicted.  The caller then only waits for blocks above those
+ * it holds, the same order as any other thread getting the range.
+ */
+static int claim_run(struct block_cache *cache, off64_t start_block, int count, struct buf **bufs, bool *evict, bool *write)
+{
+  struct blk_shard *shard;
+  struct blk_chunk *chunk = NULL;
+  struct buf *buf;
+  bool in_place = true;
+  int first = -1;
+  int idx;
+  
+  shard = buf_shard(cache, start_block);
+  lock_shard(cache, shard);
+  lock_cache(cache);
+
+  if ((buf = find_buf(cache, start_block)) != NULL) {
+    chunk = buf->chunk;
+    first = buf - chunk->buf;
+    
+    if (first + count > chunk->buf_cnt || run_is_free(chunk, first, count) == false) {
+      first = -1;
+    }
+  }
+  
+  unlock_shard(cache, shard);
+  
+  // The first chunk is searched again up to where the search started
+  for (int c = 0; first == -1 && c <= cache->chunk_cnt; c++) {
+    idx = (cache->extent_chunk + c) % cache->chunk_cnt;
+    chunk = cache->chunk[idx];
+    
+    for (int pos = (c == 0) ? cache->extent_pos : 0; pos + count <= chunk->buf_cnt; pos++) {
+      if (run_is_free(chunk, pos, count) == true) {
+        first = pos;
+        cache->extent_chunk = idx;
+        cache->extent_pos = pos + count;
+        break;
+      }
+    }
+  }
+
+  if (first == -1) {
+    unlock_cache(cache);
+    return -EAGAIN;
+  }
+  
+  for (int t = 0; t < count; t++) {
+    buf = &chunk->buf[first + t];
+    bufs[t] = buf;
+
+    if (in_place == true && buf->valid == true && buf->block == start_block + t) {
+      policy_use(cache, buf);
+      buf->in_use = true;
+      cache->avail_buf_cnt--;
+      ra_note_hit(cache, buf);
+      cache->stats.hit_cnt++;
+      evict[t] = false;
+    } else {
+      policy_remove(cache, buf);
+      write[t] = claim_victim(cache, buf);
+      evict[t] = true;
+      in_place = false;
+    }
+  }
+  
+  unlock_cache(cache);
+  return 0;
+}
+
+
+/* @brief   Check that a run of bufs is neither in use nor busy
+ *
+ * Called with the cache lock held.
+ */
+static bool run_is_free(struct blk_chunk *chunk, int first, int count)
+{
+  for (int t = first; t < first + count; t++) {
+    if (chunk->buf[t].in_use == true || chunk->buf[t].busy == true) {
+      return false;
+    }
+  }
+  
+  return true;
+}
+
+
+/* @brief   Assign a claimed buf to a block of the range
+ *
+ * @param   cache, the cache the buf belongs to
+ * @param   buf, buf of the run, in use by the caller and not in the index
+ * @param   block, block to assign to the buf
+ * @param   flags, BLK_HINT_* flags of the caller
+ * @return  true if the block's data must be read, false if it was copied
+ *          from another buf that held it
+ *
+ * If another buf holds the block it is waited for if in use, written to
+ * disk if dirty, copied into buf and then freed.
+ */
+static bool assign_buf(struct block_cache *cache, struct buf *buf, off64_t block, int flags)
+{
+  struct blk_shard *shard;
+  struct buf *old;
+  
+  shard = buf_shard(cache, block);
+  lock_shard(cache, shard);
+  
+  while ((old = find_buf(cache, block)) != NULL) {
+    lock_cache(cache);
+    
+    if (old->in_use == true || old->busy == true) {
+      unlock_cache(cache);
+      wait_shard(cache, shard, old);
+      continue;
+    }
+    
+    policy_remove(cache, old);
+    ra_note_hit(cache, old);
+    old->in_use = true;
+    cache->avail_buf_cnt--;
+    cache->stats.hit_cnt++;
+    unlock_cache(cache);
+    unlock_shard(cache, shard);
+
+    if (old->dirty == true) {
+      writeback_buf(cache, old);
+    }
+    
+    memcpy(buf->data, old->data, cache->block_size);
+    
+    lock_shard(cache, shard);
+    index_remove(cache, old);
+    old->valid = false;
+    buf->block = block;
+    buf->flags = flags;
+    buf->dirty = false;
+    buf->valid = true;
+    index_insert(cache, buf);
+    
+    lock_cache(cache);
+    buf->queue = old->queue;
+    old->in_use = false;
+    policy_insert(cache, old);
+    cache->avail_buf_cnt++;
+    unlock_cache(cache);
+    wake_shard(cache, shard);
+    unlock_shard(cache, shard);
+    return false;
+  }
+  
+  buf->block = block;
+  buf->flags = flags;
+  buf->dirty = false;
+  buf->valid = true;
+  index_insert(cache, buf);
+  
+  lock_cache(cache);
+  policy_admit(cache, buf);
+  cache->stats.miss_cnt++;
+  unlock_cache(cache);
+  unlock_shard(cache, shard);
+  return true;
+}
+
@@ -0,0 +1,244 @@
+/*
+ * Copyright 2023  Marven Gilhespie
+ *
+ * Licensed under the Apache License, segment_id 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/* Index of the blocks held in the cache.
+ *
+ * Each shard has an open-addressed table of slots holding a block number
+ * and its buf, searched by linear probing.  A lookup reads consecutive
+ * slots of one array rather than following links through struct buf.
+ * Removal shifts later entries of the probe sequence back so no tombstones
+ * are left behind.
+ *
+ * Tables are sized at init_block_cache() for a load of at most one half if
+ * blocks are spread evenly across the shards, and double in size whenever a
+ * shard becomes three quarters full.
+ *
+ * The index of a shard is protected by the shard lock.
+ */
+
+#define LOG_LEVEL_ERROR
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/blockdev.h>
+#include <sys/panic.h>
+#include <sys/debug.h>
+#include "block_cache_priv.h"
+
+
+static int alloc_index(struct blk_shard *shard, uint32_t slot_cnt);
+static void grow_index(struct blk_shard *shard);
+
+
+/* @brief   Allocate the index of each shard of a cache
+ *
+ * @param   cache, the cache to allocate indexes for
+ * @param   buf_cnt, number of bufs the index is initially sized for
+ * @return  0 on success, -ENOMEM on failure
+ */
+int init_index(struct block_cache *cache, int buf_cnt)
+{
+  uint32_t slot_cnt;
+  
+  slot_cnt = BLK_INDEX_MIN_SLOTS;
+  
+  while (slot_cnt < 2 * (uint32_t)(buf_cnt / BLK_SHARD_CNT)) {
+    slot_cnt *= 2;
+  }
+
+  for (int t = 0; t < BLK_SHARD_CNT; t++) {
+    cache->shard[t].slot = NULL;
+  }
+  
+  for (int t = 0; t < BLK_SHARD_CNT; t++) {
+    if (alloc_index(&cache->shard[t], slot_cnt) != 0) {
+      free_index(cache);
+      return -ENOMEM;
+    }
+  }
+  
+  return 0;
+}
+
+
+/* @brief   Free the index of each shard of a cache
+ */
+void free_index(struct block_cache *cache)
+{
+  for (int t = 0; t < BLK_SHARD_CNT; t++) {
+    free(cache->shard[t].slot);
+    cache->shard[t].slot = NULL;
+  }
+}
+
+
+/* @brief   Find a block in the cache's index
+ *
+ * @param   cache, the cache to search
+ * @param   block, block number to look up
+ * @return  buf holding the block or NULL if it is not cached
+ *
+ * The lock of the block's shard must be held.
+ */
+struct buf *find_buf(struct block_cache *cache, off64_t block)
+{
+  struct blk_shard *shard;
+  struct blk_index_slot *slot;
+  uint32_t idx;
+  
+  shard = buf_shard(cache, block);
+  idx = (uint32_t)block_hash(block) & shard->slot_mask;
+  
+  for (;;) {
+    slot = &shard->slot[idx];
+    
+    if (slot->buf == NULL || slot->block == block) {
+      return slot->buf;
+    }
+    
+    idx = (idx + 1) & shard->slot_mask;
+  }
+}
+
+
+/* @brief   Add a buf to the index under its block number
+ *
+ * @param   cache, the cache the buf belongs to
+ * @param   buf, buf to add, the block must not already be in the index
+ *
+ * The lock of the block's shard must be held.
+ */
+void index_insert(struct block_cache *cache, struct buf *buf)
+{
+  struct blk_shard *shard;
+  uint32_t idx;
+  
+  shard = buf_shard(cache, buf->block);
+  
+  if ((uint32_t)(shard->slot_used + 1) * 4 > (shard->slot_mask + 1) * 3) {
+    grow_index(shard);
+  }
+  
+  idx = (uint32_t)block_hash(buf->block) & shard->slot_mask;
+  
+  while (shard->slot[idx].buf != NULL) {
+    idx = (idx + 1) & shard->slot_mask;
+  }
+  
+  shard->slot[idx].block = buf->block;
+  shard->slot[idx].buf = buf;
+  shard->slot_used++;
+}
+
+
+/* @brief   Remove a buf from the index
+ *
+ * @param   cache, the cache the buf belongs to
+ * @param   buf, buf to remove, it must be in the index
+ *
+ * Entries following the removed one in its probe sequence are moved back
+ * into the hole if their home slot allows it.  The lock of the block's shard
+ * must be held.
+ */
+void index_remove(struct block_cache *cache, struct buf *buf)
+{
+  struct blk_shard *shard;
+  uint32_t hole;
+  uint32_t idx;
+  uint32_t home;
+  
+  shard = buf_shard(cache, buf->block);
+  hole = (uint32_t)block_hash(buf->block) & shard->slot_mask;
+  
+  while (shard->slot[hole].buf != buf) {
+    hole = (hole + 1) & shard->slot_mask;
+  }
+  
+  idx = hole;
+  
+  for (;;) {
+    idx = (idx + 1) & shard->slot_mask;
+    
+    if (shard->slot[idx].buf == NULL) {
+      break;
+    }
+    
+    home = (uint32_t)block_hash(shard->slot[idx].block) & shard->slot_mask;
+    
+    // Move the entry unless its home lies cyclically in (hole, idx]
+    if (((idx - home) & shard->slot_mask) >= ((idx - hole) & shard->slot_mask)) {
+      shard->slot[hole] = shard->slot[idx];
+      hole = idx;
+    }
+  }
+  
+  shard->slot[hole].buf = NULL;
+  shard->slot_used--;
+}
+
+
+/* @brief   Allocate an empty table of slots for a shard
+ *
+ * @return  0 on success, -ENOMEM on failure
+ */
+static int alloc_index(struct blk_shard *shard, uint32_t slot_cnt)
+{
+  if ((shard->slot = calloc(slot_cnt, sizeof (struct blk_index_slot))) == NULL) {
+    return -ENOMEM;
+  }
+  
+  shard->slot_mask = slot_cnt - 1;
+  shard->slot_used = 0;
+  return 0;
+}
+
+
+/* @brief   Double the number of slots of a shard's index
+ */
+static void grow_index(struct blk_shard *shard)
+{
+  struct blk_index_slot *old_slot;
+  uint32_t old_slot_cnt;
+  uint32_t idx;
+  
+  old_slot = shard->slot;
+  old_slot_cnt = shard->slot_mask + 1;
+  
+  if (alloc_index(shard, old_slot_cnt * 2) != 0) {
+    panic("libblockdev: failed to grow index");
+  }
+  
+  for (uint32_t t = 0; t < old_slot_cnt; t++) {
+    if (old_slot[t].buf == NULL) {
+      continue;
+    }
+    
+    idx = (uint32_t)block_hash(old_slot[t].block) & shard->slot_mask;
+
+    while (shard->slot[idx].buf != NULL) {
+      idx = (idx + 1) & shard->slot_mask;
+    }
+    
+    shard->slot[idx] = old_slot[t];
+    shard->slot_used++;
+  }
+  
+  free(old_slot);
+}
+
@@ -0,0 +1,349 @@
+/*
+ * Copyright 2023  Marven Gilhespie
+ *
+ * Licensed under the Apache License, segment_id 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+
+/* I/O request queue of the block cache.
+ *
+ * Every read and write of dev_fd is submitted to a queue of requests.  A
+ * thread that submits a request while no other thread is dispatching
+ * becomes the dispatcher.  It takes requests off the queue and issues them,
+ * completing the requests of other threads along the way, until its own
+ * request is done.  It then hands over to a waiting thread if any requests
+ * remain queued.  There is no dedicated thread, a lone caller takes the
+ * io_lock and goes straight to the device.
+ *
+ * Requests are dispatched in one direction across the device (C-LOOK).  The
+ * next request is the one with the lowest block at or after the end of the
+ * last dispatch, wrapping around to the lowest block queued.  Requests in
+ * the same direction for the blocks that follow are merged into one readv
+ * or writev of at most BLK_MAX_IOV buffers.  Every request is for whole
+ * blocks.
+ *
+ * Only the dispatcher seeks and transfers on dev_fd, so threads never race
+ * on its file position.  Requests of a cache that is not concurrent are
+ * issued directly.
+ */
+
+#define LOG_LEVEL_ERROR
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/blockdev.h>
+#include <sys/panic.h>
+#include <sys/syscalls.h>
+#include <sys/debug.h>
+#include <sys/uio.h>
+#include "block_cache_priv.h"
+
+
+static ssize_t submit_io(struct block_cache *cache, struct blk_io_req *req);
+static void dispatch_io(struct block_cache *cache);
+static struct blk_io_req *next_io_req(struct block_cache *cache);
+static struct blk_io_req *adjacent_io_req(struct block_cache *cache, bool writing, off64_t block, int iov_room);
+static ssize_t do_io(struct block_cache *cache, off64_t block, bool writing, struct iovec *iov, int iov_cnt);
+static void note_io(struct block_cache *cache, struct blk_io_req *req, struct timespec *start_ts);
+
+
+/* @brief   Initialize the I/O request queue of a cache
+ */
+void init_io_queue(struct block_cache *cache)
+{
+  pthread_mutex_init(&cache->io_lock, NULL);
+  pthread_cond_init(&cache->io_cond, NULL);
+  LIST_INIT(&cache->io_queue);
+  cache->io_depth = 0;
+  cache->io_dispatching = false;
+  cache->io_head = 0;
+}
+
+
+/* @brief   Free the I/O request queue of a cache
+ */
+void free_io_queue(struct block_cache *cache)
+{
+  pthread_cond_destroy(&cache->io_cond);
+  pthread_mutex_destroy(&cache->io_lock);
+}
+
+
+/* @brief   Read consecutive blocks from the device
+ *
+ * @param   cache, the cache of the device
+ * @param   block, first block to read
+ * @param   iov, buffers to read the blocks into
+ * @param   iov_cnt, number of entries in iov, at most BLK_MAX_IOV
+ * @return  number of bytes read or -1 on error
+ */
+ssize_t dev_readv(struct block_cache *cache, off64_t block, struct iovec *iov, int iov_cnt)
+{
+  struct blk_io_req req;
+  
+  req.block = block;
+  req.iov = iov;
+  req.iov_cnt = iov_cnt;
+  req.write = false;
+  return submit_io(cache, &req);
+}
+
+
+/* @brief   Write consecutive blocks to the device
+ *
+ * @param   cache, the cache of the device
+ * @param   block, first block to write
+ * @param   iov, buffers holding the blocks
+ * @param   iov_cnt, number of entries in iov, at most BLK_MAX_IOV
+ * @return  number of bytes written or -1 on error
+ *
+ * Any of the blocks queued to be discarded are taken off the discard queue.
+ */
+ssize_t dev_writev(struct block_cache *cache, off64_t block, struct iovec *iov, int iov_cnt)
+{
+  struct blk_io_req req;
+  
+  req.block = block;
+  req.iov = iov;
+  req.iov_cnt = iov_cnt;
+  req.write = true;
+  return submit_io(cache, &req);
+}
+
+
+/* @brief   Queue a request and wait for it to complete, dispatching the
+ *          queue if no other thread is
+ *
+ * @return  the rc of the request
+ */
+static ssize_t submit_io(struct block_cache *cache, struct blk_io_req *req)
+{
+  struct timespec start_ts;
+  
+  req->len = 0;
+  
+  for (int t = 0; t < req->iov_cnt; t++) {
+    req->len += req->iov[t].iov_len;
+  }
+  
+  if (req->write == true) {
+    cancel_discard(cache, req->block, req->len / cache->block_size);
+  }
+  
+  req->done = false;
+  req->merged = false;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &start_ts);
+  
+  if (cache->concurrent == false) {
+    req->depth = 0;
+    req->rc = do_io(cache, req->block, req->write, req->iov, req->iov_cnt);
+    note_io(cache, req, &start_ts);
+    return req->rc;
+  }
+  
+  pthread_mutex_lock(&cache->io_lock);
+  req->depth = cache->io_depth;
+  LIST_ADD_TAIL(&cache->io_queue, req, link);
+  cache->io_depth++;
+  
+  while (req->done == false) {
+    if (cache->io_dispatching == true) {
+      pthread_cond_wait(&cache->io_cond, &cache->io_lock);
+      continue;
+    }
+    
+    cache->io_dispatching = true;
+    
+    while (req->done == false) {
+      dispatch_io(cache);
+    }
+    
+    cache->io_dispatching = false;
+    
+    if (LIST_HEAD(&cache->io_queue) != NULL) {
+      pthread_cond_broadcast(&cache->io_cond);
+    }
+  }
+  
+  pthread_mutex_unlock(&cache->io_lock);
+  
+  note_io(cache, req, &start_ts);
+  return req->rc;
+}
+
+
+/* @brief   Issue the next request in elevator order, merged with any queued
+ *          requests for the blocks that follow it
+ *
+ * Called by the dispatcher with the io_lock held, the lock is released
+ * while the device is accessed.
+ */
+static void dispatch_io(struct block_cache *cache)
+{
+  struct iovec iov[BLK_MAX_IOV];
+  struct blk_io_req *batch[BLK_MAX_IOV];
+  struct blk_io_req *lead;
+  struct blk_io_req *req;
+  off64_t end;
+  size_t off;
+  ssize_t rc;
+  int iov_cnt = 0;
+  int cnt = 0;
+  
+  lead = next_io_req(cache);
+  req = lead;
+  end = lead->block;
+  
+  do {
+    LIST_REM_ENTRY(&cache->io_queue, req, link);
+    req->merged = (req != lead);
+    batch[cnt++] = req;
+    
+    for (int t = 0; t < req->iov_cnt; t++) {
+      iov[iov_cnt++] = req->iov[t];
+    }
+    
+    end += req->len / cache->block_size;
+  } while ((req = adjacent_io_req(cache, lead->write, end, BLK_MAX_IOV - iov_cnt)) != NULL);
+  
+  cache->io_depth -= cnt;
+  cache->io_head = end;
+  pthread_mutex_unlock(&cache->io_lock);
+  
+  rc = do_io(cache, lead->block, lead->write, iov, iov_cnt);
+  
+  pthread_mutex_lock(&cache->io_lock);
+  off = 0;
+  
+  // A short transfer completes the requests it covered
+  for (int t = 0; t < cnt; t++) {
+    req = batch[t];
+    
+    if (rc < 0) {
+      req->rc = -1;
+    } else if ((size_t)rc >= off + req->len) {
+      req->rc = req->len;
+    } else {
+      req->rc = ((size_t)rc > off) ? (ssize_t)(rc - off) : 0;
+    }
+    
+    off += req->len;
+    req->done = true;
+  }
+  
+  pthread_cond_broadcast(&cache->io_cond);
+}
+
+
+/* @brief   Find the next queued request in C-LOOK order
+ *
+ * Called with the io_lock held and the queue not empty.
+ */
+static struct blk_io_req *next_io_req(struct block_cache *cache)
+{
+  struct blk_io_req *req;
+  struct blk_io_req *lowest = NULL;
+  struct blk_io_req *ahead = NULL;
+  
+  for (req = LIST_HEAD(&cache->io_queue); req != NULL; req = LIST_NEXT(req, link)) {
+    if (lowest == NULL || req->block < lowest->block) {
+      lowest = req;
+    }
+    
+    if (req->block >= cache->io_head && (ahead == NULL || req->block < ahead->block)) {
+      ahead = req;
+    }
+  }
+  
+  return (ahead != NULL) ? ahead : lowest;
+}
+
+
+/* @brief   Find a queued request that can be merged behind a dispatch
+ *
+ * @param   cache, the cache of the device
+ * @param   writing, direction of the dispatch
+ * @param   block, block following the end of the dispatch
+ * @param   iov_room, number of buffers that can still be added
+ * @return  a request starting at block, or NULL
+ */
+static struct blk_io_req *adjacent_io_req(struct block_cache *cache, bool writing, off64_t block, int iov_room)
+{
+  struct blk_io_req *req;
+  
+  for (req = LIST_HEAD(&cache->io_queue); req != NULL; req = LIST_NEXT(req, link)) {
+    if (req->block == block && req->write == writing && req->iov_cnt <= iov_room) {
+      return req;
+    }
+  }
+  
+  return NULL;
+}
+
+
+/* @brief   Seek and transfer on dev_fd
+ */
+static ssize_t do_io(struct block_cache *cache, off64_t block, bool writing, struct iovec *iov, int iov_cnt)
+{
+  lseek64(cache->dev_fd, (uint64_t)block * cache->block_size, SEEK_SET);
+  
+  if (writing == true) {
+    return (iov_cnt == 1) ? write(cache->dev_fd, iov[0].iov_base, iov[0].iov_len)
+                          : writev(cache->dev_fd, iov, iov_cnt);
+  }
+  
+  return (iov_cnt == 1) ? read(cache->dev_fd, iov[0].iov_base, iov[0].iov_len)
+                        : readv(cache->dev_fd, iov, iov_cnt);
+}
+
+
+/* @brief   Account for a completed request
+ *
+ * The latency recorded includes the time the request spent queued.
+ */
+static void note_io(struct block_cache *cache, struct blk_io_req *req, struct timespec *start_ts)
+{
+  if (req->write == true) {
+    note_io_latency(cache, &cache->stats.write_lat, cache->prof_write, start_ts);
+  } else {
+    note_io_latency(cache, &cache->stats.read_lat, cache->prof_read, start_ts);
+  }
+  
+  lock_cache(cache);
+  cache->stats.io_req_cnt++;
+  cache->stats.io_depth_sum += req->depth;
+  
+  if (req->depth + 1 > cache->stats.io_depth_max) {
+    cache->stats.io_depth_max = req->depth + 1;
+  }
+  
+  if (req->merged == true) {
+    cache->stats.io_merge_cnt++;
+  } else {
+    cache->stats.io_dispatch_cnt++;
+  }
+  
+  if (req->rc > 0) {
+    if (req->write == true) {
+      cache->stats.writeback_cnt += req->rc / cache->block_size;
+    } else {
+      cache->stats.read_cnt += req->rc / cache->block_size;
+    }
+  }
+  
+  unlock_cache(cache);
+}
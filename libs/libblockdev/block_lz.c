@@ -0,0 +1,270 @@
+/*
+ * Copyright 2023  Marven Gilhespie
+ *
+ * Licensed under the Apache License, segment_id 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+
+/* A small LZ77 codec using the LZ4 block format.
+ *
+ * Used to compress blocks held by the victim tier, see block_victim.c.  A
+ * compressed block is a series of sequences, each a token byte holding the
+ * number of literals in its high nibble and the match length less 4 in its
+ * low nibble, extended by bytes of 255 when the nibble is 15, followed by
+ * the literals and a 2 byte little-endian offset back to the match.  The
+ * last sequence has literals only.
+ *
+ * The compressor finds matches with a single hash table of the positions of
+ * 4 byte sequences, trading ratio for speed.  The decompressor checks every
+ * length and offset so that a corrupt input cannot write outside the output.
+ */
+
+#define LOG_LEVEL_ERROR
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/blockdev.h>
+#include <sys/debug.h>
+#include "block_cache_priv.h"
+
+
+#define LZ_MIN_MATCH        4
+#define LZ_LAST_LITERALS    5           // Input bytes always emitted as literals
+#define LZ_MF_LIMIT         12          // A match must start this far from the end
+#define LZ_MAX_OFFSET       65535
+
+
+static uint8_t *put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lit, int lit_len,
+                             int offset, int match_len);
+static uint8_t *put_length(uint8_t *op, int len);
+static bool get_length(const uint8_t **ip, const uint8_t *iend, int *len);
+
+
+static inline uint32_t read32(const uint8_t *p)
+{
+  uint32_t v;
+  
+  memcpy(&v, p, sizeof v);
+  return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v)
+{
+  return (v * 2654435761U) >> (32 - BLK_LZ_HASH_BITS);
+}
+
+
+/* @brief   Compress a buffer
+ *
+ * @param   src, data to compress
+ * @param   src_len, number of bytes of src
+ * @param   dst, buffer to hold the compressed data
+ * @param   dst_max, size of dst
+ * @param   table, work area of 1 << BLK_LZ_HASH_BITS entries
+ * @return  number of bytes of compressed data, or 0 if it would not fit in
+ *          dst_max bytes
+ */
+int lz_compress(const uint8_t *src, int src_len, uint8_t *dst, int dst_max, uint32_t *table)
+{
+  const uint8_t *ip = src;
+  const uint8_t *anchor = src;
+  const uint8_t *end = src + src_len;
+  const uint8_t *ref;
+  uint8_t *op = dst;
+  uint8_t *oend = dst + dst_max;
+  uint32_t h;
+  int match_len;
+  
+  if (src_len >= LZ_MF_LIMIT) {
+    memset(table, 0, (1 << BLK_LZ_HASH_BITS) * sizeof (uint32_t));
+    
+    while (ip < end - LZ_MF_LIMIT) {
+      h = lz_hash(read32(ip));
+      ref = src + table[h];
+      table[h] = ip - src;
+      
+      if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(ref) != read32(ip)) {
+        ip++;
+        continue;
+      }
+      
+      while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+        ip--;
+        ref--;
+      }
+      
+      for (match_len = LZ_MIN_MATCH; ip + match_len < end - LZ_LAST_LITERALS
+                                     && ip[match_len] == ref[match_len]; match_len++);
+      
+      op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, match_len);
+      
+      if (op == NULL) {
+        return 0;
+      }
+      
+      ip += match_len;
+      anchor = ip;
+    }
+  }
+  
+  op = put_sequence(op, oend, anchor, end - anchor, 0, 0);
+  return (op != NULL) ? op - dst : 0;
+}
+
+
+/* @brief   Decompress a buffer compressed with lz_compress()
+ *
+ * @param   src, compressed data
+ * @param   src_len, number of bytes of compressed data
+ * @param   dst, buffer to hold the decompressed data
+ * @param   dst_len, expected number of bytes of decompressed data
+ * @return  dst_len on success, -1 if the compressed data is corrupt
+ */
+int lz_decompress(const uint8_t *src, int src_len, uint8_t *dst, int dst_len)
+{
+  const uint8_t *ip = src;
+  const uint8_t *iend = src + src_len;
+  const uint8_t *match;
+  uint8_t *op = dst;
+  uint8_t *oend = dst + dst_len;
+  int token;
+  int offset;
+  int len;
+  
+  while (ip < iend) {
+    token = *ip++;
+    len = token >> 4;
+    
+    if (get_length(&ip, iend, &len) == false || len > iend - ip || len > oend - op) {
+      return -1;
+    }
+    
+    memcpy(op, ip, len);
+    op += len;
+    ip += len;
+    
+    if (ip == iend) {
+      break;
+    }
+    
+    if (iend - ip < 2) {
+      return -1;
+    }
+    
+    offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    len = token & 0x0f;
+    
+    if (offset == 0 || offset > op - dst || get_length(&ip, iend, &len) == false) {
+      return -1;
+    }
+    
+    len += LZ_MIN_MATCH;
+    
+    if (len > oend - op) {
+      return -1;
+    }
+    
+    // The match may overlap the bytes being written, copy a byte at a time
+    for (match = op - offset; len > 0; len--) {
+      *op++ = *match++;
+    }
+  }
+  
+  return (op == oend) ? dst_len : -1;
+}
+
+
+/* @brief   Append a sequence to the compressed data
+ *
+ * @return  pointer past the sequence, or NULL if it does not fit
+ *
+ * A sequence with an offset of 0 is the last one and has no match.
+ */
+static uint8_t *put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lit, int lit_len,
+                             int offset, int match_len)
+{
+  uint8_t *token;
+  int ml = match_len - LZ_MIN_MATCH;
+  
+  if (oend - op < 1 + lit_len / 255 + 1 + lit_len + 2 + ml / 255 + 1) {
+    return NULL;
+  }
+  
+  token = op++;
+  *token = (lit_len < 15) ? lit_len << 4 : 15 << 4;
+  
+  if (lit_len >= 15) {
+    op = put_length(op, lit_len - 15);
+  }
+  
+  memcpy(op, lit, lit_len);
+  op += lit_len;
+  
+  if (offset == 0) {
+    return op;
+  }
+  
+  *op++ = offset & 0xff;
+  *op++ = offset >> 8;
+  *token |= (ml < 15) ? ml : 15;
+  
+  if (ml >= 15) {
+    op = put_length(op, ml - 15);
+  }
+  
+  return op;
+}
+
+
+/* @brief   Append the extra bytes of a length whose nibble is 15
+ */
+static uint8_t *put_length(uint8_t *op, int len)
+{
+  while (len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  
+  *op++ = len;
+  return op;
+}
+
+
+/* @brief   Add the extra bytes of a length to its nibble if it is 15
+ *
+ * @return  false if the compressed data ends within the length
+ */
+static bool get_length(const uint8_t **ip, const uint8_t *iend, int *len)
+{
+  int b;
+  
+  if (*len != 15) {
+    return true;
+  }
+  
+  do {
+    if (*ip >= iend) {
+      return false;
+    }
+    
+    b = *(*ip)++;
+    *len += b;
+  } while (b == 255);
+  
+  return true;
+}
+
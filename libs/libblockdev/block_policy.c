@@ -0,0 +1,472 @@
+/*
+ * Copyright 2023  Marven Gilhespie
+ *
+ * Licensed under the Apache License, segment_id 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/* Replacement policies of the block cache.
+ *
+ * Bufs that are not in use sit on one of the cache's queues, which are
+ * protected by the cache lock.  Bufs that do
+ * not hold a valid block are on the free list and are always reused first.
+ *
+ * BLK_POLICY_LRU keeps all other bufs on a single LRU list.  Blocks given the
+ * BLK_HINT_DATA hint are put at the cold end of the list as the VFS will be
+ * caching them too.
+ *
+ * BLK_POLICY_2Q is the simplified 2Q algorithm of Johnson and Shasha.  Blocks
+ * start on the A1in FIFO and only move to the main Am LRU list if they are
+ * referenced again after being evicted from A1in, which is detected through
+ * the A1out ghost list of block numbers.  A large sequential scan therefore
+ * only cycles through A1in and does not evict frequently used metadata from
+ * Am.  Blocks with the BLK_HINT_DATA hint are never promoted to Am.
+ *
+ * A1in must stay in order of admission for a block referenced repeatedly
+ * while on it to still reach A1out and be promoted.  A buf on A1in is
+ * therefore left in place while it is in use, see policy_use(), and skipped
+ * when choosing a victim.  The A1out ghost list holds as many block numbers
+ * as the cache has bufs and is resized along with the cache.
+ */
+
+#define LOG_LEVEL_ERROR
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/blockdev.h>
+#include <sys/panic.h>
+#include <sys/syscalls.h>
+#include <sys/debug.h>
+#include "block_cache_priv.h"
+
+
+static struct buf *first_idle_buf(buf_list_t *list);
+static void a1in_unlink(struct block_cache *cache, struct buf *buf);
+static int init_ghost_list(struct block_cache *cache, int ghost_max);
+static int resize_ghost_list(struct block_cache *cache, int ghost_max);
+static bool ghost_remove(struct block_cache *cache, off64_t block);
+static void ghost_add(struct block_cache *cache, off64_t block);
+static void ghost_unlink(struct block_cache *cache, int idx);
+static uint32_t ghost_hash(struct block_cache *cache, off64_t block);
+
+
+/* @brief   Select the replacement policy of the cache
+ *
+ * @param   cache, the cache to configure
+ * @param   policy, BLK_POLICY_LRU or BLK_POLICY_2Q
+ * @return  0 on success, negative errno on failure
+ *
+ * This is intended to be called straight after init_block_cache().  If the
+ * cache already holds blocks they are moved to the new policy's queues in
+ * their current order of eviction.
+ */
+int set_block_cache_policy(struct block_cache *cache, int policy)
+{
+  buf_list_t victims;
+  struct buf *buf;
+  
+  if (policy != BLK_POLICY_LRU && policy != BLK_POLICY_2Q) {
+    return -EINVAL;
+  }
+
+  lock_cache(cache);
+  
+  if (policy == BLK_POLICY_2Q && cache->ghost_block == NULL) {
+    if (init_ghost_list(cache, cache->buf_cnt) != 0) {
+      unlock_cache(cache);
+      return -ENOMEM;
+    }
+  }  
+
+  LIST_INIT(&victims);
+  
+  while ((buf = LIST_HEAD(&cache->a1in_list)) != NULL) {
+    LIST_REM_HEAD(&cache->a1in_list, lru_link);
+    buf->on_a1in = false;
+    LIST_ADD_TAIL(&victims, buf, lru_link);
+  }
+
+  while ((buf = LIST_HEAD(&cache->lru_list)) != NULL) {
+    LIST_REM_HEAD(&cache->lru_list, lru_link);
+    LIST_ADD_TAIL(&victims, buf, lru_link);
+  }
+
+  cache->a1in_cnt = 0;
+  cache->policy = policy;
+  
+  // Bufs of A1in that are in use are queued when they are released
+  while ((buf = LIST_HEAD(&victims)) != NULL) {
+    LIST_REM_HEAD(&victims, lru_link);
+    buf->queue = (policy == BLK_POLICY_2Q) ? BLK_QUEUE_A1IN : BLK_QUEUE_LRU;
+    
+    if (buf->in_use == false) {
+      policy_insert(cache, buf);
+    }
+  }
+
+  unlock_cache(cache);
+  return 0;
+}
+
+
+/* @brief   Initialize the queues of a cache, selecting the LRU policy
+ */
+void init_policy(struct block_cache *cache)
+{
+  cache->policy = BLK_POLICY_LRU;
+  LIST_INIT(&cache->free_list);
+  LIST_INIT(&cache->lru_list);
+  LIST_INIT(&cache->a1in_list);
+  cache->a1in_cnt = 0;
+  cache->a1in_max = 1;           // Set by update_cache_limits() as bufs are added
+
+  cache->ghost_block = NULL;
+  cache->ghost_next = NULL;
+  cache->ghost_bucket = NULL;
+  cache->ghost_max = 0;
+  cache->ghost_pos = 0;
+  cache->ghost_bucket_mask = 0;
+}
+
+
+/* @brief   Free the policy's resources
+ */
+void free_policy(struct block_cache *cache)
+{
+  free(cache->ghost_block);
+  free(cache->ghost_next);
+  free(cache->ghost_bucket);
+}
+
+
+/* @brief   Resize the A1out ghost list to the number of bufs of the cache
+ *
+ * Called with the cache lock held when the number of bufs changes.  The
+ * most recent entries are kept.  If memory cannot be allocated the list
+ * keeps its current size.
+ */
+void policy_resize(struct block_cache *cache)
+{
+  if (cache->ghost_block != NULL && cache->ghost_max != cache->buf_cnt) {
+    resize_ghost_list(cache, cache->buf_cnt);
+  }
+}
+
+
+/* @brief   Choose the queue a newly read block will be released to
+ *
+ * @param   cache, the cache the buf belongs to
+ * @param   buf, buf that has just been assigned a block
+ */
+void policy_admit(struct block_cache *cache, struct buf *buf)
+{
+  if (cache->policy == BLK_POLICY_2Q) {
+    if (ghost_remove(cache, buf->block) && (buf->flags & BLK_HINT_DATA) == 0) {
+      buf->queue = BLK_QUEUE_LRU;
+      cache->stats.ghost_hit_cnt++;
+    } else {
+      buf->queue = BLK_QUEUE_A1IN;
+    }
+  } else {
+    buf->queue = BLK_QUEUE_LRU;
+  }
+}
+
+
+/* @brief   Place a released buf on its queue
+ *
+ * @param   cache, the cache the buf belongs to
+ * @param   buf, buf no longer in use
+ */
+void policy_insert(struct block_cache *cache, struct buf *buf)
+{
+  // A buf left on A1in while in use keeps its place unless it was
+  // invalidated or moved to another queue meanwhile
+  if (buf->on_a1in == true) {
+    if (buf->valid == true && buf->queue == BLK_QUEUE_A1IN) {
+      return;
+    }
+    
+    a1in_unlink(cache, buf);
+  }
+
+  if (buf->valid == false) {
+    buf->queue = BLK_QUEUE_FREE;
+    LIST_ADD_HEAD(&cache->free_list, buf, lru_link);
+    return;
+  }
+  
+  if (buf->queue == BLK_QUEUE_A1IN) {
+    LIST_ADD_TAIL(&cache->a1in_list, buf, lru_link);
+    buf->on_a1in = true;
+    cache->a1in_cnt++;
+  } else if (cache->policy == BLK_POLICY_LRU && (buf->flags & BLK_HINT_DATA)) {
+    LIST_ADD_HEAD(&cache->lru_list, buf, lru_link);
+  } else {
+    LIST_ADD_TAIL(&cache->lru_list, buf, lru_link);
+  }
+}
+
+
+/* @brief   Take a buf holding a cached block off its queue for a caller to use
+ *
+ * @param   cache, the cache the buf belongs to
+ * @param   buf, buf that is not in use
+ *
+ * A buf on A1in stays on it, in use, so that A1in remains a FIFO.
+ */
+void policy_use(struct block_cache *cache, struct buf *buf)
+{
+  if (buf->on_a1in == false) {
+    policy_remove(cache, buf);
+  }
+}
+
+
+/* @brief   Remove a buf from its queue so that it can be reused or freed
+ *
+ * @param   cache, the cache the buf belongs to
+ * @param   buf, buf to remove, its queue field is kept for policy_insert
+ */
+void policy_remove(struct block_cache *cache, struct buf *buf)
+{
+  switch (buf->queue) {
+    case BLK_QUEUE_FREE:
+      LIST_REM_ENTRY(&cache->free_list, buf, lru_link);
+      break;
+    case BLK_QUEUE_A1IN:
+      a1in_unlink(cache, buf);
+      break;
+    default:
+      LIST_REM_ENTRY(&cache->lru_list, buf, lru_link);
+      break;
+  }
+}
+
+
+/* @brief   Choose a buf to reuse and remove it from its queue
+ *
+ * @param   cache, the cache to take a buf from
+ * @return  buf to reuse or NULL if all bufs are in use or busy
+ *
+ * Bufs that are busy being written are skipped.
+ */
+struct buf *policy_victim(struct block_cache *cache)
+{
+  struct buf *buf;
+  
+  if ((buf = first_idle_buf(&cache->free_list)) != NULL) {
+    LIST_REM_ENTRY(&cache->free_list, buf, lru_link);
+    return buf;
+  }
+  
+  if ((buf = first_idle_buf(&cache->a1in_list)) != NULL
+        && (cache->a1in_cnt > cache->a1in_max || first_idle_buf(&cache->lru_list) == NULL)) {
+    a1in_unlink(cache, buf);
+
+    if (cache->policy == BLK_POLICY_2Q) {
+      ghost_add(cache, buf->block);
+    }
+    return buf;
+  }
+  
+  if ((buf = first_idle_buf(&cache->lru_list)) != NULL) {
+    LIST_REM_ENTRY(&cache->lru_list, buf, lru_link);
+    return buf;
+  }
+
+  return NULL;
+}
+
+
+/* @brief   Find the first buf of a queue that is not busy being written or,
+ *          on A1in, in use
+ */
+static struct buf *first_idle_buf(buf_list_t *list)
+{
+  struct buf *buf;
+  
+  buf = LIST_HEAD(list);
+  
+  while (buf != NULL && (buf->busy == true || buf->in_use == true)) {
+    buf = LIST_NEXT(buf, lru_link);
+  }
+  
+  return buf;
+}
+
+
+/* @brief   Remove a buf from A1in
+ */
+static void a1in_unlink(struct block_cache *cache, struct buf *buf)
+{
+  LIST_REM_ENTRY(&cache->a1in_list, buf, lru_link);
+  buf->on_a1in = false;
+  cache->a1in_cnt--;
+}
+
+
+/* @brief   Allocate the A1out ghost list of 2Q
+ *
+ * The ghost list is a ring of block numbers with a small chained hash table
+ * indexing it.  The oldest entry is overwritten when the ring is full.
+ */
+static int init_ghost_list(struct block_cache *cache, int ghost_max)
+{
+  int bucket_cnt;
+  
+  if (ghost_max < 1) {
+    ghost_max = 1;
+  }
+
+  for (bucket_cnt = 1; bucket_cnt < ghost_max; bucket_cnt *= 2);
+  
+  cache->ghost_block = malloc(ghost_max * sizeof (off64_t));
+  cache->ghost_next = malloc(ghost_max * sizeof (int));
+  cache->ghost_bucket = malloc(bucket_cnt * sizeof (int));
+  
+  if (cache->ghost_block == NULL || cache->ghost_next == NULL || cache->ghost_bucket == NULL) {
+    free_policy(cache);
+    cache->ghost_block = NULL;
+    cache->ghost_next = NULL;
+    cache->ghost_bucket = NULL;
+    return -ENOMEM;
+  }
+  
+  for (int t = 0; t < ghost_max; t++) {
+    cache->ghost_block[t] = -1;
+    cache->ghost_next[t] = -1;
+  }
+  
+  for (int t = 0; t < bucket_cnt; t++) {
+    cache->ghost_bucket[t] = -1;
+  }
+  
+  cache->ghost_max = ghost_max;
+  cache->ghost_pos = 0;
+  cache->ghost_bucket_mask = bucket_cnt - 1;
+  return 0;
+}
+
+
+/* @brief   Resize the ghost list, keeping its most recent entries
+ *
+ * @return  0 on success, -ENOMEM if the list keeps its current size
+ */
+static int resize_ghost_list(struct block_cache *cache, int ghost_max)
+{
+  off64_t *old_block = cache->ghost_block;
+  int *old_next = cache->ghost_next;
+  int *old_bucket = cache->ghost_bucket;
+  int old_max = cache->ghost_max;
+  int old_pos = cache->ghost_pos;
+  int old_mask = cache->ghost_bucket_mask;
+  int idx;
+  
+  if (init_ghost_list(cache, ghost_max) != 0) {
+    cache->ghost_block = old_block;
+    cache->ghost_next = old_next;
+    cache->ghost_bucket = old_bucket;
+    cache->ghost_max = old_max;
+    cache->ghost_pos = old_pos;
+    cache->ghost_bucket_mask = old_mask;
+    return -ENOMEM;
+  }
+  
+  // Re-add oldest first, ghost_pos is the oldest entry of a full ring
+  for (int t = 0; t < old_max; t++) {
+    idx = (old_pos + t) % old_max;
+    
+    if (old_block[idx] != -1) {
+      ghost_add(cache, old_block[idx]);
+    }
+  }
+  
+  free(old_block);
+  free(old_next);
+  free(old_bucket);
+  return 0;
+}
+
+
+/* @brief   Remove a block from the ghost list
+ *
+ * @return  true if the block was on the ghost list
+ */
+static bool ghost_remove(struct block_cache *cache, off64_t block)
+{
+  int idx;
+  
+  idx = cache->ghost_bucket[ghost_hash(cache, block)];
+  
+  while (idx != -1) {
+    if (cache->ghost_block[idx] == block) {
+      ghost_unlink(cache, idx);
+      cache->ghost_block[idx] = -1;
+      return true;
+    }
+    
+    idx = cache->ghost_next[idx];
+  }
+  
+  return false;
+}
+
+
+/* @brief   Add a block evicted from A1in to the ghost list
+ */
+static void ghost_add(struct block_cache *cache, off64_t block)
+{
+  uint32_t hash;
+  int idx;
+  
+  idx = cache->ghost_pos;
+  cache->ghost_pos = (cache->ghost_pos + 1) % cache->ghost_max;
+
+  if (cache->ghost_block[idx] != -1) {
+    ghost_unlink(cache, idx);
+  }
+  
+  hash = ghost_hash(cache, block);
+  cache->ghost_block[idx] = block;
+  cache->ghost_next[idx] = cache->ghost_bucket[hash];
+  cache->ghost_bucket[hash] = idx;
+}
+
+
+/* @brief   Unlink a ghost list entry from its hash chain
+ */
+static void ghost_unlink(struct block_cache *cache, int idx)
+{
+  int *link;
+  
+  link = &cache->ghost_bucket[ghost_hash(cache, cache->ghost_block[idx])];
+  
+  while (*link != idx) {
+    link = &cache->ghost_next[*link];
+  }
+  
+  *link = cache->ghost_next[idx];
+  cache->ghost_next[idx] = -1;
+}
+
+
+/* @brief   Hash a block number into a ghost list bucket
+ */
+static uint32_t ghost_hash(struct block_cache *cache, off64_t block)
+{
+  return (uint32_t)block_hash(block) & cache->ghost_bucket_mask;
+}
+
@@ -0,0 +1,371 @@
+/*
+ * Copyright 2023  Marven Gilhespie
+ *
+ * Licensed under the Apache License, segment_id 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+
+/* Shared buffer pool.
+ *
+ * A pool is a single region of memory divided into chunks of
+ * BLK_POOL_CHUNK_SZ bytes that the caches created with
+ * init_pooled_block_cache() draw their bufs from, so that a busy cache can
+ * use memory that an idle one does not need.  Each cache reserves a minimum
+ * number of chunks when it is created, chunks above the minimums are lent to
+ * whichever caches need them.
+ *
+ * A pooled cache that misses while the pool has a free chunk takes it.  Once
+ * the pool is exhausted the pool is rebalanced every
+ * BLK_POOL_REBALANCE_MISSES misses of a cache.  The cost of each cache's
+ * misses since the last rebalance is the time spent reading from its device.
+ * A chunk is moved to the cache with the highest cost from the cache with
+ * the lowest cost that holds more than its minimum, if the highest cost is
+ * more than twice the lowest.  A chunk is only taken from a cache when none
+ * of its bufs are in use or busy, its dirty blocks are written first.
+ *
+ * The pool lock protects the pool, its list of caches and the pool fields
+ * of each cache.  It is taken before any lock of a cache and is never taken
+ * with one held.  Pooled caches are always concurrent as their bufs are
+ * added and removed by threads using other caches.
+ */
+
+#define LOG_LEVEL_ERROR
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/blockdev.h>
+#include <sys/panic.h>
+#include <sys/debug.h>
+#include <sys/mman.h>
+#include <sys/syscalls.h>
+#include "block_cache_priv.h"
+
+
+static int grow_cache(struct blk_pool *pool, struct block_cache *cache);
+static void *take_pool_chunk(struct blk_pool *pool, struct block_cache *cache);
+static bool reclaim_chunk(struct block_cache *cache);
+static void rebalance_pool(struct blk_pool *pool);
+static void update_pool_costs(struct blk_pool *pool);
+
+
+/* @brief   Create a pool of memory to be shared by block caches
+ *
+ * @param   pool_sz, size of the pool in bytes, rounded down to a multiple
+ *          of BLK_POOL_CHUNK_SZ
+ * @return  the pool or NULL on failure
+ */
+struct blk_pool *init_block_pool(size_t pool_sz)
+{
+  struct blk_pool *pool;
+  int chunk_cnt;
+  
+  chunk_cnt = pool_sz / BLK_POOL_CHUNK_SZ;
+  
+  if (chunk_cnt == 0) {
+    panic("bad params to init_block_pool, pool_sz:%u", (uint32_t)pool_sz);
+  }
+  
+  if ((pool = malloc(sizeof (struct blk_pool))) != NULL) {
+    if ((pool->free_chunk = malloc(chunk_cnt * sizeof (void *))) != NULL) {
+      if ((pool->mem = mmap(NULL, chunk_cnt * BLK_POOL_CHUNK_SZ, PROT_READ | PROT_WRITE, BLK_MMAP_FLAGS, -1, 0)) != MAP_FAILED) {
+        pool->chunk_cnt = chunk_cnt;
+        pool->reserved_cnt = 0;
+        pool->free_cnt = 0;
+        
+        // Push the chunks so that the first chunk is taken first
+        for (int t = chunk_cnt - 1; t >= 0; t--) {
+          pool->free_chunk[pool->free_cnt++] = (uint8_t *)pool->mem + (size_t)t * BLK_POOL_CHUNK_SZ;
+        }
+        
+        LIST_INIT(&pool->cache_list);
+        pthread_mutex_init(&pool->lock, NULL);
+        return pool;
+      }
+      
+      free(pool->free_chunk);
+    }
+    
+    free(pool);
+  }
+  
+  log_error("libblockdev: failed to initialize pool");
+  return NULL;
+}
+
+
+/* @brief   Free a pool
+ *
+ * @param   pool, pool to free
+ * @return  0 on success, -EBUSY if any cache still uses the pool
+ */
+int free_block_pool(struct blk_pool *pool)
+{
+  if (LIST_HEAD(&pool->cache_list) != NULL) {
+    return -EBUSY;
+  }
+  
+  pthread_mutex_destroy(&pool->lock);
+  munmap(pool->mem, pool->chunk_cnt * BLK_POOL_CHUNK_SZ);
+  free(pool->free_chunk);
+  free(pool);
+  return 0;
+}
+
+
+/* @brief   Initialize a block cache drawing its bufs from a pool
+ *
+ * @param   pool, pool to draw bufs from
+ * @param   dev_fd, handle to block device to read and write from
+ * @param   min_buf_cnt, number of bufs reserved for the cache, rounded up
+ *          to a whole number of chunks
+ * @param   block_size, size of blocks used by file system, at most
+ *          BLK_POOL_CHUNK_SZ
+ * @param   read_ahead_blocks, maximum number of blocks get_block_readahead
+ *          reads at a time, limited to half of the cache's bufs
+ * @return  pointer to block_cache structure or NULL on failure
+ *
+ * The cache is concurrent and is freed with free_cache().  Initialization
+ * fails if the pool cannot satisfy the reservation, either because the
+ * minimums of other caches take too much of it or because chunks lent to
+ * other caches are in use.
+ */
+struct block_cache *init_pooled_block_cache(struct blk_pool *pool, int dev_fd, int min_buf_cnt,
+                                            size_t block_size, int read_ahead_blocks)
+{
+  struct block_cache *cache;
+  int chunk_buf_cnt;
+  int min_chunks;
+  
+  if (min_buf_cnt < 1 || block_size < 512 || block_size > BLK_POOL_CHUNK_SZ) {
+    panic("bad params to init_pooled_block_cache, buf_cnt:%d blk_size:%zu", min_buf_cnt, block_size);
+  }
+  
+  chunk_buf_cnt = BLK_POOL_CHUNK_SZ / block_size;
+  min_chunks = (min_buf_cnt + chunk_buf_cnt - 1) / chunk_buf_cnt;
+  
+  if ((cache = alloc_cache(dev_fd, min_chunks * chunk_buf_cnt, block_size, read_ahead_blocks)) == NULL) {
+    log_error("libblockdev: failed to initialize cache");
+    return NULL;
+  }
+  
+  cache->concurrent = true;
+  cache->pool = pool;
+  cache->pool_min_chunks = min_chunks;
+
+  pthread_mutex_lock(&pool->lock);
+  LIST_ADD_TAIL(&pool->cache_list, cache, pool_link);
+  pool->reserved_cnt += min_chunks;
+  
+  if (pool->reserved_cnt <= pool->chunk_cnt) {
+    while (cache->chunk_cnt < min_chunks && grow_cache(pool, cache) == 0);
+  }
+  
+  pthread_mutex_unlock(&pool->lock);
+  
+  if (cache->chunk_cnt < min_chunks) {
+    destroy_cache(cache);
+    log_error("libblockdev: pool cannot reserve %d chunks", min_chunks);
+    return NULL;
+  }
+  
+  return cache;
+}
+
+
+/* @brief   Give the pool of a cache the chance to add bufs to it on a miss
+ *
+ * @param   cache, the cache that missed
+ *
+ * Called with no locks held.  Does nothing for a cache without a pool.
+ */
+void pool_note_miss(struct block_cache *cache)
+{
+  struct blk_pool *pool = cache->pool;
+  
+  if (pool == NULL) {
+    return;
+  }
+  
+  pthread_mutex_lock(&pool->lock);
+  
+  if (pool->free_cnt > 0) {
+    grow_cache(pool, cache);
+  } else if (++cache->pool_miss_cnt >= BLK_POOL_REBALANCE_MISSES) {
+    cache->pool_miss_cnt = 0;
+    rebalance_pool(pool);
+  }
+  
+  pthread_mutex_unlock(&pool->lock);
+}
+
+
+/* @brief   Remove a cache from its pool, returning the memory of its chunks
+ *
+ * The chunks themselves are freed by the caller.
+ */
+void detach_pool(struct block_cache *cache)
+{
+  struct blk_pool *pool = cache->pool;
+  
+  pthread_mutex_lock(&pool->lock);
+  LIST_REM_ENTRY(&pool->cache_list, cache, pool_link);
+  pool->reserved_cnt -= cache->pool_min_chunks;
+  
+  for (int t = 0; t < cache->chunk_cnt; t++) {
+    pool->free_chunk[pool->free_cnt++] = cache->chunk[t]->mem;
+  }
+  
+  pthread_mutex_unlock(&pool->lock);
+}
+
+
+/* @brief   Add a chunk of the pool to a cache
+ *
+ * @param   pool, the pool, locked by the caller
+ * @param   cache, the cache to grow
+ * @return  0 on success, negative errno on failure
+ */
+static int grow_cache(struct blk_pool *pool, struct block_cache *cache)
+{
+  struct blk_chunk *chunk;
+  void *mem;
+  
+  if ((mem = take_pool_chunk(pool, cache)) == NULL) {
+    return -ENOMEM;
+  }
+  
+  if ((chunk = alloc_chunk(cache, BLK_POOL_CHUNK_SZ / cache->block_size, pool, mem)) != NULL) {
+    if (add_chunk(cache, chunk) == 0) {
+      return 0;
+    }
+    
+    free_chunk(cache, chunk);
+  }
+  
+  pool->free_chunk[pool->free_cnt++] = mem;
+  return -ENOMEM;
+}
+
+
+/* @brief   Take a free chunk of memory from the pool
+ *
+ * @param   pool, the pool, locked by the caller
+ * @param   cache, the cache the chunk is for
+ * @return  the chunk's memory or NULL if none is available
+ *
+ * If no chunk is free one is reclaimed from a cache above its minimum.  This
+ * is only needed when a new cache's minimum is reserved.
+ */
+static void *take_pool_chunk(struct blk_pool *pool, struct block_cache *cache)
+{
+  struct block_cache *donor;
+  
+  if (pool->free_cnt == 0) {
+    for (donor = LIST_HEAD(&pool->cache_list); donor != NULL; donor = LIST_NEXT(donor, pool_link)) {
+      if (donor != cache && donor->chunk_cnt > donor->pool_min_chunks && reclaim_chunk(donor) == true) {
+        break;
+      }
+    }
+  }
+  
+  if (pool->free_cnt == 0) {
+    return NULL;
+  }
+  
+  return pool->free_chunk[--pool->free_cnt];
+}
+
+
+/* @brief   Return the last chunk of a cache to its pool
+ *
+ * @param   cache, the cache, holding more chunks than its minimum
+ * @return  true if the chunk was returned, false if any of its bufs are in
+ *          use or busy
+ *
+ * Called with the pool lock held.
+ */
+static bool reclaim_chunk(struct block_cache *cache)
+{
+  struct blk_pool *pool = cache->pool;
+  struct blk_chunk *chunk;
+  
+  if ((chunk = remove_chunk(cache, cache->chunk_cnt - 1)) == NULL) {
+    return false;
+  }
+  
+  pool->free_chunk[pool->free_cnt++] = chunk->mem;
+  free_chunk(cache, chunk);
+  return true;
+}
+
+
+/* @brief   Move a chunk towards the cache whose misses cost the most
+ *
+ * @param   pool, the pool, locked by the caller
+ */
+static void rebalance_pool(struct blk_pool *pool)
+{
+  struct block_cache *cache;
+  struct block_cache *receiver = NULL;
+  struct block_cache *donor = NULL;
+  
+  update_pool_costs(pool);
+  
+  for (cache = LIST_HEAD(&pool->cache_list); cache != NULL; cache = LIST_NEXT(cache, pool_link)) {
+    if (receiver == NULL || cache->pool_cost > receiver->pool_cost) {
+      receiver = cache;
+    }
+  }
+  
+  for (cache = LIST_HEAD(&pool->cache_list); cache != NULL; cache = LIST_NEXT(cache, pool_link)) {
+    if (cache != receiver && cache->chunk_cnt > cache->pool_min_chunks
+          && (donor == NULL || cache->pool_cost < donor->pool_cost)) {
+      donor = cache;
+    }
+  }
+  
+  if (donor == NULL || receiver->pool_cost <= 2 * donor->pool_cost) {
+    return;
+  }
+  
+  if (reclaim_chunk(donor) == true) {
+    grow_cache(pool, receiver);
+  }
+}
+
+
+/* @brief   Take the device read time of each cache since the last rebalance
+ *
+ * @param   pool, the pool, locked by the caller
+ *
+ * A cache whose statistics were reset since is charged with all of its
+ * read time since the reset.
+ */
+static void update_pool_costs(struct blk_pool *pool)
+{
+  struct block_cache *cache;
+  uint64_t read_usec;
+  
+  for (cache = LIST_HEAD(&pool->cache_list); cache != NULL; cache = LIST_NEXT(cache, pool_link)) {
+    lock_cache(cache);
+    read_usec = cache->stats.read_lat.sum_usec;
+    unlock_cache(cache);
+    
+    cache->pool_cost = (read_usec >= cache->pool_cost_mark) ? read_usec - cache->pool_cost_mark : read_usec;
+    cache->pool_cost_mark = read_usec;
+  }
+}
+
@@ -0,0 +1,355 @@
+/*
+ * Copyright 2023  Marven Gilhespie
+ *
+ * Licensed under the Apache License, segment_id 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+
+/* Hot set snapshots and cache prewarming.
+ *
+ * block_cache_save_hot_set() writes the block numbers of the blocks held by
+ * the cache to a small file, hottest first: blocks in use, then the blocks
+ * of the LRU list (the Am list of 2Q) from most to least recently used, then
+ * the blocks of the 2Q A1in list from newest to oldest.  A file system server
+ * saves its hot set at shutdown or on demand.
+ *
+ * block_cache_prewarm() reads a hot set back when the file system is
+ * mounted.  The hottest blocks that fit in the cache are sorted and read in
+ * runs of consecutive blocks, so that the random metadata reads of the first
+ * seconds after boot become a few sequential reads.  With the I/O worker
+ * running the runs are read in the background once no other requests are
+ * queued, otherwise they are read before returning.
+ *
+ * The file is a header followed by the block numbers as 64 bit integers in
+ * the byte order of the host.
+ */
+
+#define LOG_LEVEL_ERROR
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/blockdev.h>
+#include <sys/panic.h>
+#include <sys/debug.h>
+#include "block_cache_priv.h"
+
+
+#define BLK_HOT_SET_MAGIC     0x53544f48    // "HOTS"
+
+
+/*
+ * @brief   Header of a hot set file
+ */
+struct blk_hot_set_hdr
+{
+  uint32_t magic;
+  uint32_t block_size;
+  uint32_t cnt;
+  uint32_t reserved;
+};
+
+
+static off64_t *collect_hot_set(struct block_cache *cache, int *cnt);
+static int add_list(buf_list_t *list, off64_t *block, int cnt);
+static int read_hot_set(struct block_cache *cache, const char *path, off64_t **block);
+static int cmp_block(const void *a, const void *b);
+
+
+/* @brief   Save the block numbers of the hottest blocks in the cache
+ *
+ * @param   cache, the cache to take a snapshot of
+ * @param   path, file to write the hot set to
+ * @param   max_blocks, maximum number of blocks to save, 0 for all
+ * @return  number of blocks saved, or negative errno on failure
+ */
+int block_cache_save_hot_set(struct block_cache *cache, const char *path, int max_blocks)
+{
+  struct blk_hot_set_hdr hdr;
+  off64_t *block;
+  ssize_t sz;
+  int cnt;
+  int fd;
+  int sc = 0;
+  
+  if ((block = collect_hot_set(cache, &cnt)) == NULL) {
+    return -ENOMEM;
+  }
+  
+  if (max_blocks > 0 && cnt > max_blocks) {
+    cnt = max_blocks;
+  }
+  
+  if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+    sc = -errno;
+    free(block);
+    return sc;
+  }
+  
+  hdr.magic = BLK_HOT_SET_MAGIC;
+  hdr.block_size = cache->block_size;
+  hdr.cnt = cnt;
+  hdr.reserved = 0;
+  sz = cnt * sizeof (off64_t);
+  
+  if (write(fd, &hdr, sizeof hdr) != sizeof hdr || write(fd, block, sz) != sz) {
+    log_error("libblockdev: failed to write hot set");
+    sc = -EIO;
+  }
+  
+  if (close(fd) != 0 && sc == 0) {
+    sc = -EIO;
+  }
+  
+  free(block);
+  return (sc == 0) ? cnt : sc;
+}
+
+
+/* @brief   Read the blocks of a saved hot set into the cache
+ *
+ * @param   cache, the cache to prewarm
+ * @param   path, file the hot set was saved to
+ * @return  number of blocks to be read, or negative errno on failure.
+ *          -EINVAL if the file is not a hot set of the cache's block size.
+ *
+ * Only as many of the hottest blocks as fit in half the cache are read, so
+ * that prewarming does not evict itself.  Blocks already cached are not read
+ * again.  With the I/O worker running this replaces any prewarm still in
+ * progress and returns without waiting for the blocks to be read.
+ */
+int block_cache_prewarm(struct block_cache *cache, const char *path)
+{
+  off64_t *block;
+  off64_t *old;
+  int issued;
+  int cnt;
+  int run;
+  
+  if ((cnt = read_hot_set(cache, path, &block)) <= 0) {
+    return cnt;
+  }
+  
+  qsort(block, cnt, sizeof (off64_t), cmp_block);
+  
+  if (cache->async == true) {
+    pthread_mutex_lock(&cache->async_lock);
+    old = cache->prewarm_block;
+    cache->prewarm_block = block;
+    cache->prewarm_cnt = cnt;
+    cache->prewarm_pos = 0;
+    pthread_cond_signal(&cache->async_cond);
+    pthread_mutex_unlock(&cache->async_lock);
+    free(old);
+    return cnt;
+  }
+  
+  for (int t = 0; t < cnt; t += run) {
+    run = prewarm_run(&block[t], cnt - t);
+    issued = read_block_range(cache, block[t], prewarm_run_blocks(&block[t], run),
+                              NULL, BLK_RA_STREAM_CNT);
+    lock_cache(cache);
+    cache->stats.ra_issued_cnt += issued;
+    unlock_cache(cache);
+  }
+  
+  free(block);
+  return cnt;
+}
+
+
+/* @brief   Get the length of the run of consecutive blocks at the start of
+ *          a sorted array of block numbers
+ *
+ * @param   block, sorted block numbers
+ * @param   cnt, number of entries in block
+ * @return  number of entries in the run, including duplicates
+ *
+ * A run spans at most BLK_MAX_IOV blocks, see prewarm_run_blocks().
+ */
+int prewarm_run(off64_t *block, int cnt)
+{
+  int run;
+  
+  for (run = 1; run < cnt; run++) {
+    if (block[run] - block[0] >= BLK_MAX_IOV ||
+        block[run] - block[run - 1] > 1) {
+      break;
+    }
+  }
+  
+  return run;
+}
+
+
+/* @brief   Get the number of blocks spanned by a run found by prewarm_run()
+ */
+int prewarm_run_blocks(off64_t *block, int run)
+{
+  return block[run - 1] - block[0] + 1;
+}
+
+
+/* @brief   Collect the block numbers of a cache, hottest first
+ *
+ * @param   cache, the cache to take a snapshot of
+ * @param   cnt, set to the number of blocks collected
+ * @return  array of block numbers to free(), or NULL if out of memory
+ */
+static off64_t *collect_hot_set(struct block_cache *cache, int *cnt)
+{
+  struct blk_chunk *chunk;
+  struct buf *buf;
+  off64_t *block;
+  off64_t tmp;
+  int buf_cnt;
+  int n;
+  
+  // The cache of a pool may grow between sizing the array and filling it
+  do {
+    lock_cache(cache);
+    buf_cnt = cache->buf_cnt;
+    unlock_cache(cache);
+    
+    if ((block = malloc(buf_cnt * sizeof (off64_t))) == NULL) {
+      return NULL;
+    }
+    
+    lock_cache(cache);
+    
+    if (cache->buf_cnt <= buf_cnt) {
+      break;
+    }
+    
+    unlock_cache(cache);
+    free(block);
+  } while (true);
+  
+  // The lists run from least to most recently used, collect coldest first
+  n = add_list(&cache->a1in_list, block, 0);
+  n = add_list(&cache->lru_list, block, n);
+  
+  for (int c = 0; c < cache->chunk_cnt; c++) {
+    chunk = cache->chunk[c];
+    
+    for (int t = 0; t < chunk->buf_cnt; t++) {
+      buf = &chunk->buf[t];
+      
+      if (buf->in_use == true && buf->valid == true) {
+        block[n++] = buf->block;
+      }
+    }
+  }
+  
+  unlock_cache(cache);
+  
+  for (int t = 0; t < n / 2; t++) {
+    tmp = block[t];
+    block[t] = block[n - 1 - t];
+    block[n - 1 - t] = tmp;
+  }
+  
+  *cnt = n;
+  return block;
+}
+
+
+/* @brief   Append the blocks of a policy list to an array
+ *
+ * @return  number of entries in block
+ */
+static int add_list(buf_list_t *list, off64_t *block, int cnt)
+{
+  struct buf *buf;
+  
+  for (buf = LIST_HEAD(list); buf != NULL; buf = LIST_NEXT(buf, lru_link)) {
+    if (buf->valid == true && buf->in_use == false) {
+      block[cnt++] = buf->block;
+    }
+  }
+  
+  return cnt;
+}
+
+
+/* @brief   Read the hottest blocks of a hot set file that fit in the cache
+ *
+ * @param   cache, the cache to prewarm
+ * @param   path, file the hot set was saved to
+ * @param   block, set to an array of block numbers to free()
+ * @return  number of block numbers read, or negative errno on failure
+ */
+static int read_hot_set(struct block_cache *cache, const char *path, off64_t **block)
+{
+  struct blk_hot_set_hdr hdr;
+  ssize_t sz;
+  int cnt;
+  int fd;
+  
+  *block = NULL;
+  
+  if ((fd = open(path, O_RDONLY)) == -1) {
+    return -errno;
+  }
+  
+  if (read(fd, &hdr, sizeof hdr) != sizeof hdr ||
+      hdr.magic != BLK_HOT_SET_MAGIC || hdr.block_size != cache->block_size) {
+    close(fd);
+    return -EINVAL;
+  }
+  
+  lock_cache(cache);
+  cnt = cache->buf_cnt / 2;
+  unlock_cache(cache);
+  
+  if (hdr.cnt < (uint32_t)cnt) {
+    cnt = hdr.cnt;
+  }
+  
+  if (cnt == 0) {
+    close(fd);
+    return 0;
+  }
+  
+  if ((*block = malloc(cnt * sizeof (off64_t))) == NULL) {
+    close(fd);
+    return -ENOMEM;
+  }
+  
+  sz = cnt * sizeof (off64_t);
+  
+  if (read(fd, *block, sz) != sz) {
+    close(fd);
+    free(*block);
+    return -EINVAL;
+  }
+  
+  close(fd);
+  return cnt;
+}
+
+
+/* @brief   Compare block numbers for qsort()
+ */
+static int cmp_block(const void *a, const void *b)
+{
+  off64_t x = *(const off64_t *)a;
+  off64_t y = *(const off64_t *)b;
+  
+  return (x > y) - (x < y);
+}
+
@@ -0,0 +1,270 @@
+/*
+ * Copyright 2023  Marven Gilhespie
+ *
+ * Licensed under the Apache License, segment_id 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/* Adaptive readahead for the block cache.
+ *
+ * The cache tracks a small number of streams of get_block_readahead() calls.
+ * A call for the block following the previous call of a stream confirms the
+ * stream is sequential.  Any other call starts a new stream, replacing the
+ * least recently used one, with a window of a single block so that random
+ * access does not read ahead at all.
+ *
+ * A sequential stream reads its next window when it misses or comes within
+ * half a window of the end of the blocks it has read ahead, doubling the
+ * window each time up to the read_ahead_blocks passed to init_block_cache().
+ * A block read ahead that is evicted before it is used halves the window of
+ * its stream.
+ *
+ * The streams and counters are protected by the cache lock.
+ */
+
+#define LOG_LEVEL_ERROR
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/blockdev.h>
+#include <sys/panic.h>
+#include <sys/syscalls.h>
+#include <sys/debug.h>
+#include "block_cache_priv.h"
+
+
+static struct blk_ra_stream *update_ra_stream(struct block_cache *cache, off64_t block, bool *sequential);
+static void grow_ra_window(struct block_cache *cache, struct blk_ra_stream *stream);
+
+
+/* @brief   Get a block and read-ahead additional blocks
+ *
+ * Gets a block and, if access to it is part of a sequential stream, reads
+ * ahead in anticipation that consecutive blocks will be needed soon.  Runs of
+ * consecutive blocks that are not cached are read from the device with a
+ * single readv.
+ *
+ * TODO: Limit block numbers to partition bounds
+ */
+struct buf *get_block_readahead(struct block_cache *cache, off64_t start_block)
+{
+  struct blk_ra_stream *stream;
+  struct buf *buf;
+  off64_t ra_start = 0;
+  bool sequential;
+  bool hit;
+  int count = 0;
+  int issued;
+  
+  trace_op(cache, BLK_TRACE_READAHEAD, start_block, 1, 0);
+  buf = acquire_buf(cache, start_block, 0, true, &hit);
+  
+  lock_cache(cache);
+  stream = update_ra_stream(cache, start_block, &sequential);
+
+  if (hit == false) {
+    if (sequential) {
+      grow_ra_window(cache, stream);
+    }
+
+    ra_start = start_block;
+    count = stream->window;
+  } else if (sequential && stream->ra_end - start_block <= stream->window / 2) {
+    grow_ra_window(cache, stream);
+    ra_start = (stream->ra_end > start_block) ? stream->ra_end : start_block + 1;
+    count = stream->window;
+  }
+  
+  unlock_cache(cache);
+  
+  if (count > 0) {
+    issued = read_block_range(cache, ra_start, count, (hit) ? NULL : buf, stream - cache->ra_stream);
+
+    lock_cache(cache);
+    stream->ra_end = ra_start + count;
+    cache->stats.ra_issued_cnt += issued;
+    unlock_cache(cache);
+  }
+  
+  return buf;
+}
+
+
+/* @brief   Reset the readahead streams of a cache
+ */
+void init_ra_streams(struct block_cache *cache)
+{
+  for (int t = 0; t < BLK_RA_STREAM_CNT; t++) {
+    cache->ra_stream[t].next_block = -1;
+    cache->ra_stream[t].ra_end = -1;
+    cache->ra_stream[t].window = 1;
+    cache->ra_stream[t].last_used = 0;
+  }
+  
+  cache->ra_clock = 0;
+}
+
+
+/* @brief   Account for a block being used from the cache
+ *
+ * @param   cache, the cache the buf belongs to
+ * @param   buf, the buf being handed to a caller
+ *
+ * Called with the cache lock held.
+ */
+void ra_note_hit(struct block_cache *cache, struct buf *buf)
+{
+  if (buf->prefetched == true) {
+    buf->prefetched = false;
+    cache->stats.ra_hit_cnt++;
+  }
+}
+
+
+/* @brief   Account for a block read ahead being evicted before it was used
+ *
+ * @param   cache, the cache the buf belongs to
+ * @param   buf, the buf being evicted
+ *
+ * Called with the cache lock held.
+ */
+void ra_note_evict(struct block_cache *cache, struct buf *buf)
+{
+  struct blk_ra_stream *stream;
+  
+  buf->prefetched = false;
+  cache->stats.ra_wasted_cnt++;
+
+  // Blocks queued by prefetch_blocks() do not belong to a stream
+  if (buf->ra_stream >= BLK_RA_STREAM_CNT) {
+    return;
+  }
+  
+  stream = &cache->ra_stream[buf->ra_stream];
+
+  if (stream->window > 1) {
+    stream->window /= 2;
+  }
+}
+
+
+/* @brief   Find the stream an access belongs to or start a new one
+ *
+ * @param   cache, the cache being accessed
+ * @param   block, block being accessed
+ * @param   sequential, set to true if the access continues an existing stream
+ * @return  the stream of the access, with its window updated
+ */
+static struct blk_ra_stream *update_ra_stream(struct block_cache *cache, off64_t block, bool *sequential)
+{
+  struct blk_ra_stream *stream;
+  struct blk_ra_stream *lru_stream;
+  
+  cache->ra_clock++;
+  lru_stream = &cache->ra_stream[0];
+  
+  for (int t = 0; t < BLK_RA_STREAM_CNT; t++) {
+    stream = &cache->ra_stream[t];
+    
+    if (stream->next_block == block) {
+      stream->next_block = block + 1;
+      stream->last_used = cache->ra_clock;
+      *sequential = true;
+      return stream;
+    }
+    
+    if ((int32_t)(stream->last_used - lru_stream->last_used) < 0) {
+      lru_stream = stream;
+    }
+  }
+  
+  lru_stream->next_block = block + 1;
+  lru_stream->ra_end = block;
+  lru_stream->window = 1;
+  lru_stream->last_used = cache->ra_clock;
+  *sequential = false;
+  return lru_stream;
+}
+
+
+/* @brief   Double the readahead window of a stream
+ */
+static void grow_ra_window(struct block_cache *cache, struct blk_ra_stream *stream)
+{
+  stream->window *= 2;
+  
+  if (stream->window > cache->read_ahead_blocks) {
+    stream->window = cache->read_ahead_blocks;
+  }
+}
+
+
+/* @brief   Read a range of blocks into the cache
+ *
+ * @param   cache, the cache to read blocks into
+ * @param   start_block, first block of the range
+ * @param   count, number of blocks
+ * @param   first, buf already assigned to start_block that the caller will
+ *          keep in use, or NULL
+ * @param   ra_stream, index of the stream the blocks are read for, or
+ *          BLK_RA_STREAM_CNT if they do not belong to a stream
+ * @return  number of blocks read other than first
+ *
+ * Blocks of the range that are already cached are not read again.  The
+ * range is processed in chunks of up to BLK_MAX_IOV blocks.  Blocks read
+ * are marked as prefetched until they are used.
+ */
+int read_block_range(struct block_cache *cache, off64_t start_block, int count, struct buf *first, int ra_stream)
+{
+  struct buf *buf[BLK_MAX_IOV];
+  bool hit;
+  int chunk;
+  int run;
+  int issued = 0;
+
+  for (int c = 0; c < count; c += chunk) {
+    chunk = (count - c < BLK_MAX_IOV) ? count - c : BLK_MAX_IOV;
+    
+    for (int t = 0; t < chunk; t++) {
+      if (c + t == 0 && first != NULL) {
+        buf[t] = first;
+      } else {
+        buf[t] = acquire_buf(cache, start_block + c + t, 0, false, &hit);
+      }
+    }  
+
+    for (int t = 0; t < chunk; t += run) {
+      if (buf[t] == NULL) {
+        run = 1;
+        continue;
+      }
+
+      for (run = 1; t + run < chunk && buf[t + run] != NULL; run++);
+      
+      read_blocks(cache, &buf[t], run);
+    }
+
+    for (int t = 0; t < chunk; t++) {
+      if (buf[t] != NULL && buf[t] != first) {
+        buf[t]->prefetched = true;
+        buf[t]->ra_stream = ra_stream;
+        put_buf(cache, buf[t]);
+        issued++;
+      }
+    }
+  }
+  
+  return issued;
+}
+
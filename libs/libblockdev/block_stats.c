@@ -0,0 +1,168 @@
+/*
+ * Copyright 2023  Marven Gilhespie
+ *
+ * Licensed under the Apache License, segment_id 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/* Statistics and tracing of the block cache.
+ *
+ * Counters of cache activity and histograms of the latency of device reads,
+ * writes and fsyncs are kept in the cache's stats, protected by the cache
+ * lock.  The read and write latencies can also be fed to libprofiling
+ * samples so they can be viewed alongside other profiling points.
+ *
+ * A trace function can be set to record the operations made on the cache,
+ * so that a workload captured on CheviotOS can be replayed against the
+ * cache elsewhere.
+ */
+
+#define LOG_LEVEL_ERROR
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/blockdev.h>
+#include <sys/profiling.h>
+#include <sys/syscalls.h>
+#include <sys/debug.h>
+#include "block_cache_priv.h"
+
+
+static void add_lat_sample(struct blk_lat_hist *hist, uint32_t usec);
+
+
+/* @brief   Get a snapshot of the statistics of a cache
+ *
+ * @param   cache, the cache to get the statistics of
+ * @param   stats, filled in with the counters and latency histograms
+ */
+void block_cache_get_stats(struct block_cache *cache, struct block_cache_stats *stats)
+{
+  lock_cache(cache);
+  *stats = cache->stats;
+  stats->buf_cnt = cache->buf_cnt;
+  stats->avail_buf_cnt = cache->avail_buf_cnt;
+  stats->dirty_cnt = cache->dirty_cnt;
+  unlock_cache(cache);
+  victim_get_stats(cache, stats);
+}
+
+
+/* @brief   Clear the counters and latency histograms of a cache
+ */
+void block_cache_reset_stats(struct block_cache *cache)
+{
+  lock_cache(cache);
+  memset(&cache->stats, 0, sizeof cache->stats);
+  unlock_cache(cache);
+  victim_reset_stats(cache);
+}
+
+
+/* @brief   Feed device latencies to libprofiling
+ *
+ * @param   cache, the cache to profile
+ * @param   read_ps, samples to add the latency in microseconds of each
+ *          device read to, or NULL
+ * @param   write_ps, samples to add the latency of each device write to,
+ *          or NULL
+ * @return  0 on success
+ *
+ * Samples are only added while profiling is enabled, see profiling_enable().
+ * The samples are updated with the cache lock held and must not be shared
+ * with other users.
+ */
+int set_block_cache_profiling(struct block_cache *cache, struct profiling_samples *read_ps,
+                              struct profiling_samples *write_ps)
+{
+  lock_cache(cache);
+  cache->prof_read = read_ps;
+  cache->prof_write = write_ps;
+  unlock_cache(cache);
+  return 0;
+}
+
+
+/* @brief   Set a function to be called for each operation on the cache
+ *
+ * @param   cache, the cache to trace
+ * @param   trace_fn, function called with a record of each operation before
+ *          it is performed, or NULL to stop tracing
+ * @param   arg, argument passed to trace_fn
+ * @return  0 on success
+ *
+ * Blocks read by readahead or prefetching are not recorded individually.
+ * In a concurrent cache the function is called from multiple threads, and
+ * from the I/O worker, with no lock held.
+ */
+int set_block_cache_trace(struct block_cache *cache, blk_trace_fn_t trace_fn, void *arg)
+{
+  lock_cache(cache);
+  cache->trace_fn = trace_fn;
+  cache->trace_arg = arg;
+  unlock_cache(cache);
+  return 0;
+}
+
+
+/* @brief   Record the latency of a device operation
+ *
+ * @param   cache, the cache of the device
+ * @param   hist, histogram to add the latency to
+ * @param   ps, libprofiling samples to also add the latency to, or NULL
+ * @param   start_ts, time the operation started
+ */
+void note_io_latency(struct block_cache *cache, struct blk_lat_hist *hist,
+                     struct profiling_samples *ps, struct timespec *start_ts)
+{
+  struct timespec end_ts;
+  struct timespec diff;
+  uint32_t usec;
+  
+  clock_gettime(CLOCK_MONOTONIC_RAW, &end_ts);
+  diff_timespec(&diff, &end_ts, start_ts);
+  usec = (uint32_t)(((uint64_t)diff.tv_sec * 1000000) + diff.tv_nsec / 1000);
+  
+  lock_cache(cache);
+  add_lat_sample(hist, usec);
+  
+  if (ps != NULL && __libprofiling_enable) {
+    profiling_add_sample(ps, usec);
+  }
+  
+  unlock_cache(cache);
+}
+
+
+/* @brief   Add a latency to a histogram
+ */
+static void add_lat_sample(struct blk_lat_hist *hist, uint32_t usec)
+{
+  int b = 0;
+  
+  while (b < BLK_LAT_BUCKET_CNT - 1 && (usec >> b) != 0) {
+    b++;
+  }
+  
+  hist->bucket[b]++;
+  hist->cnt++;
+  hist->sum_usec += usec;
+  
+  if (usec > hist->max_usec) {
+    hist->max_usec = usec;
+  }
+}
+
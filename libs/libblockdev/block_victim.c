@@ -0,0 +1,404 @@
+/*
+ * Copyright 2023  Marven Gilhespie
+ *
+ * Licensed under the Apache License, segment_id 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+
+/* Compressed victim tier.
+ *
+ * Clean blocks evicted from the cache are compressed, see block_lz.c, and
+ * kept in a bounded arena so that a later miss on one of them is satisfied
+ * by decompressing it instead of reading the device.  Metadata compresses
+ * well and decompressing a block takes far less time than reading it from
+ * an SD card.  Blocks read with BLK_HINT_DATA and blocks that do not
+ * compress to three quarters of their size are not kept.
+ *
+ * The arena is used as a ring.  Compressed blocks are appended at its head,
+ * wrapping to the start when one does not fit before the end, and the
+ * oldest blocks are dropped to make room.  A ring of entries in the same
+ * order records where each block is held, with a chained hash table indexing
+ * the entries by block number.  An entry whose block is loaded back into the
+ * cache or invalidated is unlinked from the hash table and its space is
+ * reclaimed when it becomes the oldest.
+ *
+ * A block is stored while the buf that held it is still in the index, and
+ * loaded while the buf it is loaded into is in use, so a block is never in
+ * the tier and the cache at the same time.  The tier has its own lock, which
+ * is taken after any other lock.
+ */
+
+#define LOG_LEVEL_ERROR
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/blockdev.h>
+#include <sys/panic.h>
+#include <sys/debug.h>
+#include "block_cache_priv.h"
+
+
+static struct blk_victim_tier *alloc_victim_tier(struct block_cache *cache, size_t arena_sz);
+static uint32_t alloc_arena(struct blk_victim_tier *vt, uint32_t len);
+static void drop_oldest(struct blk_victim_tier *vt);
+static int find_entry(struct blk_victim_tier *vt, off64_t block);
+static void unlink_entry(struct blk_victim_tier *vt, int idx);
+
+
+/* @brief   Keep evicted clean blocks compressed in memory
+ *
+ * @param   cache, the cache to configure
+ * @param   arena_sz, size in bytes of the memory holding compressed blocks,
+ *          or 0 to disable the victim tier
+ * @return  0 on success, -ENOMEM on failure
+ *
+ * Must be called before any other thread uses the cache.
+ */
+int set_block_cache_victim_tier(struct block_cache *cache, size_t arena_sz)
+{
+  struct blk_victim_tier *vt = NULL;
+  
+  if (arena_sz > 0 && (vt = alloc_victim_tier(cache, arena_sz)) == NULL) {
+    return -ENOMEM;
+  }
+
+  free_victim_tier(cache);
+  cache->vtier = vt;
+  return 0;
+}
+
+
+/* @brief   Free the victim tier of a cache, if it has one
+ */
+void free_victim_tier(struct block_cache *cache)
+{
+  struct blk_victim_tier *vt = cache->vtier;
+  
+  if (vt == NULL) {
+    return;
+  }
+  
+  pthread_mutex_destroy(&vt->lock);
+  free(vt->arena);
+  free(vt->ent);
+  free(vt->bucket);
+  free(vt->lz_table);
+  free(vt->lz_buf);
+  free(vt);
+  cache->vtier = NULL;
+}
+
+
+/* @brief   Compress and keep the block of a buf being evicted
+ *
+ * @param   cache, the cache the buf belongs to
+ * @param   buf, valid, clean buf in use by the caller, still in the index
+ *
+ * Called with the buf's shard lock held.
+ */
+void victim_store(struct block_cache *cache, struct buf *buf)
+{
+  struct blk_victim_tier *vt = cache->vtier;
+  struct blk_victim_ent *ent;
+  uint32_t hash;
+  int len;
+  int idx;
+  
+  if (vt == NULL) {
+    return;
+  }
+  
+  pthread_mutex_lock(&vt->lock);
+  
+  // An older copy remains if the block was cached without reading it
+  if ((idx = find_entry(vt, buf->block)) != -1) {
+    unlink_entry(vt, idx);
+  }
+  
+  if ((buf->flags & BLK_HINT_DATA) != 0) {
+    pthread_mutex_unlock(&vt->lock);
+    return;
+  }
+  
+  len = lz_compress(buf->data, cache->block_size, vt->lz_buf, (cache->block_size * 3) / 4, vt->lz_table);
+  
+  if (len == 0) {
+    vt->reject_cnt++;
+    pthread_mutex_unlock(&vt->lock);
+    return;
+  }
+  
+  idx = (vt->ent_tail + vt->ent_cnt) % vt->ent_max;
+  ent = &vt->ent[idx];
+  ent->off = alloc_arena(vt, len);
+  ent->len = len;
+  ent->block = buf->block;
+  memcpy(vt->arena + ent->off, vt->lz_buf, len);
+  
+  hash = (uint32_t)block_hash(buf->block) & vt->bucket_mask;
+  ent->next = vt->bucket[hash];
+  vt->bucket[hash] = idx;
+  vt->ent_cnt++;
+  vt->block_cnt++;
+  vt->store_cnt++;
+  pthread_mutex_unlock(&vt->lock);
+}
+
+
+/* @brief   Load a block from the victim tier instead of reading it
+ *
+ * @param   cache, the cache the buf belongs to
+ * @param   buf, buf assigned to the block, in use by the caller
+ * @return  true if the block was loaded into the buf
+ */
+bool victim_load(struct block_cache *cache, struct buf *buf)
+{
+  struct blk_victim_tier *vt = cache->vtier;
+  struct blk_victim_ent *ent;
+  bool loaded;
+  int idx;
+  
+  if (vt == NULL) {
+    return false;
+  }
+  
+  pthread_mutex_lock(&vt->lock);
+  
+  if ((idx = find_entry(vt, buf->block)) == -1) {
+    pthread_mutex_unlock(&vt->lock);
+    return false;
+  }
+  
+  ent = &vt->ent[idx];
+  loaded = (lz_decompress(vt->arena + ent->off, ent->len, buf->data, cache->block_size) == (int)cache->block_size);
+  unlink_entry(vt, idx);
+  
+  if (loaded == true) {
+    vt->hit_cnt++;
+  } else {
+    log_error("libblockdev: corrupt victim tier block %u", (uint32_t)buf->block);
+  }
+  
+  pthread_mutex_unlock(&vt->lock);
+  return loaded;
+}
+
+
+/* @brief   Drop a block from the victim tier
+ */
+void victim_invalidate(struct block_cache *cache, off64_t block)
+{
+  struct blk_victim_tier *vt = cache->vtier;
+  int idx;
+  
+  if (vt == NULL) {
+    return;
+  }
+  
+  pthread_mutex_lock(&vt->lock);
+  
+  if ((idx = find_entry(vt, block)) != -1) {
+    unlink_entry(vt, idx);
+  }
+  
+  pthread_mutex_unlock(&vt->lock);
+}
+
+
+/* @brief   Add the victim tier's counters to a snapshot of the statistics
+ */
+void victim_get_stats(struct block_cache *cache, struct block_cache_stats *stats)
+{
+  struct blk_victim_tier *vt = cache->vtier;
+  
+  if (vt == NULL) {
+    return;
+  }
+  
+  pthread_mutex_lock(&vt->lock);
+  stats->victim_cnt = vt->block_cnt;
+  stats->victim_hit_cnt = vt->hit_cnt;
+  stats->victim_store_cnt = vt->store_cnt;
+  stats->victim_reject_cnt = vt->reject_cnt;
+  pthread_mutex_unlock(&vt->lock);
+}
+
+
+/* @brief   Clear the victim tier's counters
+ */
+void victim_reset_stats(struct block_cache *cache)
+{
+  struct blk_victim_tier *vt = cache->vtier;
+  
+  if (vt == NULL) {
+    return;
+  }
+  
+  pthread_mutex_lock(&vt->lock);
+  vt->hit_cnt = 0;
+  vt->store_cnt = 0;
+  vt->reject_cnt = 0;
+  pthread_mutex_unlock(&vt->lock);
+}
+
+
+/* @brief   Allocate a victim tier
+ *
+ * The ring of entries is sized for blocks compressing to a sixteenth of
+ * their size on average.
+ */
+static struct blk_victim_tier *alloc_victim_tier(struct block_cache *cache, size_t arena_sz)
+{
+  struct blk_victim_tier *vt;
+  int bucket_cnt;
+  int ent_max;
+  
+  if (arena_sz < cache->block_size) {
+    arena_sz = cache->block_size;
+  }
+  
+  ent_max = (arena_sz / cache->block_size) * 16;
+  for (bucket_cnt = 1; bucket_cnt < ent_max; bucket_cnt *= 2);
+
+  if ((vt = malloc(sizeof (struct blk_victim_tier))) == NULL) {
+    return NULL;
+  }
+  
+  vt->arena = malloc(arena_sz);
+  vt->ent = malloc(ent_max * sizeof (struct blk_victim_ent));
+  vt->bucket = malloc(bucket_cnt * sizeof (int));
+  vt->lz_table = malloc((1 << BLK_LZ_HASH_BITS) * sizeof (uint32_t));
+  vt->lz_buf = malloc(cache->block_size);
+  
+  if (vt->arena == NULL || vt->ent == NULL || vt->bucket == NULL
+        || vt->lz_table == NULL || vt->lz_buf == NULL) {
+    free(vt->arena);
+    free(vt->ent);
+    free(vt->bucket);
+    free(vt->lz_table);
+    free(vt->lz_buf);
+    free(vt);
+    return NULL;
+  }
+  
+  for (int t = 0; t < bucket_cnt; t++) {
+    vt->bucket[t] = -1;
+  }
+  
+  pthread_mutex_init(&vt->lock, NULL);
+  vt->arena_sz = arena_sz;
+  vt->head = 0;
+  vt->ent_max = ent_max;
+  vt->ent_tail = 0;
+  vt->ent_cnt = 0;
+  vt->block_cnt = 0;
+  vt->bucket_mask = bucket_cnt - 1;
+  vt->hit_cnt = 0;
+  vt->store_cnt = 0;
+  vt->reject_cnt = 0;
+  return vt;
+}
+
+
+/* @brief   Make room for compressed data at the head of the arena
+ *
+ * @param   vt, the victim tier, locked by the caller
+ * @param   len, number of bytes needed, at most the size of the arena
+ * @return  offset of the space in the arena
+ *
+ * Live data runs from the oldest entry's offset forwards to the head,
+ * wrapping at the end of the arena, so the oldest entry is always the next
+ * one in the way.  A free entry is also made for the caller.
+ */
+static uint32_t alloc_arena(struct blk_victim_tier *vt, uint32_t len)
+{
+  struct blk_victim_ent *oldest;
+  uint32_t pos = vt->head;
+  
+  if (pos + len > vt->arena_sz) {
+    // Entries after the head are the oldest and are dropped before wrapping
+    while (vt->ent_cnt > 0 && vt->ent[vt->ent_tail].off >= pos) {
+      drop_oldest(vt);
+    }
+    
+    pos = 0;
+  }
+  
+  while (vt->ent_cnt > 0) {
+    oldest = &vt->ent[vt->ent_tail];
+    
+    if (vt->ent_cnt < vt->ent_max && (oldest->off >= pos + len || oldest->off + oldest->len <= pos)) {
+      break;
+    }
+    
+    drop_oldest(vt);
+  }
+  
+  vt->head = pos + len;
+  return pos;
+}
+
+
+/* @brief   Drop the oldest entry of the victim tier
+ */
+static void drop_oldest(struct blk_victim_tier *vt)
+{
+  if (vt->ent[vt->ent_tail].block != -1) {
+    unlink_entry(vt, vt->ent_tail);
+  }
+  
+  vt->ent_tail = (vt->ent_tail + 1) % vt->ent_max;
+  vt->ent_cnt--;
+}
+
+
+/* @brief   Find the entry holding a block
+ *
+ * @return  index of the entry or -1 if the block is not in the tier
+ */
+static int find_entry(struct blk_victim_tier *vt, off64_t block)
+{
+  int idx;
+  
+  idx = vt->bucket[(uint32_t)block_hash(block) & vt->bucket_mask];
+  
+  while (idx != -1 && vt->ent[idx].block != block) {
+    idx = vt->ent[idx].next;
+  }
+  
+  return idx;
+}
+
+
+/* @brief   Unlink an entry from its hash chain, leaving its space in the ring
+ */
+static void unlink_entry(struct blk_victim_tier *vt, int idx)
+{
+  int *link;
+  
+  link = &vt->bucket[(uint32_t)block_hash(vt->ent[idx].block) & vt->bucket_mask];
+  
+  while (*link != idx) {
+    link = &vt->ent[*link].next;
+  }
+  
+  *link = vt->ent[idx].next;
+  vt->ent[idx].next = -1;
+  vt->ent[idx].block = -1;
+  vt->block_cnt--;
+}
+
@@ -0,0 +1,725 @@
+/*
+ * Copyright 2023  Marven Gilhespie
+ *
+ * Licensed under the Apache License, segment_id 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+/* Write-back support for the block cache.
+ *
+ * In write-back mode put_block() does not write a dirty block to disk, it is
+ * instead placed on the cache's dirty list.  Dirty blocks are written when
+ * their buf is reused, when the number of dirty blocks exceeds the high
+ * watermark or when sync_block_cache() or sync_block_range() is called.
+ *
+ * Ordering of writes across a block_cache_barrier() call is preserved. Each
+ * dirty block is tagged with the barrier epoch it was first dirtied in and
+ * blocks of older epochs are always written and fsync'd before any block of
+ * a newer epoch reaches the device.  If that fsync fails nothing of the
+ * newer epoch is written.  A block on the dirty list that is dirtied again
+ * after a barrier holds changes of the new epoch, when it is released the
+ * blocks of older epochs are written and fsync'd and it joins the current
+ * epoch, see redirty_buf().
+ *
+ * Writes are done by claiming dirty bufs under the cache lock, taking them
+ * off the dirty list and marking them busy so they cannot be reused, and
+ * then writing them with only the cache's write_lock held.  The write_lock
+ * keeps the writes of concurrent threads in epoch order.
+ *
+ * A dirty buf that a caller is still holding is not claimed, its contents
+ * may be half modified and marking it clean would lose the rest of the
+ * caller's changes.  It stays on the dirty list for put_block().  If a block
+ * of a newer epoch is to be written while such a buf of an older epoch is
+ * held, the held buf's current contents are written first to keep the
+ * order, but it stays dirty and moves to the current epoch.
+ *
+ * A block that fails to be written is released clean, there is nothing more
+ * that can be done with it.  The error is kept on the cache and returned by
+ * the next sync or barrier so that the file system learns that data was
+ * lost even if the write was done by a flush it did not call.
+ *
+ * Claimed blocks of the same epoch are sorted by block number and runs of
+ * consecutive blocks are written with a single writev, so a flush sweeps
+ * across the device in one direction with as few, large writes as
+ * possible.  Flushing to the low watermark claims at most
+ * BLK_WB_BATCH_MAX blocks at a time, releasing the write_lock in between so
+ * that a thread evicting a dirty block does not wait for the whole flush.
+ * A sync claims every dirty block at once for the longest sweep.
+ */
+
+#define LOG_LEVEL_ERROR
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/blockdev.h>
+#include <sys/panic.h>
+#include <sys/syscalls.h>
+#include <sys/debug.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include "block_cache_priv.h"
+
+
+static int write_range(struct block_cache *cache, off64_t start_block, off64_t block_cnt);
+static void claim_buf(struct block_cache *cache, struct buf *buf, int *cnt);
+static void claim_dirty(struct block_cache *cache, struct buf *buf, bool *held,
+                        uint32_t *held_epoch, int *cnt);
+static void claim_older(struct block_cache *cache, uint32_t epoch, int *cnt);
+static int write_claimed_bufs(struct block_cache *cache, int cnt);
+static int write_run(struct block_cache *cache, struct buf **bufs, int cnt);
+static int cmp_buf_block(const void *a, const void *b);
+static void release_buf(struct block_cache *cache, struct buf *buf, bool written);
+static int order_writes(struct block_cache *cache, uint32_t epoch);
+static int sync_device(struct block_cache *cache);
+static int take_write_error(struct block_cache *cache);
+
+
+/* @brief   Select the write policy of the cache
+ *
+ * @param   cache, the cache to configure
+ * @param   write_policy, BLK_WRITE_THROUGH or BLK_WRITE_BACK
+ * @param   dirty_high_watermark, number of dirty blocks in write-back mode
+ *          above which dirty blocks are flushed down to half this number.
+ *          A value of 0 selects a default of three quarters of the cache,
+ *          which follows the number of bufs in a pooled cache.
+ * @return  0 on success, negative errno on failure
+ *
+ * Switching to write-through mode writes all dirty blocks to disk.
+ */
+int set_block_cache_writeback(struct block_cache *cache, int write_policy, int dirty_high_watermark)
+{
+  if (write_policy != BLK_WRITE_THROUGH && write_policy != BLK_WRITE_BACK) {
+    return -EINVAL;
+  }
+  
+  if (dirty_high_watermark < 0 || dirty_high_watermark > cache->buf_cnt) {
+    return -EINVAL;
+  }
+  
+  if (write_policy == BLK_WRITE_THROUGH) {
+    sync_block_cache(cache);
+  }
+
+  lock_cache(cache);
+  cache->write_policy = write_policy;
+  cache->dirty_high_watermark = dirty_high_watermark;
+  cache->dirty_watermark_auto = (dirty_high_watermark == 0);
+  update_cache_limits(cache);
+  unlock_cache(cache);
+  return 0;
+}
+
+
+/* @brief   Write all dirty blocks to disk and wait for them to be stable
+ *
+ * @param   cache, the cache to sync
+ * @return  0 on success, -EIO if any block failed to be written, including
+ *          blocks written by a flush since the last sync or barrier
+ *
+ * Blocks queued to be discarded are also discarded.  Dirty blocks that are
+ * in use are not written, they remain dirty until released and synced.
+ */
+int sync_block_cache(struct block_cache *cache)
+{
+  int sc;
+  
+  trace_op(cache, BLK_TRACE_SYNC, 0, 0, 0);
+  sc = flush_dirty_bufs(cache, 0);
+  
+  lock_writes(cache);
+  issue_discards(cache);
+  
+  if (sync_device(cache) != 0) {
+    sc = -EIO;
+  }
+  
+  if (take_write_error(cache) != 0) {
+    sc = -EIO;
+  }
+  
+  unlock_writes(cache);
+  return sc;
+}
+
+
+/* @brief   Write dirty blocks within a range to disk and wait for them to be stable
+ *
+ * @param   cache, the cache to sync
+ * @param   start_block, first block of the range
+ * @param   block_cnt, number of blocks in the range
+ * @return  0 on success, -EIO if any block failed to be written, including
+ *          blocks written by a flush since the last sync or barrier
+ *
+ * Dirty blocks outside of the range that precede a barrier ahead of a block
+ * in the range are also written.  All blocks queued to be discarded are
+ * discarded.
+ */
+int sync_block_range(struct block_cache *cache, off64_t start_block, off64_t block_cnt)
+{
+  int sc;
+  
+  trace_op(cache, BLK_TRACE_SYNC, start_block, (int)block_cnt, 0);
+  
+  lock_writes(cache);
+  sc = write_range(cache, start_block, block_cnt);
+  issue_discards(cache);
+  
+  if (sync_device(cache) != 0) {
+    sc = -EIO;
+  }
+  
+  if (take_write_error(cache) != 0) {
+    sc = -EIO;
+  }
+  
+  unlock_writes(cache);
+  return sc;
+}
+
+
+/* @brief   Order writes before the barrier ahead of writes after it
+ *
+ * @param   cache, the cache to add a barrier to
+ * @return  0 on success, -EIO if a block written by a flush since the last
+ *          sync or barrier failed to be written
+ *
+ * Blocks dirtied before the barrier are written to disk and fsync'd before
+ * any block dirtied after the barrier is written.  This does not wait for
+ * any writes, use sync_block_cache() for that.
+ */
+int block_cache_barrier(struct block_cache *cache)
+{
+  int sc;
+  
+  trace_op(cache, BLK_TRACE_BARRIER, 0, 0, 0);
+  lock_writes(cache);
+  lock_cache(cache);
+  cache->barrier_epoch++;
+  unlock_cache(cache);
+  sc = take_write_error(cache);
+  unlock_writes(cache);
+  return sc;
+}
+
+
+/* @brief   Write a dirty block to disk, honouring barriers
+ *
+ * @param   cache, the cache the buf belongs to
+ * @param   buf, the buf to write, in use by the caller
+ * @return  0 on success, -EIO on failure
+ *
+ * Any dirty blocks from an epoch before that of buf are written first.  If
+ * buf was already claimed by a flush in another thread this waits for that
+ * write to complete.
+ */
+int writeback_buf(struct block_cache *cache, struct buf *buf)
+{
+  uint32_t epoch;
+  int cnt = 0;
+  int sc;
+  
+  lock_writes(cache);
+  lock_cache(cache);
+  
+  epoch = (buf->on_dirty_list) ? buf->dirty_epoch : cache->barrier_epoch;
+  claim_older(cache, epoch, &cnt);
+  
+  if (buf->dirty == true) {
+    claim_buf(cache, buf, &cnt);
+  }
+  
+  unlock_cache(cache);
+  sc = write_claimed_bufs(cache, cnt);
+  unlock_writes(cache);
+  return sc;
+}
+
+
+/* @brief   Move a released buf dirtied again after a barrier to the current epoch
+ *
+ * @param   cache, the cache the buf belongs to
+ * @param   buf, buf in use by the caller, on the dirty list from an older
+ *          epoch and marked dirty since it was got
+ *
+ * The dirty blocks of older epochs are written and fsync'd first, so that
+ * none of the buf's new changes can reach the device ahead of them.  A
+ * failure is kept for the next sync or barrier to return.
+ */
+void redirty_buf(struct block_cache *cache, struct buf *buf)
+{
+  uint32_t epoch;
+  int cnt = 0;
+  
+  lock_writes(cache);
+  lock_cache(cache);
+  epoch = cache->barrier_epoch;
+  
+  if (buf->on_dirty_list == false || buf->dirty_epoch == epoch) {
+    unlock_cache(cache);
+    unlock_writes(cache);
+    return;
+  }
+  
+  LIST_REM_ENTRY(&cache->dirty_list, buf, dirty_link);
+  LIST_ADD_TAIL(&cache->dirty_list, buf, dirty_link);
+  buf->dirty_epoch = epoch;
+  claim_older(cache, epoch, &cnt);
+  unlock_cache(cache);
+  
+  if (write_claimed_bufs(cache, cnt) == 0) {
+    order_writes(cache, epoch);
+  }
+  
+  unlock_writes(cache);
+}
+
+
+/* @brief   Write the oldest dirty blocks until the dirty count drops to a target
+ *
+ * @param   cache, the cache to flush
+ * @param   target_dirty_cnt, number of dirty blocks to leave in the cache
+ * @return  0 on success, -EIO if any block failed to be written
+ *
+ * Unless flushing all dirty blocks, at most BLK_WB_BATCH_MAX blocks are
+ * written at a time with the write_lock held.  Blocks in use are left
+ * dirty, so fewer than target_dirty_cnt may remain afterwards.
+ */
+int flush_dirty_bufs(struct block_cache *cache, int target_dirty_cnt)
+{
+  struct buf *buf;
+  struct buf *next;
+  uint32_t held_epoch;
+  bool held;
+  int batch_max;
+  int cnt;
+  int sc = 0;
+  
+  batch_max = (target_dirty_cnt > 0) ? BLK_WB_BATCH_MAX : cache->buf_cnt;
+  
+  do {
+    cnt = 0;
+    held = false;
+    lock_writes(cache);
+    lock_cache(cache);
+    
+    buf = LIST_HEAD(&cache->dirty_list);
+    
+    while (buf != NULL && cache->dirty_cnt > target_dirty_cnt && cnt < batch_max) {
+      next = LIST_NEXT(buf, dirty_link);
+      claim_dirty(cache, buf, &held, &held_epoch, &cnt);
+      buf = next;
+    }
+
+    unlock_cache(cache);
+    
+    if (write_claimed_bufs(cache, cnt) != 0) {
+      sc = -EIO;
+    }
+    
+    unlock_writes(cache);
+  } while (cnt >= batch_max);
+  
+  return sc;
+}
+
+
+/* @brief   Write dirty blocks within a range to disk without waiting for
+ *          them to be stable
+ *
+ * @param   cache, the cache to flush
+ * @param   start_block, first block of the range
+ * @param   block_cnt, number of blocks in the range
+ * @return  0 on success, -EIO if any block failed to be written
+ *
+ * Used before reading the range from the device behind the cache's back,
+ * see block_cache_read().  As with sync_block_range(), blocks outside of
+ * the range that precede a barrier ahead of a block in the range are also
+ * written.
+ */
+int flush_block_range(struct block_cache *cache, off64_t start_block, off64_t block_cnt)
+{
+  int sc;
+  
+  lock_writes(cache);
+  sc = write_range(cache, start_block, block_cnt);
+  unlock_writes(cache);
+  return sc;
+}
+
+
+/* @brief   Write blocks that bypass the cache, honouring barriers
+ *
+ * @param   cache, the cache of the device
+ * @param   block, first block to write
+ * @param   data, contents of the blocks
+ * @param   count, number of blocks
+ * @return  0 on success, -EIO on failure
+ *
+ * The blocks belong to the current barrier epoch, any dirty blocks from an
+ * older epoch are written and fsync'd first.  Called with the write_lock
+ * held.  The caller must drop cached copies of the blocks afterwards.
+ */
+int write_uncached(struct block_cache *cache, off64_t block, const void *data, int count)
+{
+  struct iovec iov;
+  uint32_t epoch;
+  ssize_t rc;
+  int cnt = 0;
+  int sc;
+  
+  lock_cache(cache);
+  epoch = cache->barrier_epoch;
+  claim_older(cache, epoch, &cnt);
+  unlock_cache(cache);
+  sc = write_claimed_bufs(cache, cnt);
+  
+  if (order_writes(cache, epoch) != 0) {
+    return -EIO;
+  }
+  
+  iov.iov_base = (void *)data;
+  iov.iov_len = (size_t)count * cache->block_size;
+  rc = dev_writev(cache, block, &iov, 1);
+
+  cache->last_write_epoch = epoch;
+  cache->unsynced_writes = true;
+  
+  if (rc != (ssize_t)iov.iov_len) {
+    log_error("libblockdev: direct write of blocks %u-%u failed, rc:%d", (uint32_t)block,
+                (uint32_t)(block + count - 1), (int)rc);
+    return -EIO;
+  }
+  
+  return sc;
+}
+
+
+/* @brief   Claim and write the dirty blocks within a range
+ *
+ * Dirty blocks outside of the range that precede a barrier ahead of a block
+ * in the range are also written.  Blocks in use are left dirty.  Called with
+ * the write_lock held.
+ */
+static int write_range(struct block_cache *cache, off64_t start_block, off64_t block_cnt)
+{
+  struct buf *buf;
+  struct buf *next;
+  uint32_t last_epoch;
+  uint32_t held_epoch;
+  bool held = false;
+  bool found = false;
+  int cnt = 0;
+  
+  lock_cache(cache);
+
+  // The dirty list is in epoch order, find the epoch of the last block in range  
+  for (buf = LIST_HEAD(&cache->dirty_list); buf != NULL; buf = LIST_NEXT(buf, dirty_link)) {
+    if (buf->block >= start_block && buf->block < start_block + block_cnt) {
+      last_epoch = buf->dirty_epoch;
+      found = true;
+    }
+  }
+
+  buf = (found) ? LIST_HEAD(&cache->dirty_list) : NULL;
+    
+  while (buf != NULL) {
+    next = LIST_NEXT(buf, dirty_link);
+
+    if ((buf->block >= start_block && buf->block < start_block + block_cnt)
+          || (int32_t)(buf->dirty_epoch - last_epoch) < 0) {
+      claim_dirty(cache, buf, &held, &held_epoch, &cnt);
+    }
+    
+    buf = next;
+  }
+  
+  unlock_cache(cache);
+  
+  return write_claimed_bufs(cache, cnt);
+}
+
+
+/* @brief   Claim a dirty buf for writing
+ *
+ * The buf is taken off the dirty list, marked clean and busy and added to
+ * the cache's wb_bufs array.  Called with the write_lock and cache lock held.
+ */
+static void claim_buf(struct block_cache *cache, struct buf *buf, int *cnt)
+{
+  if (buf->on_dirty_list) {
+    LIST_REM_ENTRY(&cache->dirty_list, buf, dirty_link);
+    buf->on_dirty_list = false;
+    cache->dirty_cnt--;
+  } else {
+    buf->dirty_epoch = cache->barrier_epoch;
+  }
+
+  buf->dirty = false;
+  buf->busy = true;
+  cache->wb_bufs[(*cnt)++] = buf;
+}
+
+
+/* @brief   Claim a buf of the dirty list for a flush unless it is in use
+ *
+ * @param   held, set once a buf in use has been skipped
+ * @param   held_epoch, set to the epoch of the first buf in use skipped
+ *
+ * Bufs must be passed in the order of the dirty list.  Before a buf of a
+ * newer epoch than one that was skipped is claimed, the skipped bufs are
+ * claimed too so that they reach the device first.  Called with the
+ * write_lock and cache lock held.
+ */
+static void claim_dirty(struct block_cache *cache, struct buf *buf, bool *held,
+                        uint32_t *held_epoch, int *cnt)
+{
+  if (buf->in_use) {
+    if (*held == false) {
+      *held = true;
+      *held_epoch = buf->dirty_epoch;
+    }
+    
+    return;
+  }
+  
+  if (*held == true && buf->dirty_epoch != *held_epoch) {
+    claim_older(cache, buf->dirty_epoch, cnt);
+    *held = false;
+  }
+  
+  claim_buf(cache, buf, cnt);
+}
+
+
+/* @brief   Claim every buf of the dirty list from an epoch before a given one
+ *
+ * A buf in use by a caller is only marked busy and added to wb_bufs for its
+ * contents to be written, it stays dirty and on the dirty list, see
+ * release_buf().  Called with the write_lock and cache lock held.
+ */
+static void claim_older(struct block_cache *cache, uint32_t epoch, int *cnt)
+{
+  struct buf *buf;
+  struct buf *next;
+  
+  buf = LIST_HEAD(&cache->dirty_list);
+  
+  while (buf != NULL && (int32_t)(buf->dirty_epoch - epoch) < 0) {
+    next = LIST_NEXT(buf, dirty_link);
+    
+    if (buf->busy == true) {
+      // Already claimed while in use
+    } else if (buf->in_use == true) {
+      buf->busy = true;
+      cache->wb_bufs[(*cnt)++] = buf;
+    } else {
+      claim_buf(cache, buf, cnt);
+    }
+    
+    buf = next;
+  }
+}
+
+
+/* @brief   Write the bufs claimed in wb_bufs and release them
+ *
+ * The bufs are claimed in epoch order.  Each group of bufs of the same
+ * epoch is sorted by block number and written in runs of consecutive
+ * blocks.  If the fsync ahead of a newer epoch fails the remaining bufs are
+ * not written and go back to the head of the dirty list.  Called with the
+ * write_lock held.
+ */
+static int write_claimed_bufs(struct block_cache *cache, int cnt)
+{
+  struct buf **bufs = cache->wb_bufs;
+  int sc = 0;
+  int written = cnt;
+  int end;
+  int run;
+  
+  for (int t = 0; t < cnt; t = end) {
+    for (end = t + 1; end < cnt && bufs[end]->dirty_epoch == bufs[t]->dirty_epoch; end++);
+    
+    if (order_writes(cache, bufs[t]->dirty_epoch) != 0) {
+      log_error("libblockdev: %d blocks not written after failed fsync", cnt - t);
+      written = t;
+      sc = -EIO;
+      break;
+    }
+    
+    qsort(&bufs[t], end - t, sizeof (struct buf *), cmp_buf_block);
+    
+    for (int r = t; r < end; r += run) {
+      for (run = 1; r + run < end && run < BLK_MAX_IOV
+                    && bufs[r + run]->block == bufs[r]->block + run; run++);
+      
+      if (write_run(cache, &bufs[r], run) != 0) {
+        sc = -EIO;
+      }
+    }
+  }
+  
+  for (int t = 0; t < written; t++) {
+    release_buf(cache, bufs[t], true);
+  }
+  
+  for (int t = cnt - 1; t >= written; t--) {
+    release_buf(cache, bufs[t], false);
+  }
+  
+  return sc;
+}
+
+
+/* @brief   Write a run of claimed bufs of consecutive blocks to disk
+ *
+ * The writes of older epochs must already be ordered ahead of the run with
+ * order_writes().  Blocks that fail to be written are not marked dirty
+ * again, the error is kept for take_write_error().
+ */
+static int write_run(struct block_cache *cache, struct buf **bufs, int cnt)
+{
+  struct iovec iov[BLK_MAX_IOV];
+  ssize_t rc;
+  
+  for (int t = 0; t < cnt; t++) {
+    iov[t].iov_base = bufs[t]->data;
+    iov[t].iov_len = cache->block_size;
+  }
+  
+  rc = dev_writev(cache, bufs[0]->block, iov, cnt);
+
+  cache->last_write_epoch = bufs[0]->dirty_epoch;
+  cache->unsynced_writes = true;
+  
+  if (rc != (ssize_t)(cnt * cache->block_size)) {
+    log_error("libblockdev: write of blocks %u-%u failed, rc:%d", (uint32_t)bufs[0]->block,
+                (uint32_t)bufs[cnt - 1]->block, (int)rc);
+    cache->write_error = -EIO;
+    return -EIO;
+  }
+  
+  return 0;
+}
+
+
+/* @brief   Compare the block numbers of two bufs for qsort()
+ */
+static int cmp_buf_block(const void *a, const void *b)
+{
+  const struct buf *buf_a = *(struct buf * const *)a;
+  const struct buf *buf_b = *(struct buf * const *)b;
+  
+  if (buf_a->block < buf_b->block) {
+    return -1;
+  }
+  
+  return (buf_a->block > buf_b->block) ? 1 : 0;
+}
+
+
+/* @brief   Clear the busy state of a claimed buf and wake any waiters
+ *
+ * @param   written, false if the buf was not written, it is then dirty again
+ *          at the head of the dirty list in its original epoch
+ *
+ * A buf written while in use stays dirty, further changes by its holder
+ * belong to the current epoch so it moves to the end of the dirty list.
+ */
+static void release_buf(struct block_cache *cache, struct buf *buf, bool written)
+{
+  struct blk_shard *shard;
+  
+  shard = buf_shard(cache, buf->block);
+  lock_shard(cache, shard);
+  lock_cache(cache);
+  buf->busy = false;
+  
+  if (written == false) {
+    if (buf->on_dirty_list == false) {
+      LIST_ADD_HEAD(&cache->dirty_list, buf, dirty_link);
+      buf->on_dirty_list = true;
+      buf->dirty = true;
+      cache->dirty_cnt++;
+    }
+  } else if (buf->on_dirty_list) {
+    LIST_REM_ENTRY(&cache->dirty_list, buf, dirty_link);
+    LIST_ADD_TAIL(&cache->dirty_list, buf, dirty_link);
+    buf->dirty_epoch = cache->barrier_epoch;
+  }
+  
+  unlock_cache(cache);
+  wake_shard(cache, shard);
+  unlock_shard(cache, shard);
+}
+
+
+/* @brief   Make the writes of older epochs stable before writing an epoch
+ *
+ * @return  0 on success, -EIO if the fsync failed, in which case nothing of
+ *          the epoch may be written and the error is kept for
+ *          take_write_error()
+ *
+ * Called with the write_lock held.
+ */
+static int order_writes(struct block_cache *cache, uint32_t epoch)
+{
+  if (cache->unsynced_writes && cache->last_write_epoch != epoch
+        && sync_device(cache) != 0) {
+    cache->write_error = -EIO;
+    return -EIO;
+  }
+  
+  return 0;
+}
+
+
+/* @brief   Wait for writes to the device to be stable
+ *
+ * Called with the write_lock held.
+ */
+static int sync_device(struct block_cache *cache)
+{
+  struct timespec start_ts;
+  int sc = 0;
+  
+  if (cache->unsynced_writes) {
+    clock_gettime(CLOCK_MONOTONIC_RAW, &start_ts);
+    
+    if (fsync(cache->dev_fd) != 0) {
+      sc = -EIO;
+    }
+    
+    note_io_latency(cache, &cache->stats.sync_lat, NULL, &start_ts);
+    cache->unsynced_writes = false;
+  }
+  
+  return sc;
+}
+
+
+/* @brief   Get and clear the error of a write that failed since the last
+ *          sync or barrier
+ *
+ * Called with the write_lock held.
+ */
+static int take_write_error(struct block_cache *cache)
+{
+  int sc = cache->write_error;
+  
+  cache->write_error = 0;
+  return sc;
+}
@@ -20,13 +20,16 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/lists.h>
+#include <sys/profiling.h>
 #include <sys/stat.h>
+#include <time.h>
 
 
 /*
@@ -35,9 +38,95 @@
 #define BLK_READ              0             /* get_block will read from disk if needed */
 #define BLK_NO_READ           1             /* get_block will not read contents from disk */
 #define BLK_CLEAR             2             /* get_block will return a clear block */
+#define BLK_OPT_MASK          0x0f
 
-// Number of buckets in buf hash table
-#define BUF_HASH_CNT  128
+/*
+ * get_block hints, or'd with the flag above
+ */
+#define BLK_HINT_DATA         0x10          /* block holds file data cached elsewhere */
+#define BLK_HINT_MASK         0xf0
+
+// Number of shards the buf index and its locks are split into
+#define BLK_SHARD_CNT 8
+
+// Minimum number of slots in the index of a shard, a power of 2
+#define BLK_INDEX_MIN_SLOTS   16
+
+// Maximum number of blocks transferred by a single readv or writev
+#define BLK_MAX_IOV   64
+
+// Maximum number of dirty blocks claimed at a time when flushing
+#define BLK_WB_BATCH_MAX    256
+
+// Number of sequential streams tracked for readahead
+#define BLK_RA_STREAM_CNT   4
+
+// Number of prefetch_blocks() ranges that can be queued for the I/O worker
+#define BLK_PREFETCH_QUEUE_SZ   16
+
+// Number of buckets in a latency histogram
+#define BLK_LAT_BUCKET_CNT    24
+
+// Size of the chunks a cache maps its bufs in, see resize_block_cache()
+#define BLK_CHUNK_SZ          (256 * 1024)
+
+// Size of the chunks a shared buffer pool is divided into
+#define BLK_POOL_CHUNK_SZ     (256 * 1024)
+
+// Number of misses of a pooled cache between rebalancing its pool
+#define BLK_POOL_REBALANCE_MISSES   1024
+
+// Number of bits of the hash of the compressor's match table
+#define BLK_LZ_HASH_BITS      12
+
+// Default number of blocks from which block_cache_read() and write bypass the cache
+#define BLK_DIRECT_THRESHOLD  64
+
+// Number of extents of freed blocks held before they are discarded
+#define BLK_DISCARD_EXTENT_MAX  32
+
+// Time after which freed blocks are discarded on the next block freed
+#define BLK_DISCARD_DELAY_MS  1000
+
+/*
+ * Operations recorded by a trace function, see set_block_cache_trace()
+ */
+#define BLK_TRACE_GET         0             /* get_block, opt as passed */
+#define BLK_TRACE_READAHEAD   1             /* get_block_readahead */
+#define BLK_TRACE_RANGE       2             /* get_block_range, count and opt as passed */
+#define BLK_TRACE_PREFETCH    3             /* prefetch_blocks */
+#define BLK_TRACE_PUT         4             /* put_block, opt is 1 if the block is dirty */
+#define BLK_TRACE_INVALIDATE  5             /* invalidate_block */
+#define BLK_TRACE_SYNC        6             /* sync_block_cache or sync_block_range */
+#define BLK_TRACE_BARRIER     7             /* block_cache_barrier */
+#define BLK_TRACE_READ        8             /* block_cache_read, opt is 1 if the cache is bypassed */
+#define BLK_TRACE_WRITE       9             /* block_cache_write, opt is 1 if the cache is bypassed */
+#define BLK_TRACE_DISCARD     10            /* discard_block_range */
+
+/*
+ * Write policy of the block cache, see set_block_cache_writeback()
+ */
+#define BLK_WRITE_THROUGH     0             /* put_block writes dirty blocks immediately */
+#define BLK_WRITE_BACK        1             /* dirty blocks are written on eviction or sync */
+
+/*
+ * Replacement policy of the block cache, see set_block_cache_policy()
+ */
+#define BLK_POLICY_LRU        0             /* least recently used */
+#define BLK_POLICY_2Q         1             /* scan resistant 2Q */
+
+/*
+ * Queue a buf is on, or returns to when released
+ */
+#define BLK_QUEUE_FREE        0             /* not holding a valid block */
+#define BLK_QUEUE_LRU         1             /* LRU list, or the Am list of 2Q */
+#define BLK_QUEUE_A1IN        2             /* 2Q FIFO of blocks seen once */
+
+/*
+ * Memory pressure levels, see block_cache_memory_pressure()
+ */
+#define BLK_PRESSURE_LOW      0             /* release half the bufs above the minimum */
+#define BLK_PRESSURE_CRITICAL 1             /* release all bufs above the minimum */
 
 /*
  * Types
@@ -45,7 +134,249 @@
 typedef uint32_t block_t;
 typedef uint64_t block64_t;
 
+struct block_cache;
+struct blk_chunk;
+
 LIST_TYPE(buf, buf_list_t, buf_link_t);
+LIST_TYPE(block_cache, block_cache_list_t, block_cache_link_t);
+LIST_TYPE(blk_async, blk_async_list_t, blk_async_link_t);
+LIST_TYPE(blk_io_req, blk_io_req_list_t, blk_io_req_link_t);
+
+
+/*
+ * @brief   A sequential stream of get_block_readahead calls
+ *
+ * The readahead window doubles each time the stream is confirmed to be
+ * sequential and halves when a block it read ahead is evicted unused.
+ */
+struct blk_ra_stream
+{
+  off64_t next_block;           // Block expected next if the stream is sequential
+  off64_t ra_end;               // Block after the last one read ahead
+  int window;                   // Number of blocks read at a time
+  uint32_t last_used;
+};
+
+
+/*
+ * @brief   Histogram of device operation latencies
+ *
+ * Bucket 0 counts operations taking under 1 microsecond, bucket n those
+ * taking 2^(n-1) to 2^n - 1 microseconds.  The last bucket also counts
+ * anything longer.
+ */
+struct blk_lat_hist
+{
+  uint64_t cnt;
+  uint64_t sum_usec;
+  uint32_t max_usec;
+  uint32_t bucket[BLK_LAT_BUCKET_CNT];
+};
+
+
+/*
+ * @brief   Statistics of a block cache, see block_cache_get_stats()
+ */
+struct block_cache_stats
+{
+  int buf_cnt;
+  int avail_buf_cnt;
+  int dirty_cnt;
+  
+  uint64_t hit_cnt;             // Blocks requested that were cached, not counting read-ahead
+  uint64_t miss_cnt;            // Blocks requested that were not cached, not counting read-ahead
+  uint64_t ghost_hit_cnt;       // 2Q misses found in A1out and promoted to Am
+  uint64_t evict_cnt;           // Cached blocks evicted to reuse their buf
+  uint64_t read_cnt;            // Blocks read from the device
+  uint64_t writeback_cnt;       // Blocks written to the device, including direct writes
+  uint64_t ra_issued_cnt;       // Blocks read ahead
+  uint64_t ra_hit_cnt;          // Blocks read ahead that were later used
+  uint64_t ra_wasted_cnt;       // Blocks read ahead that were evicted unused
+  uint64_t direct_read_cnt;     // Blocks read bypassing the cache
+  uint64_t direct_write_cnt;    // Blocks written bypassing the cache
+  
+  uint64_t io_req_cnt;          // Device reads and writes submitted
+  uint64_t io_dispatch_cnt;     // Device reads and writes issued after merging
+  uint64_t io_merge_cnt;        // Requests merged into an adjacent request
+  uint64_t io_depth_sum;        // Sum of the queue depth seen by each request
+  int io_depth_max;             // Deepest the request queue has been
+  
+  uint64_t discard_queued_cnt;  // Freed blocks queued to be discarded
+  uint64_t discard_cancel_cnt;  // Queued blocks written again before being discarded
+  uint64_t discard_cnt;         // Blocks discarded
+  uint64_t discard_req_cnt;     // Extents passed to the discard function
+  
+  int victim_cnt;               // Blocks held compressed by the victim tier
+  uint64_t victim_hit_cnt;      // Misses satisfied by the victim tier
+  uint64_t victim_store_cnt;    // Evicted blocks compressed into the victim tier
+  uint64_t victim_reject_cnt;   // Evicted blocks that did not compress well enough
+  
+  struct blk_lat_hist read_lat;     // Per device read or readv
+  struct blk_lat_hist write_lat;    // Per device write or writev
+  struct blk_lat_hist sync_lat;     // Per fsync of the device
+};
+
+
+/*
+ * @brief   A cache operation passed to a trace function
+ */
+struct blk_trace_rec
+{
+  off64_t block;                // First block, 0 if not applicable
+  int32_t count;                // Number of blocks, 0 for the whole cache
+  uint8_t op;                   // BLK_TRACE_*
+  uint8_t opt;
+};
+
+typedef void (*blk_trace_fn_t)(void *arg, struct blk_trace_rec *rec);
+
+
+/*
+ * @brief   Function that discards a range of blocks, see set_block_cache_discard()
+ *
+ * Returns 0 on success, -ENOSYS or -EOPNOTSUPP if the device does not
+ * support discarding or another negative errno on failure.
+ */
+typedef int (*blk_discard_fn_t)(void *arg, off64_t block, off64_t count);
+
+
+/*
+ * @brief   A range of freed blocks waiting to be discarded
+ */
+struct blk_discard_ext
+{
+  off64_t block;
+  off64_t count;
+};
+
+
+/*
+ * @brief   A range of blocks queued by prefetch_blocks()
+ */
+struct blk_prefetch
+{
+  off64_t start_block;
+  int count;
+};
+
+
+/*
+ * @brief   An asynchronous get_block request, see get_block_async()
+ *
+ * The block, opt, callback and arg fields are filled in by the caller.  The
+ * request must not be modified or freed until it has completed.
+ */
+struct blk_async
+{
+  off64_t block;
+  int opt;                      // As for get_block()
+  void (*callback)(struct block_cache *cache, struct blk_async *req);
+  void *arg;                    // For use by the caller
+  
+  struct buf *buf;              // Block in use by the caller once completed
+  bool done;
+  blk_async_link_t link;
+};
+
+
+/*
+ * @brief   A device read or write in the I/O request queue
+ *
+ * Lives on the stack of the submitting thread until it is done.
+ */
+struct blk_io_req
+{
+  off64_t block;
+  struct iovec *iov;
+  int iov_cnt;
+  size_t len;                   // Total length of iov
+  bool write;
+  bool done;
+  ssize_t rc;                   // Bytes transferred once done, or -1
+  int depth;                    // Requests queued when this was submitted
+  bool merged;                  // Dispatched behind an adjacent request
+  blk_io_req_link_t link;
+};
+
+
+/*
+ * @brief   A slot of the open-addressed buf index, empty if buf is NULL
+ */
+struct blk_index_slot
+{
+  off64_t block;
+  struct buf *buf;
+};
+
+
+/*
+ * @brief   A shard of the buf index
+ *
+ * In a concurrent cache the shard's lock protects its index and its
+ * condition variable is signalled when a buf of the shard is released.
+ */
+struct blk_shard
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct blk_index_slot *slot;  // Linear probing table, power of 2 sized
+  uint32_t slot_mask;
+  int slot_used;
+};
+
+
+/*
+ * @brief   Where a block is held in the arena of the victim tier
+ */
+struct blk_victim_ent
+{
+  off64_t block;                // -1 once loaded, invalidated or replaced
+  uint32_t off;
+  uint32_t len;
+  int next;                     // Hash chain, -1 terminated
+};
+
+
+/*
+ * @brief   Evicted clean blocks kept compressed, see set_block_cache_victim_tier()
+ */
+struct blk_victim_tier
+{
+  pthread_mutex_t lock;
+  uint8_t *arena;               // Ring of compressed blocks
+  uint32_t arena_sz;
+  uint32_t head;                // Where the next compressed block is stored
+  struct blk_victim_ent *ent;   // Ring of entries, oldest first
+  int ent_max;
+  int ent_tail;
+  int ent_cnt;
+  int block_cnt;                // Entries still holding a block
+  int *bucket;                  // Entry hash chains, -1 terminated
+  uint32_t bucket_mask;
+  uint32_t *lz_table;           // Work area of the compressor
+  uint8_t *lz_buf;              // Compressed block before it is stored
+  uint64_t hit_cnt;
+  uint64_t store_cnt;
+  uint64_t reject_cnt;
+};
+
+
+/*
+ * @brief   Memory shared by the caches created with init_pooled_block_cache()
+ *
+ * The pool is divided into chunks of BLK_POOL_CHUNK_SZ bytes, each holding
+ * the data of a chunk of bufs of one cache.
+ */
+struct blk_pool
+{
+  pthread_mutex_t lock;         // Protects the pool and the pool fields of its caches
+  void *mem;
+  int chunk_cnt;
+  int reserved_cnt;             // Chunks reserved by the minimums of caches
+  void **free_chunk;            // Stack of free chunks
+  int free_cnt;
+  block_cache_list_t cache_list;
+};
 
 
 /*
@@ -53,9 +384,6 @@ LIST_TYPE(buf, buf_list_t, buf_link_t);
  */
 struct block_cache
 {
-  void *mem_pool;
-  size_t mem_pool_sz;
-
   int dev_fd;
     
   size_t block_size;
@@ -66,14 +394,97 @@ struct block_cache
   off64_t lba_start;
   off64_t lba_end;
   
-  struct buf *buf_table;
+  struct blk_chunk **chunk;     // Chunks holding the bufs of the cache
+  int chunk_cnt;
+  int chunk_max;
   int buf_cnt;
+  int min_buf_cnt;              // Memory pressure does not shrink the cache below this
+  pthread_mutex_t resize_lock;  // Serializes resize_block_cache() and memory pressure
+  int extent_chunk;             // Where get_block_range() searches for free bufs from
+  int extent_pos;
 
   int avail_buf_cnt;
-  int read_ahead_blocks;
+  int read_ahead_blocks;        // Maximum readahead window
+  int read_ahead_max;           // As passed to init_block_cache()
+  int direct_threshold;         // Transfers of this many blocks bypass the cache, 0 for none
 
-  buf_list_t lru_list;
-  buf_list_t hash_list[BUF_HASH_CNT];
+  struct blk_ra_stream ra_stream[BLK_RA_STREAM_CNT];
+  uint32_t ra_clock;
+
+  int write_policy;
+  int dirty_cnt;
+  int dirty_high_watermark;
+  int dirty_low_watermark;
+  bool dirty_watermark_auto;    // Watermarks follow the size of the cache
+
+  uint32_t barrier_epoch;       // Incremented by block_cache_barrier()
+  uint32_t last_write_epoch;    // Epoch of the last block written to the device
+  bool unsynced_writes;         // Blocks written since the last fsync
+  int write_error;              // Failed write not yet reported by a sync or barrier
+  
+  int policy;
+  buf_list_t free_list;         // Bufs not holding a valid block
+  buf_list_t lru_list;          // LRU list, or the Am list of 2Q
+  buf_list_t a1in_list;         // 2Q FIFO of blocks referenced once
+  int a1in_cnt;
+  int a1in_max;
+  
+  off64_t *ghost_block;         // 2Q A1out ring of blocks evicted from A1in
+  int *ghost_next;              // Ghost hash chains, -1 terminated
+  int *ghost_bucket;
+  int ghost_max;
+  int ghost_pos;
+  int ghost_bucket_mask;
+
+  struct block_cache_stats stats;   // Protected by the cache lock
+  struct profiling_samples *prof_read;
+  struct profiling_samples *prof_write;
+  blk_trace_fn_t trace_fn;      // Called for each operation, see set_block_cache_trace()
+  void *trace_arg;
+
+  buf_list_t dirty_list;        // Dirty, released blocks in write-back mode, oldest first
+
+  struct blk_victim_tier *vtier;    // Evicted clean blocks kept compressed, or NULL
+
+  blk_discard_fn_t discard_fn;  // Discards freed blocks, see set_block_cache_discard()
+  void *discard_arg;
+  struct blk_discard_ext discard_ext[BLK_DISCARD_EXTENT_MAX];   // Sorted, not adjacent
+  int discard_ext_cnt;
+  struct timespec discard_since;    // When the oldest queued extent was freed
+
+  bool concurrent;              // Locks are taken, see set_block_cache_concurrent()
+  pthread_mutex_t lock;         // Protects everything but the shard indexes
+  pthread_mutex_t write_lock;   // Serializes writes to the device
+  pthread_mutex_t io_lock;      // Protects the I/O request queue
+  pthread_cond_t io_cond;       // Signalled when requests complete or dispatching stops
+  blk_io_req_list_t io_queue;   // Requests waiting to be dispatched
+  int io_depth;
+  bool io_dispatching;          // A thread is dispatching the queue
+  off64_t io_head;              // Block following the last dispatch
+  struct buf **wb_bufs;         // Bufs claimed for writing, under write_lock
+  int wb_bufs_max;
+  struct blk_shard shard[BLK_SHARD_CNT];
+
+  bool async;                   // I/O worker running, see set_block_cache_async()
+  bool async_exit;              // I/O worker to exit once its queues are empty
+  pthread_t async_thread;
+  pthread_mutex_t async_lock;   // Protects the request queues
+  pthread_cond_t async_cond;    // Signalled when a request is queued
+  pthread_cond_t async_done_cond;   // Signalled when a get_block_async() completes
+  blk_async_list_t async_list;  // Queued get_block_async() requests
+  struct blk_prefetch prefetch_queue[BLK_PREFETCH_QUEUE_SZ];
+  int prefetch_head;
+  int prefetch_cnt;
+  off64_t *prewarm_block;       // Sorted hot set being read, see block_cache_prewarm()
+  int prewarm_cnt;
+  int prewarm_pos;              // Next entry of prewarm_block to read
+
+  struct blk_pool *pool;        // Pool the bufs are drawn from, or NULL
+  block_cache_link_t pool_link;
+  int pool_min_chunks;          // Chunks reserved in the pool
+  int pool_miss_cnt;            // Misses since the pool was last rebalanced
+  uint64_t pool_cost_mark;      // Read time when the pool was last rebalanced
+  uint64_t pool_cost;           // Read time between the last two rebalances
 };
 
 
@@ -82,16 +493,37 @@ struct block_cache
  */
 struct buf
 {
-  off_t block;
+  off64_t block;
   void *data;
-  uint32_t flags;
+  struct blk_chunk *chunk;      // Chunk the buf belongs to
+  uint32_t flags;               // BLK_HINT_* passed to get_block
   
   bool in_use;
   bool valid;
   bool dirty;
+  bool busy;                    // Being written by a flush, must not be reused
+  bool on_dirty_list;
+  uint32_t dirty_epoch;
+  bool marked_dirty;            // block_markdirty() called since the buf was got
+  bool prefetched;              // Read ahead and not yet used
+  uint8_t queue;                // Policy queue, BLK_QUEUE_*
+  bool on_a1in;                 // Linked on A1in, possibly while in use
+  uint8_t ra_stream;            // Index of stream that read the block ahead
   
   buf_link_t lru_link;
-  buf_link_t hash_link;
+  buf_link_t dirty_link;
+};
+
+
+/*
+ * @brief   A table of bufs whose data is held in contiguous memory
+ */
+struct blk_chunk
+{
+  struct blk_pool *pool;        // Pool the memory was taken from, or NULL
+  void *mem;
+  int buf_cnt;
+  struct buf buf[];
 };
 
 
@@ -101,13 +533,45 @@ struct buf
 
 // block_cache.c
 struct block_cache *init_block_cache(int dev_fd, int buf_cnt, size_t block_size, int read_ahead_blocks);
+void free_cache(struct block_cache *cache);
+struct blk_pool *init_block_pool(size_t pool_sz);
+int free_block_pool(struct blk_pool *pool);
+struct block_cache *init_pooled_block_cache(struct blk_pool *pool, int dev_fd, int min_buf_cnt, size_t block_size, int read_ahead_blocks);
+int resize_block_cache(struct block_cache *cache, int buf_cnt);
+int set_block_cache_min_bufs(struct block_cache *cache, int min_buf_cnt);
+int block_cache_memory_pressure(struct block_cache *cache, int level);
+int set_block_cache_writeback(struct block_cache *cache, int write_policy, int dirty_high_watermark);
+int set_block_cache_policy(struct block_cache *cache, int policy);
+int set_block_cache_concurrent(struct block_cache *cache, bool concurrent);
+int set_block_cache_async(struct block_cache *cache, bool async);
 struct buf *get_block(struct block_cache *cache, off64_t block, int opt);
 struct buf *get_block_readahead(struct block_cache *cache, off64_t start_block);
+void *get_block_range(struct block_cache *cache, off64_t start_block, int count, int opt, struct buf **bufs);
+void put_block_range(struct block_cache *cache, struct buf **bufs, int count);
 void put_block(struct block_cache *cache, struct buf *buf);
 void invalidate_block(struct block_cache *cache, off64_t block);
 void block_markdirty(struct buf *bp);
 void block_markclean(struct buf *bp);
 int block_isclean(struct buf *bp);
+int sync_block_cache(struct block_cache *cache);
+int sync_block_range(struct block_cache *cache, off64_t start_block, off64_t block_cnt);
+int block_cache_barrier(struct block_cache *cache);
+int prefetch_blocks(struct block_cache *cache, off64_t start_block, int count);
+int get_block_async(struct block_cache *cache, struct blk_async *req);
+bool block_async_done(struct block_cache *cache, struct blk_async *req);
+struct buf *wait_block_async(struct block_cache *cache, struct blk_async *req);
+void block_cache_get_stats(struct block_cache *cache, struct block_cache_stats *stats);
+void block_cache_reset_stats(struct block_cache *cache);
+int set_block_cache_profiling(struct block_cache *cache, struct profiling_samples *read_ps, struct profiling_samples *write_ps);
+int set_block_cache_trace(struct block_cache *cache, blk_trace_fn_t trace_fn, void *arg);
+int set_block_cache_victim_tier(struct block_cache *cache, size_t arena_sz);
+int block_cache_save_hot_set(struct block_cache *cache, const char *path, int max_blocks);
+int block_cache_prewarm(struct block_cache *cache, const char *path);
+int set_block_cache_direct_threshold(struct block_cache *cache, int block_cnt);
+int block_cache_read(struct block_cache *cache, off64_t start_block, int count, void *data);
+int block_cache_write(struct block_cache *cache, off64_t start_block, int count, const void *data);
+int set_block_cache_discard(struct block_cache *cache, blk_discard_fn_t discard_fn, void *arg);
+int discard_block_range(struct block_cache *cache, off64_t start_block, off64_t block_cnt);
 
 
 
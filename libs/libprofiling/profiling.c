@@ -16,8 +16,28 @@
  * *************************************************************************
  * 
  * Simple profiling library for measuring performance of sections of code
- * 
- * TODO: Extend API, allow dynamic sizing of profiling buffers
+ *
+ * A struct profiling_samples keeps the last window_size samples and
+ * statistics of them that are updated in constant time per sample:
+ *
+ * - sum and avg of the window.
+ * - min and max of the window from two monotonic deques of window positions.
+ *   The min deque holds positions whose values increase from front to
+ *   back, a new sample first removes the positions at the back with values
+ *   no smaller than it, so the front is always the minimum.  The position
+ *   about to be overwritten is the oldest, it is removed from the front if
+ *   it is still there.  The max deque is the same with the order reversed.
+ *   A window set up without deques, see profiling_init_samples(), instead
+ *   scans the window when its min or max leaves it.
+ * - mean and m2, the sum of squared differences from the mean, by
+ *   Welford's method extended to replace the oldest sample.  Rounding errors
+ *   would accumulate forever, so they are recomputed exactly from the window
+ *   each time it wraps, an amortized constant cost.  A bound on the error
+ *   of m2 is also kept, when large samples leave the window m2 can cancel
+ *   down to the size of the error, in which case it is recomputed early.
+ * - ewma, an exponentially weighted moving average of all samples, and an
+ *   EWMA of the interval between samples added with a timestamp, giving a
+ *   rate per second.
  */
 
 #define LOG_LEVEL_ERROR
@@ -31,6 +51,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <float.h>
 #include <time.h>
 #include <sys/time.h>
 #include <sys/profiling.h>
@@ -38,14 +59,38 @@
 #include <sys/debug.h>
 
 
+static void update_min_max(struct profiling_samples *ps, int p, int64_t val, bool full);
+static void scan_min_max(struct profiling_samples *ps, int64_t val, int64_t old_val, bool full);
+static void recompute_moments(struct profiling_samples *ps);
+static uint64_t isqrt(uint64_t x);
+
+
+/* @brief   Reduce an index less than twice the window size into the window,
+ *          cheaper than a modulo
+ */
+static inline int wrap(int idx, int ws)
+{
+  return (idx >= ws) ? idx - ws : idx;
+}
+
+
+// Multiple of the rounding error of each update of m2 added to its bound
+#define PROFILING_M2_ERR_ULPS         8
+
+// m2 is recomputed if its error bound exceeds 1 / this fraction of it
+#define PROFILING_M2_MAX_REL_ERR_INV  1e9
+
+
 /*
  * Libprofiling variable to control profiling
  */
 int __libprofiling_enable = false;
 
 
-/*
+/* @brief   Clear a struct profiling_samples, which has no window
  *
+ * A caller may then attach its own window and window_size.  deque may be
+ * left NULL, the min and max are then kept by scanning the window.
  */
 void profiling_init_samples(struct profiling_samples *ps)
 {
@@ -53,38 +98,191 @@ void profiling_init_samples(struct profiling_samples *ps)
 }
 
 
-/*
+/* @brief   Allocate the window of a struct profiling_samples
  *
+ * @param   ps, samples to initialize
+ * @param   window_size, number of samples the window holds
+ * @param   hist, true to also count every sample in a histogram
+ * @return  0 on success, negative errno on failure
+ */
+int profiling_alloc_samples(struct profiling_samples *ps, int window_size, bool hist)
+{
+  profiling_init_samples(ps);
+  
+  if (window_size <= 0) {
+    return -EINVAL;
+  }
+  
+  ps->window = malloc(window_size * sizeof *ps->window);
+  ps->deque = malloc(2 * window_size * sizeof *ps->deque);
+  ps->hist = (hist) ? malloc(sizeof *ps->hist) : NULL;
+  
+  if (ps->window == NULL || ps->deque == NULL || (hist && ps->hist == NULL)) {
+    profiling_free_samples(ps);
+    return -ENOMEM;
+  }
+  
+  ps->window_size = window_size;
+  profiling_reset_samples(ps);
+  return 0;
+}
+
+
+/* @brief   Free the window of samples allocated by profiling_alloc_samples()
  */
-void profiling_add_sample(struct profiling_samples *ps, int val)
+void profiling_free_samples(struct profiling_samples *ps)
 {
-  if (ps->sample_cnt < ps->window_size) {
-    ps->window[ps->i] = val;
+  free(ps->window);
+  free(ps->deque);
+  free(ps->hist);
+  profiling_init_samples(ps);
+}
+
+
+/* @brief   Discard all samples and statistics
+ *
+ * The window, its size, any histogram and the EWMA weight are kept.
+ */
+void profiling_reset_samples(struct profiling_samples *ps)
+{
+  ps->sample_cnt = 0;
+  ps->i = 0;
+  ps->total_cnt = 0;
+  ps->sum = 0;
+  ps->avg = 0;
+  ps->min = 0;
+  ps->max = 0;
+  ps->mean = 0;
+  ps->m2 = 0;
+  ps->m2_err = 0;
+  ps->ewma = 0;
+  ps->ewma_interval = 0;
+  ps->last_ts = 0;
+  ps->min_head = 0;
+  ps->min_cnt = 0;
+  ps->max_head = 0;
+  ps->max_cnt = 0;
+  
+  if (ps->hist != NULL) {
+    profiling_hist_init(ps->hist);
+  }
+}
 
-    ps->i = (ps->i + 1) % ps->window_size;
-    ps->sample_cnt++;
 
-    ps->sum += (int64_t)val;  
-    ps->avg = (int)(ps->sum / ps->sample_cnt);
+/* @brief   Add a sample to the window and update the statistics
+ */
+void profiling_add_sample(struct profiling_samples *ps, int64_t val)
+{
+  int64_t old_val = 0;
+  double old_mean;
+  double alpha;
+  double d;
+  int ws = ps->window_size;
+  int p = ps->i;
+  bool full = (ps->sample_cnt == ws);
+  
+  if (full) {
+    old_val = ps->window[p];
+    ps->sum += val - old_val;
+    old_mean = ps->mean;
+    ps->mean += (double)(val - old_val) / ws;
+    d = (double)(val - old_val) * ((val - ps->mean) + (old_val - old_mean));
   } else {
-    int old_val = ps->window[ps->i];
-    ps->window[ps->i] = val;
-    
-    ps->i = (ps->i + 1) % ps->window_size;
+    ps->sample_cnt++;
+    ps->sum += val;
+    old_mean = ps->mean;
+    ps->mean += (val - old_mean) / ps->sample_cnt;
+    d = (val - old_mean) * (val - ps->mean);
+  }
+  
+  ps->m2 += d;
+  ps->m2_err += PROFILING_M2_ERR_ULPS * DBL_EPSILON * ((d < 0) ? -d : d);
+  
+  ps->window[p] = val;
+  ps->i = wrap(p + 1, ws);
+  
+  if (ps->deque != NULL) {
+    update_min_max(ps, p, val, full);
+  } else {
+    scan_min_max(ps, val, old_val, full);
+  }
+  
+  ps->avg = ps->sum / ps->sample_cnt;
+  
+  if (ps->i == 0 || ps->m2 < ps->m2_err * PROFILING_M2_MAX_REL_ERR_INV) {
+    recompute_moments(ps);
+  }
+  
+  alpha = (ps->ewma_alpha > 0) ? ps->ewma_alpha : PROFILING_EWMA_ALPHA;
+  ps->ewma = (ps->total_cnt == 0) ? val : ps->ewma + alpha * (val - ps->ewma);
+  ps->total_cnt++;
 
-    ps->sum -= (int64_t)old_val;
-    ps->sum += (int64_t)val;    
-    ps->avg = (int)(ps->sum / ps->sample_cnt);
+  if (ps->hist != NULL) {
+    profiling_hist_add(ps->hist, (val < 0) ? 0 : (uint64_t)val);
   }
+}
 
-  if (ps->sample_cnt == 1) {
-    ps->min = val;
-    ps->max = val;
-  } else if (val < ps->min) {
-    ps->min = val;
-  } else if (val > ps->max) {
-    ps->max = val;
-  }  
+
+/* @brief   Add a sample taken at a profiling_timestamp(), also updating
+ *          the rate of samples
+ */
+void profiling_add_sample_ts(struct profiling_samples *ps, int64_t val, uint64_t ts)
+{
+  double interval;
+  double alpha;
+  
+  if (ps->total_cnt > 0) {
+    interval = (double)profiling_elapsed_nsec(ps->last_ts, ts);
+    alpha = (ps->ewma_alpha > 0) ? ps->ewma_alpha : PROFILING_EWMA_ALPHA;
+    ps->ewma_interval = (ps->ewma_interval == 0) ? interval
+                        : ps->ewma_interval + alpha * (interval - ps->ewma_interval);
+  }
+  
+  ps->last_ts = ts;
+  profiling_add_sample(ps, val);
+}
+
+
+/* @brief   Get the sample variance of the window
+ *
+ * Returned as a double as the variance of 64 bit samples can exceed 64 bits
+ */
+double profiling_samples_variance(struct profiling_samples *ps)
+{
+  if (ps->sample_cnt < 2 || ps->m2 <= 0) {
+    return 0;
+  }
+  
+  return ps->m2 / (ps->sample_cnt - 1);
+}
+
+
+/* @brief   Get the standard deviation of the window, rounded down
+ *
+ * A variance too large for a uint64_t is scaled down by powers of 4 and
+ * the root scaled back up, keeping the library free of libm.
+ */
+int64_t profiling_samples_stddev(struct profiling_samples *ps)
+{
+  double var = profiling_samples_variance(ps);
+  int shift = 0;
+  
+  while (var >= 18446744073709551616.0) {
+    var /= 4;
+    shift++;
+  }
+  
+  return (int64_t)(isqrt((uint64_t)var) << shift);
+}
+
+
+/* @brief   Get the EWMA rate of samples added with a timestamp
+ *
+ * @return  samples per second, or 0 if fewer than two have been added
+ */
+double profiling_samples_rate(struct profiling_samples *ps)
+{
+  return (ps->ewma_interval > 0) ? 1e9 / ps->ewma_interval : 0;
 }
 
 
@@ -94,11 +292,9 @@ void profiling_add_sample(struct profiling_samples *ps, int val)
 void profiling_microsecs(struct profiling_samples *ps, struct timespec *start, struct timespec *end)
 {
   struct timespec diff;
-  int micros;
   
   diff_timespec(&diff, end, start);
-  micros = (int)(((uint64_t)diff.tv_sec * 1000000) + diff.tv_nsec / 1000);  
-  profiling_add_sample(ps, micros);
+  profiling_add_sample(ps, (int64_t)diff.tv_sec * 1000000 + diff.tv_nsec / 1000);
 }
 
 
@@ -108,10 +304,133 @@ void profiling_microsecs(struct profiling_samples *ps, struct timespec *start, s
 void profiling_millisecs(struct profiling_samples *ps, struct timespec *start, struct timespec *end)
 {
   struct timespec diff;
-  int millis;
   
   diff_timespec(&diff, end, start);    
-  millis = (int)(((uint64_t)diff.tv_sec * 1000) + diff.tv_nsec / 1000000);
-  profiling_add_sample(ps, millis);
+  profiling_add_sample(ps, (int64_t)diff.tv_sec * 1000 + diff.tv_nsec / 1000000);
+}
+
+
+/* @brief   Update the min and max deques with a sample stored at position p
+ *
+ * @param   full, true if the sample replaced the oldest one of a full window
+ */
+static void update_min_max(struct profiling_samples *ps, int p, int64_t val, bool full)
+{
+  int ws = ps->window_size;
+  int *min_dq = ps->deque;
+  int *max_dq = ps->deque + ws;
+  
+  if (full) {
+    if (ps->min_cnt > 0 && min_dq[ps->min_head] == p) {
+      ps->min_head = wrap(ps->min_head + 1, ws);
+      ps->min_cnt--;
+    }
+
+    if (ps->max_cnt > 0 && max_dq[ps->max_head] == p) {
+      ps->max_head = wrap(ps->max_head + 1, ws);
+      ps->max_cnt--;
+    }
+  }
+  
+  while (ps->min_cnt > 0 && ps->window[min_dq[wrap(ps->min_head + ps->min_cnt - 1, ws)]] >= val) {
+    ps->min_cnt--;
+  }
+  
+  min_dq[wrap(ps->min_head + ps->min_cnt, ws)] = p;
+  ps->min_cnt++;
+
+  while (ps->max_cnt > 0 && ps->window[max_dq[wrap(ps->max_head + ps->max_cnt - 1, ws)]] <= val) {
+    ps->max_cnt--;
+  }
+  
+  max_dq[wrap(ps->max_head + ps->max_cnt, ws)] = p;
+  ps->max_cnt++;
+
+  ps->min = ps->window[min_dq[ps->min_head]];
+  ps->max = ps->window[max_dq[ps->max_head]];
+}
+
+
+/* @brief   Update the min and max of a window that has no deques
+ *
+ * @param   old_val, the sample replaced if full is true
+ *
+ * The window is only scanned when the sample leaving it was its min or max.
+ */
+static void scan_min_max(struct profiling_samples *ps, int64_t val, int64_t old_val, bool full)
+{
+  if (ps->sample_cnt == 1) {
+    ps->min = val;
+    ps->max = val;
+  } else if (full && (old_val == ps->min || old_val == ps->max)) {
+    ps->min = ps->window[0];
+    ps->max = ps->window[0];
+    
+    for (int t = 1; t < ps->window_size; t++) {
+      if (ps->window[t] < ps->min) {
+        ps->min = ps->window[t];
+      }
+      
+      if (ps->window[t] > ps->max) {
+        ps->max = ps->window[t];
+      }
+    }
+  } else {
+    if (val < ps->min) {
+      ps->min = val;
+    }
+    
+    if (val > ps->max) {
+      ps->max = val;
+    }
+  }
+}
+
+
+/* @brief   Recompute the mean and m2 of the window exactly
+ */
+static void recompute_moments(struct profiling_samples *ps)
+{
+  double mean = (double)ps->sum / ps->sample_cnt;
+  double d;
+  double m2 = 0;
+  int p = ps->i;
+  
+  // The window is only partly filled from its start until it wraps
+  for (int t = 0; t < ps->sample_cnt; t++) {
+    p = (p == 0) ? ps->window_size - 1 : p - 1;
+    d = ps->window[p] - mean;
+    m2 += d * d;
+  }
+  
+  ps->mean = mean;
+  ps->m2 = m2;
+  ps->m2_err = PROFILING_M2_ERR_ULPS * DBL_EPSILON * m2;
+}
+
+
+/* @brief   Integer square root, rounded down
+ */
+static uint64_t isqrt(uint64_t x)
+{
+  uint64_t r = 0;
+  uint64_t bit = (uint64_t)1 << 62;
+  
+  while (bit > x) {
+    bit >>= 2;
+  }
+  
+  while (bit != 0) {
+    if (x >= r + bit) {
+      x -= r + bit;
+      r = (r >> 1) + bit;
+    } else {
+      r >>= 1;
+    }
+    
+    bit >>= 2;
+  }
+  
+  return r;
 }
 
@@ -0,0 +1,214 @@
+/*
+ * Copyright 2023  Marven Gilhespie
+ *
+ * Licensed under the Apache License, segment_id 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+
+
+/* Timestamps for timing short sections of code.
+ *
+ * clock_gettime() is a system call on CheviotOS, which costs more than many
+ * of the sections worth measuring.  profiling_timestamp() instead reads a
+ * free running counter that user mode can read directly:
+ *
+ * - the counter exposed by the HAL, the generic timer's CNTVCT on the
+ *   Raspberry Pi 4 or the PMU cycle counter on the Raspberry Pi 1.
+ * - the TSC on an x86 host build.
+ * - clock_gettime(CLOCK_MONOTONIC_RAW) elsewhere, such as an ARM Linux host
+ *   where it is handled by the vDSO without a system call.
+ *
+ * Timestamps are in counter ticks and are only converted to nanoseconds
+ * when an elapsed time is recorded.  The conversion factor is taken from the
+ * counter's frequency if it is fixed, otherwise it is calibrated once
+ * against clock_gettime() over PROFILING_CALIBRATE_MS.  The calibration
+ * happens on first use unless profiling_clock_calibrate() is called earlier,
+ * which is best done at startup so that it is not part of a measurement.
+ *
+ * A counter narrower than 64 bits, such as the Pi 1's, wraps and elapsed
+ * times are taken modulo its width, so sections must be shorter than one
+ * period of the counter, about 6 seconds at 700MHz.
+ */
+
+#define LOG_LEVEL_ERROR
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/profiling.h>
+#include <sys/syscalls.h>
+#include <sys/debug.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PROFILING_CLOCK_TSC
+#define PROFILING_CLOCK_BITS    64
+#elif defined(__arm__) && !defined(__linux__)
+#include <machine/cheviot_hal.h>
+#define PROFILING_CLOCK_HAL
+#define PROFILING_CLOCK_BITS    HAL_CYCLE_COUNTER_BITS
+#else
+#define PROFILING_CLOCK_BITS    64
+#endif
+
+// Period over which a counter of unknown frequency is calibrated
+#define PROFILING_CALIBRATE_MS  10
+
+
+static void calibrate(void);
+static uint64_t read_counter(void);
+static uint64_t read_clock_nsec(void);
+
+
+static pthread_once_t calibrate_once = PTHREAD_ONCE_INIT;
+static uint64_t nsec_per_tick;          // Whole nanoseconds per tick
+static uint64_t nsec_per_tick_frac;     // Fraction of a nanosecond per tick, in 1/2^32
+
+
+/* @brief   Read the current timestamp
+ *
+ * @return  timestamp in ticks of the profiling clock, only the difference
+ *          between two timestamps is meaningful, see profiling_elapsed_nsec()
+ */
+uint64_t profiling_timestamp(void)
+{
+  return read_counter();
+}
+
+
+/* @brief   Calibrate the profiling clock if it has not been already
+ */
+void profiling_clock_calibrate(void)
+{
+  pthread_once(&calibrate_once, calibrate);
+}
+
+
+/* @brief   Convert the time between two timestamps to nanoseconds
+ *
+ * @param   start, timestamp at the start of the interval
+ * @param   end, timestamp at the end of the interval
+ * @return  nanoseconds between start and end
+ */
+uint64_t profiling_elapsed_nsec(uint64_t start, uint64_t end)
+{
+  uint64_t ticks;
+  
+  pthread_once(&calibrate_once, calibrate);
+
+  ticks = end - start;
+  
+#if PROFILING_CLOCK_BITS < 64
+  ticks &= ((uint64_t)1 << PROFILING_CLOCK_BITS) - 1;
+#endif
+
+  return ticks * nsec_per_tick
+         + (ticks >> 32) * nsec_per_tick_frac
+         + (((ticks & 0xffffffff) * nsec_per_tick_frac) >> 32);
+}
+
+
+/* @brief   Add the time between two timestamps as a sample, timestamped
+ *          with the end of the section
+ *
+ * @param   ps, samples to add to
+ * @param   start, timestamp at the start of the section
+ * @param   end, timestamp at the end of the section
+ * @param   unit_nsec, nanoseconds per unit of the sample, 1, 1000 or 1000000
+ */
+void profiling_add_elapsed(struct profiling_samples *ps, uint64_t start, uint64_t end, uint32_t unit_nsec)
+{
+  profiling_add_sample_ts(ps, (int64_t)(profiling_elapsed_nsec(start, end) / unit_nsec), end);
+}
+
+
+/* @brief   Determine the number of nanoseconds per tick of the counter
+ *
+ * The counter and the clock are read back to back at both ends of the
+ * period so that the time between the reads adds little error.
+ */
+static void calibrate(void)
+{
+  struct timespec delay;
+  uint64_t freq = 0;
+  uint64_t start_nsec, end_nsec;
+  uint64_t start_tick, end_tick;
+  uint64_t ticks;
+  uint64_t scaled;
+
+#if defined(PROFILING_CLOCK_HAL)
+  freq = hal_get_cycle_counter_freq();
+#elif !defined(PROFILING_CLOCK_TSC)
+  freq = 1000000000;
+#endif
+
+  if (freq != 0) {
+    scaled = ((uint64_t)1000000000 << 32) / freq;
+  } else {
+    delay.tv_sec = 0;
+    delay.tv_nsec = PROFILING_CALIBRATE_MS * 1000000;
+
+    start_nsec = read_clock_nsec();
+    start_tick = read_counter();
+    nanosleep(&delay, NULL);
+    end_nsec = read_clock_nsec();
+    end_tick = read_counter();
+
+    ticks = end_tick - start_tick;
+
+#if PROFILING_CLOCK_BITS < 64
+    ticks &= ((uint64_t)1 << PROFILING_CLOCK_BITS) - 1;
+#endif
+    
+    if (ticks == 0) {
+      ticks = 1;
+    }
+    
+    scaled = ((end_nsec - start_nsec) << 32) / ticks;
+  }
+  
+  nsec_per_tick = scaled >> 32;
+  nsec_per_tick_frac = scaled & 0xffffffff;
+}
+
+
+/* @brief   Read the counter the profiling clock is based on
+ */
+static uint64_t read_counter(void)
+{
+#if defined(PROFILING_CLOCK_TSC)
+  uint32_t lo, hi;
+
+  __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+  return ((uint64_t)hi << 32) | lo;
+#elif defined(PROFILING_CLOCK_HAL)
+  return hal_get_cycle_counter();
+#else
+  return read_clock_nsec();
+#endif
+}
+
+
+/* @brief   Read CLOCK_MONOTONIC_RAW in nanoseconds
+ */
+static uint64_t read_clock_nsec(void)
+{
+  struct timespec ts;
+  
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
@@ -0,0 +1,207 @@
+/*
+ * Copyright 2023  Marven Gilhespie
+ *
+ * Licensed under the Apache License, segment_id 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+
+/* Log-linear histograms of samples.
+ *
+ * A struct profiling_hist counts any number of 64 bit samples in a fixed
+ * number of buckets.  Values below 2^PROFILING_HIST_SUB_BITS each have a
+ * bucket of their own.  Above that each power of two range is split into
+ * 2^PROFILING_HIST_SUB_BITS buckets of equal width, so a percentile is
+ * reported to within 1 / 2^PROFILING_HIST_SUB_BITS of the true value across
+ * the whole range.  The minimum, maximum and sum are kept exactly.
+ *
+ * Histograms of the same operation taken in different places can be added
+ * together with profiling_hist_merge().  A histogram attached to a
+ * struct profiling_samples is fed every sample added to the window, so the
+ * profiling_end_usec() and profiling_end_msec() macros fill it.
+ *
+ * A histogram is not protected by any lock, callers that share one between
+ * threads must serialize updates.
+ */
+
+#define LOG_LEVEL_ERROR
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/profiling.h>
+#include <sys/debug.h>
+
+
+#define SUB_CNT     (1 << PROFILING_HIST_SUB_BITS)
+
+
+static int hist_bucket(uint64_t val);
+static uint64_t bucket_upper(int idx);
+
+
+/* @brief   Clear a histogram
+ */
+void profiling_hist_init(struct profiling_hist *ph)
+{
+  memset(ph, 0, sizeof *ph);
+}
+
+
+/* @brief   Count a sample
+ */
+void profiling_hist_add(struct profiling_hist *ph, uint64_t val)
+{
+  if (ph->cnt == 0 || val < ph->min) {
+    ph->min = val;
+  }
+  
+  if (val > ph->max) {
+    ph->max = val;
+  }
+  
+  ph->cnt++;
+  ph->sum += val;
+  ph->bucket[hist_bucket(val)]++;
+}
+
+
+/* @brief   Add the samples counted by one histogram to another
+ *
+ * @param   dst, histogram to add to
+ * @param   src, histogram to add, unchanged
+ */
+void profiling_hist_merge(struct profiling_hist *dst, const struct profiling_hist *src)
+{
+  if (src->cnt == 0) {
+    return;
+  }
+  
+  if (dst->cnt == 0 || src->min < dst->min) {
+    dst->min = src->min;
+  }
+  
+  if (src->max > dst->max) {
+    dst->max = src->max;
+  }
+  
+  dst->cnt += src->cnt;
+  dst->sum += src->sum;
+  
+  for (int t = 0; t < PROFILING_HIST_BUCKET_CNT; t++) {
+    dst->bucket[t] += src->bucket[t];
+  }
+}
+
+
+/* @brief   Get the value below or at which a percentage of samples lie
+ *
+ * @param   ph, histogram to query
+ * @param   pct, percentage from 0 to 100
+ * @return  the highest value of the bucket holding the percentile, limited
+ *          to the range of samples counted, or 0 if there are none
+ */
+uint64_t profiling_hist_percentile(const struct profiling_hist *ph, double pct)
+{
+  uint64_t rank;
+  uint64_t seen = 0;
+  uint64_t val;
+  
+  if (ph->cnt == 0) {
+    return 0;
+  }
+  
+  if (pct <= 0.0) {
+    return ph->min;
+  }
+  
+  if (pct >= 100.0) {
+    return ph->max;
+  }
+  
+  rank = (uint64_t)(pct / 100.0 * (double)ph->cnt + 0.5);
+  
+  if (rank == 0) {
+    rank = 1;
+  }
+  
+  for (int t = 0; t < PROFILING_HIST_BUCKET_CNT; t++) {
+    seen += ph->bucket[t];
+    
+    if (seen >= rank) {
+      val = bucket_upper(t);
+      
+      if (val < ph->min) {
+        return ph->min;
+      }
+      
+      return (val > ph->max) ? ph->max : val;
+    }
+  }
+  
+  return ph->max;
+}
+
+
+/* @brief   Get the percentiles usually reported of a histogram
+ *
+ * @param   ph, histogram to query
+ * @param   sum, filled in with the count, average, minimum, maximum and
+ *          50th, 90th, 99th and 99.9th percentiles
+ */
+void profiling_hist_summary(const struct profiling_hist *ph, struct profiling_hist_summary *sum)
+{
+  sum->cnt = ph->cnt;
+  sum->avg = (ph->cnt > 0) ? ph->sum / ph->cnt : 0;
+  sum->min = ph->min;
+  sum->max = ph->max;
+  sum->p50 = profiling_hist_percentile(ph, 50.0);
+  sum->p90 = profiling_hist_percentile(ph, 90.0);
+  sum->p99 = profiling_hist_percentile(ph, 99.0);
+  sum->p999 = profiling_hist_percentile(ph, 99.9);
+}
+
+
+/* @brief   Get the index of the bucket counting a value
+ */
+static int hist_bucket(uint64_t val)
+{
+  int msb;
+  int shift;
+  
+  if (val < SUB_CNT) {
+    return (int)val;
+  }
+  
+  msb = 63 - __builtin_clzll(val);
+  shift = msb - PROFILING_HIST_SUB_BITS;
+  return ((shift + 1) << PROFILING_HIST_SUB_BITS) + (int)((val >> shift) - SUB_CNT);
+}
+
+
+/* @brief   Get the highest value counted by a bucket
+ */
+static uint64_t bucket_upper(int idx)
+{
+  int shift;
+  uint64_t lower;
+  
+  if (idx < SUB_CNT) {
+    return (uint64_t)idx;
+  }
+  
+  shift = (idx >> PROFILING_HIST_SUB_BITS) - 1;
+  lower = (uint64_t)(SUB_CNT + (idx & (SUB_CNT - 1))) << shift;
+  return lower + (((uint64_t)1 << shift) - 1);
+}
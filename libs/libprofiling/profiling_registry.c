@@ -0,0 +1,372 @@
+/*
+ * Copyright 2023  Marven Gilhespie
+ *
+ * Licensed under the Apache License, segment_id 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+
+
+/* Registry of profiling points and snapshots of their values.
+ *
+ * Each profiling_define_* macro also defines a struct profiling_point
+ * naming the variable and places a pointer to it in the "profiling_points"
+ * section.  The linker gathers the pointers of all object files of a
+ * program into one array bounded by __start_profiling_points and
+ * __stop_profiling_points, so every point is known without any code
+ * running at startup or a list being maintained.
+ *
+ * profiling_snapshot() serializes the current values of all points, either
+ * as text with a line per point or as a compact binary format, for a
+ * server to return in a message or to write to a file with
+ * profiling_snapshot_file().  Values are read without stopping the threads
+ * updating them so a snapshot is not an exact instant.
+ *
+ * The binary format is a struct profiling_snapshot_hdr followed by a
+ * record per point: a struct profiling_snapshot_rec, the name without a
+ * terminating NUL and field_cnt int64_t values, all in host byte order and
+ * without padding.  The fields of each kind are those listed in
+ * field_names below, in the same order as the text format.
+ */
+
+#define LOG_LEVEL_ERROR
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/profiling.h>
+#include <sys/syscalls.h>
+#include <sys/debug.h>
+
+
+/* @brief   Output buffer of a snapshot, counting what did not fit
+ */
+struct snapshot_out
+{
+  char *buf;
+  size_t size;
+  size_t len;
+};
+
+
+static int read_point(struct profiling_point *pp, int64_t *val);
+static int read_samples(struct profiling_samples *ps, int64_t *val);
+static int read_pts(struct profiling_psamples *pps, int64_t *val);
+static void put_bytes(struct snapshot_out *out, const void *data, size_t sz);
+static void put_text(struct snapshot_out *out, const char *fmt, ...);
+
+
+extern struct profiling_point *__start_profiling_points[] __attribute__((weak));
+extern struct profiling_point *__stop_profiling_points[] __attribute__((weak));
+
+
+// Names of the fields of each kind of point, indexed by kind
+static const char *const field_names[][PROFILING_SNAPSHOT_MAX_FIELDS] = {
+  [PROFILING_POINT_TS]       = { "cnt", "avg", "min", "max", "stddev", "hist_cnt", "p50", "p90", "p99", "p999" },
+  [PROFILING_POINT_COUNTER]  = { "val" },
+  [PROFILING_POINT_PCOUNTER] = { "val" },
+  [PROFILING_POINT_PTS]      = { "cnt", "avg", "min", "max", "stddev", "hist_cnt", "p50", "p90", "p99", "p999" },
+};
+
+static const char *const kind_names[] = {
+  [PROFILING_POINT_TS]       = "ts",
+  [PROFILING_POINT_COUNTER]  = "counter",
+  [PROFILING_POINT_PCOUNTER] = "pcounter",
+  [PROFILING_POINT_PTS]      = "pts",
+};
+
+
+/* @brief   Get the number of profiling points of the program
+ */
+int profiling_point_cnt(void)
+{
+  if (__start_profiling_points == NULL) {
+    return 0;
+  }
+  
+  return (int)(__stop_profiling_points - __start_profiling_points);
+}
+
+
+/* @brief   Get a profiling point by index
+ *
+ * @param   idx, index from 0 to profiling_point_cnt() - 1
+ * @return  the point, or NULL if idx is out of range
+ */
+struct profiling_point *profiling_get_point(int idx)
+{
+  if (idx < 0 || idx >= profiling_point_cnt()) {
+    return NULL;
+  }
+  
+  return __start_profiling_points[idx];
+}
+
+
+/* @brief   Find a profiling point by name
+ *
+ * @param   name, name of the variable passed to profiling_define_*
+ * @param   kind, PROFILING_POINT_* kind of the point, or 0 for any kind
+ * @return  the first point found, or NULL if there is none
+ */
+struct profiling_point *profiling_find_point(const char *name, int kind)
+{
+  struct profiling_point *pp;
+  int cnt = profiling_point_cnt();
+
+  for (int t = 0; t < cnt; t++) {
+    pp = __start_profiling_points[t];
+    
+    if ((kind == 0 || pp->kind == kind) && strcmp(pp->name, name) == 0) {
+      return pp;
+    }
+  }
+  
+  return NULL;
+}
+
+
+/* @brief   Serialize the values of all profiling points
+ *
+ * @param   buf, buffer to write the snapshot to, may be NULL if size is 0
+ * @param   size, size of buf
+ * @param   format, PROFILING_SNAPSHOT_TEXT or PROFILING_SNAPSHOT_BINARY
+ * @return  size of the whole snapshot, which was truncated if larger
+ *          than size.  A text snapshot is NUL terminated if it fits,
+ *          the NUL is not counted.
+ *
+ * Like snprintf() this can be called with a size of 0 to find the size
+ * of buffer needed.  Values may change between calls so a slightly larger
+ * buffer should be allowed.
+ */
+size_t profiling_snapshot(void *buf, size_t size, int format)
+{
+  struct snapshot_out out;
+  struct profiling_snapshot_hdr hdr;
+  struct profiling_snapshot_rec rec;
+  struct profiling_point *pp;
+  int64_t val[PROFILING_SNAPSHOT_MAX_FIELDS];
+  size_t name_len;
+  int cnt;
+  int field_cnt;
+  
+  out.buf = buf;
+  out.size = size;
+  out.len = 0;
+  cnt = profiling_point_cnt();
+    
+  if (format == PROFILING_SNAPSHOT_BINARY) {
+    hdr.magic = PROFILING_SNAPSHOT_MAGIC;
+    hdr.version = PROFILING_SNAPSHOT_VERSION;
+    hdr.point_cnt = cnt;
+    put_bytes(&out, &hdr, sizeof hdr);
+  }
+  
+  for (int t = 0; t < cnt; t++) {
+    pp = __start_profiling_points[t];
+    field_cnt = read_point(pp, val);
+
+    if (format == PROFILING_SNAPSHOT_BINARY) {
+      name_len = strlen(pp->name);
+      
+      rec.kind = pp->kind;
+      rec.name_len = (name_len < 255) ? name_len : 255;
+      rec.field_cnt = field_cnt;
+      rec.reserved = 0;
+      put_bytes(&out, &rec, sizeof rec);
+      put_bytes(&out, pp->name, rec.name_len);
+      put_bytes(&out, val, field_cnt * sizeof val[0]);
+    } else {
+      put_text(&out, "%s ", kind_names[pp->kind]);
+      put_bytes(&out, pp->name, strlen(pp->name));
+
+      for (int f = 0; f < field_cnt; f++) {
+        put_text(&out, " %s=%lld", field_names[pp->kind][f], (long long)val[f]);
+      }
+
+      put_text(&out, "\n");
+    }
+  }
+  
+  if (format != PROFILING_SNAPSHOT_BINARY && out.len < out.size) {
+    out.buf[out.len] = '\0';
+  }
+  
+  return out.len;
+}
+
+
+/* @brief   Write a snapshot of all profiling points to a file
+ *
+ * @param   path, file to create or replace
+ * @param   format, PROFILING_SNAPSHOT_TEXT or PROFILING_SNAPSHOT_BINARY
+ * @return  number of bytes written, or negative errno on failure
+ */
+ssize_t profiling_snapshot_file(const char *path, int format)
+{
+  char *buf = NULL;
+  size_t size = 0;
+  size_t len;
+  int fd;
+  int sc = 0;
+  
+  len = profiling_snapshot(NULL, 0, format);
+
+  while (len >= size) {
+    free(buf);
+    size = len + len / 8 + 64;
+
+    if ((buf = malloc(size)) == NULL) {
+      return -ENOMEM;
+    }
+    
+    len = profiling_snapshot(buf, size, format);
+  }
+  
+  if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+    sc = -errno;
+    free(buf);
+    return sc;
+  }
+  
+  if (write(fd, buf, len) != (ssize_t)len) {
+    sc = -EIO;
+  }
+
+  if (close(fd) != 0 && sc == 0) {
+    sc = -errno;
+  }
+  
+  free(buf);
+  return (sc == 0) ? (ssize_t)len : sc;
+}
+
+
+/* @brief   Read the current values of a profiling point
+ *
+ * @param   pp, point to read
+ * @param   val, array of PROFILING_SNAPSHOT_MAX_FIELDS to store values in
+ * @return  number of values stored
+ */
+static int read_point(struct profiling_point *pp, int64_t *val)
+{
+  switch (pp->kind) {
+    case PROFILING_POINT_TS:
+      return read_samples(pp->var, val);
+
+    case PROFILING_POINT_COUNTER:
+      val[0] = *(int *)pp->var;
+      return 1;
+    
+    case PROFILING_POINT_PCOUNTER:
+      val[0] = profiling_pcounter_read(pp->var);
+      return 1;
+    
+    case PROFILING_POINT_PTS:
+      return read_pts(pp->var, val);
+
+    default:
+      return 0;
+  }
+}
+
+
+/* @brief   Read the statistics of a window of samples
+ *
+ * @return  number of values stored, the percentiles are only stored if
+ *          the samples have a histogram
+ */
+static int read_samples(struct profiling_samples *ps, int64_t *val)
+{
+  struct profiling_hist_summary sum;
+
+  val[0] = ps->sample_cnt;
+  val[1] = ps->avg;
+  val[2] = ps->min;
+  val[3] = ps->max;
+  val[4] = profiling_samples_stddev(ps);
+  
+  if (ps->hist == NULL) {
+    return 5;
+  }
+  
+  profiling_hist_summary(ps->hist, &sum);
+  val[5] = sum.cnt;
+  val[6] = sum.p50;
+  val[7] = sum.p90;
+  val[8] = sum.p99;
+  val[9] = sum.p999;
+  return 10;
+}
+
+
+/* @brief   Read the values of per-thread sample windows
+ *
+ * The windows are collected into a temporary struct profiling_samples
+ * large enough for all of them, with a histogram for the percentiles.
+ */
+static int read_pts(struct profiling_psamples *pps, int64_t *val)
+{
+  struct profiling_samples ps;
+  int cnt;
+  
+  if (profiling_alloc_samples(&ps, PROFILING_MAX_THREADS * pps->window_size, true) != 0) {
+    return 0;
+  }
+  
+  profiling_psamples_collect(pps, &ps);
+  cnt = read_samples(&ps, val);
+  profiling_free_samples(&ps);
+  return cnt;
+}
+
+
+/* @brief   Append bytes to a snapshot, counting any that do not fit
+ */
+static void put_bytes(struct snapshot_out *out, const void *data, size_t sz)
+{
+  size_t n = 0;
+  
+  if (out->len < out->size) {
+    n = (out->size - out->len < sz) ? out->size - out->len : sz;
+    memcpy(out->buf + out->len, data, n);
+  }
+  
+  out->len += sz;
+}
+
+
+/* @brief   Append formatted text of no more than 63 characters to a
+ *          snapshot, counting any that does not fit
+ */
+static void put_text(struct snapshot_out *out, const char *fmt, ...)
+{
+  va_list ap;
+  char tmp[64];
+  int n;
+  
+  va_start(ap, fmt);
+  n = vsnprintf(tmp, sizeof tmp, fmt, ap);
+  va_end(ap);
+  
+  if (n > 0) {
+    put_bytes(out, tmp, ((size_t)n < sizeof tmp) ? (size_t)n : sizeof tmp - 1);
+  }
+}
+
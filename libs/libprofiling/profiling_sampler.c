@@ -0,0 +1,450 @@
+/*
+ * Copyright 2023  Marven Gilhespie
+ *
+ * Licensed under the Apache License, segment_id 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+
+
+/* Statistical sampling profiler.
+ *
+ * Instrumenting with profiling_begin() and profiling_end_*() only measures
+ * code already suspected of being slow.  The sampler instead arms an
+ * ITIMER_PROF interval timer so that SIGPROF is delivered periodically
+ * while the process is using CPU time.  The signal handler records the PC
+ * that was interrupted and, if a depth greater than 1 is requested, the
+ * return addresses found by walking the frame pointer chain, which needs
+ * code compiled with -fno-omit-frame-pointer.  A leaf function that sets up
+ * no frame of its own is interrupted with the frame pointer of its caller,
+ * so that caller is missing from its stacks.
+ *
+ * Samples are stored in a buffer allocated when the sampler is started.
+ * The handler claims an entry with an atomic increment so that signals
+ * delivered to several threads at once do not need a lock.  Samples taken
+ * once the buffer is full are counted as dropped.
+ *
+ * After profiling_sampler_stop() the samples can be written as a flat
+ * profile of the number of samples at each PC, or as folded stacks, one
+ * line per distinct stack from the outermost frame inwards followed by its
+ * count, the input format of flamegraph.pl.  Addresses are written in hex
+ * and are symbolized offline from the ELF, such as with addr2line, after
+ * subtracting the load address of a position independent executable.
+ *
+ * Reading the interrupted registers from the signal context is machine
+ * specific.  Only Linux host builds on x86-64, AArch64 and 32 bit ARM are
+ * supported, elsewhere profiling_sampler_start() returns -ENOSYS.
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE             // For the register names of ucontext_t
+#endif
+
+#define LOG_LEVEL_ERROR
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/profiling.h>
+#include <sys/syscalls.h>
+#include <sys/debug.h>
+
+#if defined(__linux__) && (defined(__x86_64__) || defined(__aarch64__) || defined(__arm__))
+#include <ucontext.h>
+#define PROFILING_SAMPLER_SUPPORTED
+#endif
+
+// Largest distance between a frame and the interrupted stack pointer or
+// the previous frame that is followed when walking frame pointers
+#define PROFILING_SAMPLER_MAX_FRAME   (1024 * 1024)
+
+
+/* @brief   Number of samples at a PC, for the flat profile
+ */
+struct pc_count
+{
+  uintptr_t pc;
+  int cnt;
+};
+
+
+static int write_flat(FILE *fp);
+static int write_folded(FILE *fp);
+static int cmp_pc(const void *a, const void *b);
+static int cmp_count(const void *a, const void *b);
+static int cmp_stack(const void *a, const void *b);
+
+#ifdef PROFILING_SAMPLER_SUPPORTED
+static void sigprof_handler(int sig, siginfo_t *info, void *ctx);
+static int walk_stack(ucontext_t *uc, uintptr_t *pc, int depth);
+
+static struct sigaction old_action;
+#endif
+
+
+static uintptr_t *sample_pc;            // sample_max samples of sample_depth PCs
+static int sample_max;
+static int sample_depth;
+static int sample_cnt;                  // Samples claimed, may exceed sample_max
+static bool sampler_running;
+
+
+/* @brief   Start sampling the process
+ *
+ * @param   hz, samples per second of CPU time
+ * @param   max_samples, number of samples the buffer holds
+ * @param   depth, number of PCs recorded per sample, 1 to record only the
+ *          interrupted PC, up to PROFILING_SAMPLER_MAX_DEPTH
+ * @return  0 on success, negative errno on failure
+ *
+ * Any samples of a previous run are discarded.  The process's SIGPROF
+ * handler and ITIMER_PROF timer are replaced until the sampler is stopped.
+ */
+int profiling_sampler_start(int hz, int max_samples, int depth)
+{
+#ifdef PROFILING_SAMPLER_SUPPORTED
+  struct sigaction action;
+  struct itimerval timer;
+  
+  if (sampler_running) {
+    return -EBUSY;
+  }
+  
+  if (hz <= 0 || hz > 1000000 || max_samples <= 0 || depth <= 0 || depth > PROFILING_SAMPLER_MAX_DEPTH) {
+    return -EINVAL;
+  }
+  
+  free(sample_pc);
+
+  if ((sample_pc = calloc((size_t)max_samples * depth, sizeof *sample_pc)) == NULL) {
+    return -ENOMEM;
+  }
+  
+  sample_max = max_samples;
+  sample_depth = depth;
+  sample_cnt = 0;
+
+  memset(&action, 0, sizeof action);
+  action.sa_sigaction = sigprof_handler;
+  action.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  
+  if (sigaction(SIGPROF, &action, &old_action) != 0) {
+    return -errno;
+  }
+
+  timer.it_interval.tv_sec = 0;
+  timer.it_interval.tv_usec = 1000000 / hz;
+  timer.it_value = timer.it_interval;
+  
+  if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+    sigaction(SIGPROF, &old_action, NULL);
+    return -errno;
+  }
+  
+  sampler_running = true;
+  return 0;
+#else
+  return -ENOSYS;
+#endif
+}
+
+
+/* @brief   Stop sampling the process
+ *
+ * Restores the previous SIGPROF handler.  The samples remain available to
+ * profiling_sampler_dump() until the sampler is started again.
+ */
+void profiling_sampler_stop(void)
+{
+#ifdef PROFILING_SAMPLER_SUPPORTED
+  struct sigaction ignore;
+  struct itimerval timer;
+
+  if (sampler_running == false) {
+    return;
+  }
+  
+  memset(&timer, 0, sizeof timer);
+  setitimer(ITIMER_PROF, &timer, NULL);
+  
+  // A SIGPROF may still be pending from the last tick.  Ignoring the signal
+  // discards it, otherwise the restored action, usually SIG_DFL, would
+  // terminate the process when it is delivered.
+  memset(&ignore, 0, sizeof ignore);
+  ignore.sa_handler = SIG_IGN;
+  sigemptyset(&ignore.sa_mask);
+  sigaction(SIGPROF, &ignore, NULL);
+  
+  sigaction(SIGPROF, &old_action, NULL);
+  sampler_running = false;
+#endif
+}
+
+
+/* @brief   Get the number of samples taken by the sampler
+ *
+ * @param   dropped, set to the number of samples lost because the buffer
+ *          was full, may be NULL
+ * @return  number of samples in the buffer
+ */
+int profiling_sampler_cnt(int *dropped)
+{
+  int cnt = __atomic_load_n(&sample_cnt, __ATOMIC_RELAXED);
+  
+  if (dropped != NULL) {
+    *dropped = (cnt > sample_max) ? cnt - sample_max : 0;
+  }
+  
+  return (cnt < sample_max) ? cnt : sample_max;
+}
+
+
+/* @brief   Write the samples taken to a file
+ *
+ * @param   path, file to create or replace
+ * @param   format, PROFILING_SAMPLER_FLAT or PROFILING_SAMPLER_FOLDED
+ * @return  number of lines written, or negative errno on failure
+ *
+ * The samples are sorted in place, the sampler must be stopped.
+ */
+int profiling_sampler_dump(const char *path, int format)
+{
+  FILE *fp;
+  int lines;
+  int sc = 0;
+  
+  if (sampler_running) {
+    return -EBUSY;
+  }
+  
+  if ((fp = fopen(path, "w")) == NULL) {
+    return -errno;
+  }
+  
+  lines = (format == PROFILING_SAMPLER_FOLDED) ? write_folded(fp) : write_flat(fp);
+  
+  if (ferror(fp)) {
+    sc = -EIO;
+  }
+  
+  if (fclose(fp) != 0 && sc == 0) {
+    sc = -errno;
+  }
+  
+  return (sc == 0) ? lines : sc;
+}
+
+
+/* @brief   Write the number of samples at each PC, most frequent first
+ *
+ * @return  number of lines written
+ */
+static int write_flat(FILE *fp)
+{
+  struct pc_count *pcc;
+  int cnt = profiling_sampler_cnt(NULL);
+  int n = 0;
+  
+  if (cnt == 0) {
+    return 0;
+  }
+  
+  if ((pcc = malloc(cnt * sizeof *pcc)) == NULL) {
+    return 0;
+  }
+  
+  for (int s = 0; s < cnt; s++) {
+    pcc[s].pc = sample_pc[s * sample_depth];
+    pcc[s].cnt = 1;
+  }
+  
+  qsort(pcc, cnt, sizeof *pcc, cmp_pc);
+
+  for (int s = 1; s < cnt; s++) {
+    if (pcc[s].pc == pcc[n].pc) {
+      pcc[n].cnt++;
+    } else {
+      pcc[++n] = pcc[s];
+    }
+  }
+  
+  n++;
+  qsort(pcc, n, sizeof *pcc, cmp_count);
+  
+  fprintf(fp, "# %d samples\n", cnt);
+  
+  for (int t = 0; t < n; t++) {
+    fprintf(fp, "%#lx %d %.2f%%\n", (unsigned long)pcc[t].pc, pcc[t].cnt, 100.0 * pcc[t].cnt / cnt);
+  }
+  
+  free(pcc);
+  return n + 1;
+}
+
+
+/* @brief   Write each distinct stack, outermost frame first, and the number
+ *          of samples of it
+ *
+ * @return  number of lines written
+ */
+static int write_folded(FILE *fp)
+{
+  uintptr_t *stack;
+  int cnt = profiling_sampler_cnt(NULL);
+  int n = 0;
+  int run;
+  int f;
+  
+  qsort(sample_pc, cnt, sample_depth * sizeof *sample_pc, cmp_stack);
+  
+  for (int s = 0; s < cnt; s += run) {
+    stack = &sample_pc[s * sample_depth];
+    
+    for (run = 1; s + run < cnt && cmp_stack(stack, &sample_pc[(s + run) * sample_depth]) == 0; run++);
+    
+    for (f = sample_depth - 1; f > 0 && stack[f] == 0; f--);
+    
+    for (; f >= 0; f--) {
+      fprintf(fp, "%#lx%s", (unsigned long)stack[f], (f > 0) ? ";" : "");
+    }
+    
+    fprintf(fp, " %d\n", run);
+    n++;
+  }
+  
+  return n;
+}
+
+
+#ifdef PROFILING_SAMPLER_SUPPORTED
+
+/* @brief   Record the interrupted PC and stack of a thread
+ */
+static void sigprof_handler(int sig, siginfo_t *info, void *ctx)
+{
+  int idx;
+  
+  (void)sig;
+  (void)info;
+  
+  if (sample_pc == NULL) {
+    return;
+  }
+  
+  idx = __atomic_fetch_add(&sample_cnt, 1, __ATOMIC_RELAXED);
+
+  if (idx < sample_max) {
+    walk_stack(ctx, &sample_pc[idx * sample_depth], sample_depth);
+  }
+}
+
+
+/* @brief   Get the interrupted PC and the return addresses of its callers
+ *
+ * @param   uc, context of the interrupted thread
+ * @param   pc, array to store PCs in, innermost first
+ * @param   depth, size of the pc array
+ * @return  number of PCs stored, the rest of the array is left as 0
+ *
+ * A frame pointer is only followed if it is aligned, above the previous
+ * one and within PROFILING_SAMPLER_MAX_FRAME of it, the first being
+ * compared with the interrupted stack pointer.  This keeps the walk within
+ * the stack when code without frame pointers leaves other values in the
+ * frame pointer register.
+ */
+static int walk_stack(ucontext_t *uc, uintptr_t *pc, int depth)
+{
+  uintptr_t *fp;
+  uintptr_t *next;
+  uintptr_t low;                // Lowest address the next frame may be at
+  int n = 0;
+  
+#if defined(__x86_64__)
+  pc[n++] = uc->uc_mcontext.gregs[REG_RIP];
+  fp = (uintptr_t *)uc->uc_mcontext.gregs[REG_RBP];
+  low = uc->uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+  pc[n++] = uc->uc_mcontext.pc;
+  fp = (uintptr_t *)uc->uc_mcontext.regs[29];
+  low = uc->uc_mcontext.sp;
+#else
+  // The layout of 32 bit ARM frames depends on the compiler options so
+  // only the interrupted PC is recorded
+  pc[n++] = uc->uc_mcontext.arm_pc;
+  fp = NULL;
+  low = 0;
+#endif
+
+  // Each frame holds the caller's frame pointer followed by the return address
+  while (n < depth && fp != NULL && ((uintptr_t)fp & (sizeof *fp - 1)) == 0
+         && (uintptr_t)fp >= low && (uintptr_t)fp - low < PROFILING_SAMPLER_MAX_FRAME) {
+    if (fp[1] == 0) {
+      break;
+    }
+    
+    pc[n++] = fp[1];
+    next = (uintptr_t *)fp[0];
+    low = (uintptr_t)(fp + 2);
+    fp = next;
+  }
+  
+  return n;
+}
+
+#endif
+
+
+/* @brief   Compare PCs of the flat profile
+ */
+static int cmp_pc(const void *a, const void *b)
+{
+  uintptr_t x = ((const struct pc_count *)a)->pc;
+  uintptr_t y = ((const struct pc_count *)b)->pc;
+  
+  return (x > y) - (x < y);
+}
+
+
+/* @brief   Compare counts of the flat profile, for descending order
+ */
+static int cmp_count(const void *a, const void *b)
+{
+  int x = ((const struct pc_count *)a)->cnt;
+  int y = ((const struct pc_count *)b)->cnt;
+  
+  return (x < y) - (x > y);
+}
+
+
+/* @brief   Compare the sample_depth PCs of two samples
+ */
+static int cmp_stack(const void *a, const void *b)
+{
+  const uintptr_t *x = a;
+  const uintptr_t *y = b;
+  
+  for (int f = 0; f < sample_depth; f++) {
+    if (x[f] != y[f]) {
+      return (x[f] > y[f]) - (x[f] < y[f]);
+    }
+  }
+  
+  return 0;
+}
+
@@ -0,0 +1,256 @@
+/*
+ * Copyright 2023  Marven Gilhespie
+ *
+ * Licensed under the Apache License, segment_id 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+
+/* Per-thread counters and sample windows.
+ *
+ * profiling_count() and profiling_add_sample() update shared state, so
+ * threads counting the same event lose updates and bounce its cache line
+ * between CPUs.  A struct profiling_pcounter or struct profiling_psamples
+ * instead has a slot for each thread, padded to a cache line, that only its
+ * own thread writes.  The hot path is a plain increment or store into the
+ * calling thread's slot, no locks or atomic operations are used.
+ *
+ * profiling_pcounter_read() and profiling_psamples_collect() fold the slots
+ * of all threads together without stopping them, so while other threads are
+ * counting the results are approximate.  On a 32 bit CPU a count being
+ * incremented can be misread, and a window entry being overwritten can be
+ * read with half of its old and half of its new value.  Values read once
+ * the other threads have stopped updating them are exact.
+ *
+ * A thread is given a slot index the first time it uses a per-thread
+ * counter or window and gives it back when it exits, so up to
+ * PROFILING_MAX_THREADS threads can run at once.  Threads beyond that share
+ * the last slot and may lose updates.  The values a thread leaves in its
+ * slot remain part of the totals.
+ */
+
+#define LOG_LEVEL_ERROR
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/profiling.h>
+#include <sys/syscalls.h>
+#include <sys/debug.h>
+
+
+static void init_thread_key(void);
+static void release_thread_idx(void *arg);
+static uint64_t read_slot(volatile uint64_t *val);
+
+
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key;
+static pthread_mutex_t thread_idx_lock = PTHREAD_MUTEX_INITIALIZER;
+static int thread_idx_refs[PROFILING_MAX_THREADS];
+
+
+/* @brief   Get the slot index of the calling thread
+ *
+ * @return  index from 0 to PROFILING_MAX_THREADS - 1
+ */
+int profiling_thread_idx(void)
+{
+  void *val;
+  int idx;
+  
+  pthread_once(&thread_key_once, init_thread_key);
+  
+  if ((val = pthread_getspecific(thread_key)) != NULL) {
+    return (int)((intptr_t)val - 1);
+  }
+  
+  pthread_mutex_lock(&thread_idx_lock);
+  
+  for (idx = 0; idx < PROFILING_MAX_THREADS - 1 && thread_idx_refs[idx] > 0; idx++);
+
+  thread_idx_refs[idx]++;
+  pthread_mutex_unlock(&thread_idx_lock);
+  
+  pthread_setspecific(thread_key, (void *)(intptr_t)(idx + 1));
+  return idx;
+}
+
+
+/* @brief   Get the total of a per-thread counter
+ *
+ * @return  the sum of all threads' counts since the counter was last reset
+ */
+uint64_t profiling_pcounter_read(struct profiling_pcounter *pc)
+{
+  uint64_t total = 0;
+  
+  for (int t = 0; t < PROFILING_MAX_THREADS; t++) {
+    total += read_slot(&pc->slot[t].val);
+  }
+  
+  return total - pc->base;
+}
+
+
+/* @brief   Reset a per-thread counter
+ *
+ * The slots of the threads are not written, the current total becomes the
+ * counter's base instead, so counts made during the reset are not lost.
+ */
+void profiling_pcounter_reset(struct profiling_pcounter *pc)
+{
+  pc->base = 0;
+  pc->base = profiling_pcounter_read(pc);
+}
+
+
+/* @brief   Add a sample to the calling thread's window
+ */
+void profiling_psamples_add(struct profiling_psamples *pps, int64_t val)
+{
+  struct profiling_psamples_slot *slot;
+  int idx;
+  
+  idx = profiling_thread_idx();
+  slot = &pps->slot[idx];
+  pps->window[idx * pps->window_size + slot->i] = val;
+  slot->i = (slot->i + 1) % pps->window_size;
+  slot->cnt++;
+}
+
+
+/* @brief   Add the time in microseconds between two timestamps to the
+ *          calling thread's window
+ */
+void profiling_psamples_microsecs(struct profiling_psamples *pps, struct timespec *start, struct timespec *end)
+{
+  struct timespec diff;
+  
+  diff_timespec(&diff, end, start);
+  profiling_psamples_add(pps, (int64_t)diff.tv_sec * 1000000 + diff.tv_nsec / 1000);
+}
+
+
+/* @brief   Add the time in milliseconds between two timestamps to the
+ *          calling thread's window
+ */
+void profiling_psamples_millisecs(struct profiling_psamples *pps, struct timespec *start, struct timespec *end)
+{
+  struct timespec diff;
+  
+  diff_timespec(&diff, end, start);
+  profiling_psamples_add(pps, (int64_t)diff.tv_sec * 1000 + diff.tv_nsec / 1000000);
+}
+
+
+/* @brief   Fold the windows of all threads into a struct profiling_samples
+ *
+ * @param   pps, per-thread windows to collect
+ * @param   ps, samples to reset and then add every sample in the windows
+ *          to, including to any histogram attached to it
+ * @return  number of samples collected
+ *
+ * The samples of each thread are added oldest first.  If ps has a smaller
+ * window than the total collected only the last samples remain in its
+ * window, its histogram counts them all.  Samples being added by other
+ * threads during the call may be missed or read torn.
+ */
+int profiling_psamples_collect(struct profiling_psamples *pps, struct profiling_samples *ps)
+{
+  uint64_t cnt;
+  int total = 0;
+  int n;
+  int first;
+  int64_t *window;
+  
+  profiling_reset_samples(ps);
+  
+  for (int t = 0; t < PROFILING_MAX_THREADS; t++) {
+    cnt = read_slot(&pps->slot[t].cnt);
+    
+    if (cnt == 0) {
+      continue;
+    }
+    
+    n = (cnt < (uint64_t)pps->window_size) ? (int)cnt : pps->window_size;
+    first = (int)((cnt - n) % pps->window_size);
+    window = &pps->window[t * pps->window_size];
+    
+    for (int s = 0; s < n; s++) {
+      profiling_add_sample(ps, window[(first + s) % pps->window_size]);
+    }
+    
+    total += n;
+  }
+  
+  return total;
+}
+
+
+/* @brief   Reset the per-thread windows
+ *
+ * Must not be called while other threads are adding samples.
+ */
+void profiling_psamples_reset(struct profiling_psamples *pps)
+{
+  for (int t = 0; t < PROFILING_MAX_THREADS; t++) {
+    pps->slot[t].cnt = 0;
+    pps->slot[t].i = 0;
+  }
+}
+
+
+/* @brief   Create the key holding the slot index of each thread
+ */
+static void init_thread_key(void)
+{
+  pthread_key_create(&thread_key, release_thread_idx);
+}
+
+
+/* @brief   Free the slot index of an exiting thread
+ */
+static void release_thread_idx(void *arg)
+{
+  int idx = (int)((intptr_t)arg - 1);
+  
+  pthread_mutex_lock(&thread_idx_lock);
+  thread_idx_refs[idx]--;
+  pthread_mutex_unlock(&thread_idx_lock);
+}
+
+
+/* @brief   Read a 64 bit slot another thread may be incrementing
+ *
+ * On a 32 bit CPU the two halves are loaded separately, the value is read
+ * until two reads agree.  This makes it unlikely that a carry half way
+ * through is seen, it does not rule it out.
+ */
+static uint64_t read_slot(volatile uint64_t *val)
+{
+  uint64_t a;
+  uint64_t b;
+  
+  b = *val;
+  
+  do {
+    a = b;
+    b = *val;
+  } while (a != b);
+  
+  return a;
+}
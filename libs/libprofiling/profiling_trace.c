@@ -0,0 +1,282 @@
+/*
+ * Copyright 2023  Marven Gilhespie
+ *
+ * Licensed under the Apache License, segment_id 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+
+
+/* Span tracer.
+ *
+ * Averages and percentiles say how long an operation usually takes but not
+ * why one occurrence was slow.  The tracer records individual events, the
+ * begin and end of spans defined with profiling_define_span() and instant
+ * marks, so that the sequence of operations behind a slow request can be
+ * seen.
+ *
+ * Each event is a fixed size struct profiling_trace_event holding a
+ * profiling_timestamp(), the id of the span's name and an optional
+ * argument.  Events go into a ring buffer of the calling thread's slot, see
+ * profiling_thread_idx(), overwriting its oldest events when full.  As with
+ * the per-thread counters only the owning thread writes a ring so recording
+ * takes no locks.  Threads beyond PROFILING_MAX_THREADS share the last ring
+ * and may corrupt each other's events.
+ *
+ * A span is given an id the first time it records an event.  Names are
+ * kept in a table of PROFILING_TRACE_MAX_SPANS entries, spans beyond that
+ * are not recorded.
+ *
+ * profiling_trace_dump() writes the rings as Chrome trace event JSON that
+ * can be loaded by about:tracing or Perfetto.  It should be called while
+ * no events are being recorded, such as after profiling_enable(false),
+ * otherwise the events being overwritten may appear garbled.
+ */
+
+#define LOG_LEVEL_ERROR
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/profiling.h>
+#include <sys/syscalls.h>
+#include <sys/debug.h>
+
+
+static int assign_span_id(struct profiling_span *span);
+static int dump_ring(FILE *fp, struct profiling_trace_ring *ring, uint64_t base, int tid, bool *first);
+
+
+static struct profiling_trace_ring trace_ring[PROFILING_MAX_THREADS];
+static int trace_ring_size;
+
+static pthread_mutex_t span_lock = PTHREAD_MUTEX_INITIALIZER;
+static const char *span_name[PROFILING_TRACE_MAX_SPANS];
+static int span_cnt;
+
+
+/* @brief   Allocate the ring buffers of the tracer
+ *
+ * @param   events_per_thread, number of events each thread's ring holds
+ * @return  0 on success, negative errno on failure
+ *
+ * Must not be called while events are being recorded.
+ */
+int profiling_trace_init(int events_per_thread)
+{
+  struct profiling_trace_event *event;
+  
+  if (events_per_thread <= 0) {
+    return -EINVAL;
+  }
+  
+  profiling_trace_free();
+
+  if ((event = calloc((size_t)PROFILING_MAX_THREADS * events_per_thread, sizeof *event)) == NULL) {
+    return -ENOMEM;
+  }
+  
+  for (int t = 0; t < PROFILING_MAX_THREADS; t++) {
+    trace_ring[t].event = &event[t * events_per_thread];
+    trace_ring[t].head = 0;
+  }
+  
+  trace_ring_size = events_per_thread;
+  return 0;
+}
+
+
+/* @brief   Free the ring buffers of the tracer, disabling tracing
+ *
+ * Must not be called while events are being recorded.
+ */
+void profiling_trace_free(void)
+{
+  free(trace_ring[0].event);
+
+  for (int t = 0; t < PROFILING_MAX_THREADS; t++) {
+    trace_ring[t].event = NULL;
+    trace_ring[t].head = 0;
+  }
+  
+  trace_ring_size = 0;
+}
+
+
+/* @brief   Discard all recorded events
+ *
+ * Must not be called while events are being recorded.
+ */
+void profiling_trace_reset(void)
+{
+  for (int t = 0; t < PROFILING_MAX_THREADS; t++) {
+    trace_ring[t].head = 0;
+  }
+}
+
+
+/* @brief   Record an event in the calling thread's ring
+ *
+ * @param   span, span the event belongs to
+ * @param   type, PROFILING_TRACE_BEGIN, _END or _MARK
+ * @param   arg, argument shown with the event
+ */
+void profiling_trace_event(struct profiling_span *span, int type, uint32_t arg)
+{
+  struct profiling_trace_ring *ring;
+  struct profiling_trace_event *ev;
+  int id;
+  
+  if (trace_ring_size == 0) {
+    return;
+  }
+  
+  if ((id = __atomic_load_n(&span->id, __ATOMIC_ACQUIRE)) == 0
+      && (id = assign_span_id(span)) == 0) {
+    return;
+  }
+  
+  ring = &trace_ring[profiling_thread_idx()];
+  ev = &ring->event[ring->head % trace_ring_size];
+  ev->ts = profiling_timestamp();
+  ev->name_id = id;
+  ev->type = type;
+  ev->arg = arg;
+  ring->head++;
+}
+
+
+/* @brief   Write the recorded events as Chrome trace event JSON
+ *
+ * @param   path, file to create or replace
+ * @return  number of events written, or negative errno on failure
+ *
+ * Timestamps are relative to the oldest event recorded.  Threads are
+ * identified by their slot index.
+ */
+int profiling_trace_dump(const char *path)
+{
+  struct profiling_trace_ring *ring;
+  uint64_t base = 0;
+  bool have_base = false;
+  bool first = true;
+  uint32_t n;
+  int cnt = 0;
+  int sc = 0;
+  FILE *fp;
+  
+  if ((fp = fopen(path, "w")) == NULL) {
+    return -errno;
+  }
+  
+  // The oldest event of each ring is compared as the tick difference so
+  // that a wrapping counter is handled
+  for (int t = 0; t < PROFILING_MAX_THREADS; t++) {
+    ring = &trace_ring[t];
+    
+    if (ring->head == 0) {
+      continue;
+    }
+    
+    n = (ring->head < (uint32_t)trace_ring_size) ? 0 : ring->head % trace_ring_size;
+        
+    if (have_base == false || (int64_t)(ring->event[n].ts - base) < 0) {
+      base = ring->event[n].ts;
+      have_base = true;
+    }
+  }
+  
+  fprintf(fp, "{\"traceEvents\":[\n");
+  
+  for (int t = 0; t < PROFILING_MAX_THREADS; t++) {
+    cnt += dump_ring(fp, &trace_ring[t], base, t, &first);
+  }
+  
+  fprintf(fp, "\n],\"displayTimeUnit\":\"ns\"}\n");
+  
+  if (ferror(fp)) {
+    sc = -EIO;
+  }
+  
+  if (fclose(fp) != 0 && sc == 0) {
+    sc = -errno;
+  }
+  
+  return (sc == 0) ? cnt : sc;
+}
+
+
+/* @brief   Write the events of one ring, oldest first
+ *
+ * @return  number of events written
+ */
+static int dump_ring(FILE *fp, struct profiling_trace_ring *ring, uint64_t base, int tid, bool *first)
+{
+  static const char ph[] = { [PROFILING_TRACE_BEGIN] = 'B', [PROFILING_TRACE_END] = 'E',
+                             [PROFILING_TRACE_MARK] = 'i' };
+  struct profiling_trace_event *ev;
+  uint64_t nsec;
+  uint32_t n;
+  uint32_t start;
+  int pid = (int)getpid();
+  int cnt = 0;
+  
+  n = (ring->head < (uint32_t)trace_ring_size) ? ring->head : (uint32_t)trace_ring_size;
+  start = ring->head - n;
+  
+  for (uint32_t e = 0; e < n; e++) {
+    ev = &ring->event[(start + e) % trace_ring_size];
+
+    if (ev->name_id == 0 || ev->name_id > span_cnt || ev->type > PROFILING_TRACE_MARK) {
+      continue;
+    }
+    
+    nsec = profiling_elapsed_nsec(base, ev->ts);
+
+    fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03u,\"pid\":%d,\"tid\":%d%s,\"args\":{\"arg\":%lu}}",
+            (*first) ? "" : ",\n", span_name[ev->name_id - 1], ph[ev->type],
+            (unsigned long long)(nsec / 1000), (unsigned)(nsec % 1000), pid, tid,
+            (ev->type == PROFILING_TRACE_MARK) ? ",\"s\":\"t\"" : "", (unsigned long)ev->arg);
+    *first = false;
+    cnt++;
+  }
+  
+  return cnt;
+}
+
+
+/* @brief   Give a span the next free id
+ *
+ * @return  the id of the span, or 0 if the name table is full
+ */
+static int assign_span_id(struct profiling_span *span)
+{
+  int id;
+  
+  pthread_mutex_lock(&span_lock);
+  
+  if ((id = span->id) == 0 && span_cnt < PROFILING_TRACE_MAX_SPANS) {
+    span_name[span_cnt++] = span->name;
+    id = span_cnt;
+    __atomic_store_n(&span->id, id, __ATOMIC_RELEASE);
+  }
+  
+  pthread_mutex_unlock(&span_lock);
+  return id;
+}
+
@@ -27,78 +27,373 @@
 #include <string.h>
 #include <sys/lists.h>
 #include <sys/stat.h>
+#include <sys/types.h>
 
 
+// Number of bits of a sample resolved within each power of two of a histogram
+#define PROFILING_HIST_SUB_BITS     4
+
+// Number of buckets of a histogram covering all 64 bit values
+#define PROFILING_HIST_BUCKET_CNT   ((64 - PROFILING_HIST_SUB_BITS + 1) << PROFILING_HIST_SUB_BITS)
+
+
+/* @brief   Log-linear histogram of an unbounded number of samples
+ */
+struct profiling_hist
+{
+  uint64_t cnt;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+  uint64_t bucket[PROFILING_HIST_BUCKET_CNT];
+};
+
+
+// Maximum number of threads with their own slot in per-thread counters and windows
+#define PROFILING_MAX_THREADS       32
+
+// Size slots written by different threads are padded to
+#define PROFILING_CACHE_LINE        64
+
+
+/* @brief   A thread's slot of a per-thread counter
+ */
+struct profiling_pcounter_slot
+{
+  uint64_t val;
+} __attribute__((aligned(PROFILING_CACHE_LINE)));
+
+
+/* @brief   Counter updated by each thread in its own slot, see profiling_pcount()
+ */
+struct profiling_pcounter
+{
+  struct profiling_pcounter_slot slot[PROFILING_MAX_THREADS];
+  uint64_t base;                // Total when last reset
+};
+
+
+/* @brief   A thread's slot of a per-thread sample window
+ */
+struct profiling_psamples_slot
+{
+  uint64_t cnt;                 // Samples added by the thread
+  int i;                        // Next entry of the thread's window
+} __attribute__((aligned(PROFILING_CACHE_LINE)));
+
+
+/* @brief   Sample windows of each thread, see profiling_psamples_collect()
+ */
+struct profiling_psamples
+{
+  int64_t *window;              // PROFILING_MAX_THREADS windows of window_size
+  int window_size;
+  struct profiling_psamples_slot slot[PROFILING_MAX_THREADS];
+};
+
+
+/* @brief   Percentiles of a histogram, see profiling_hist_summary()
+ */
+struct profiling_hist_summary
+{
+  uint64_t cnt;
+  uint64_t avg;
+  uint64_t min;
+  uint64_t p50;
+  uint64_t p90;
+  uint64_t p99;
+  uint64_t p999;
+  uint64_t max;
+};
+
+
+// Kinds of profiling point, see struct profiling_point
+#define PROFILING_POINT_TS          1
+#define PROFILING_POINT_COUNTER     2
+#define PROFILING_POINT_PCOUNTER    3
+#define PROFILING_POINT_PTS         4
+
+
+/* @brief   Entry of the registry of profiling points
+ *
+ * Defined by the profiling_define_* macros, which place a pointer to it in
+ * the profiling_points section, see profiling_registry.c
+ */
+struct profiling_point
+{
+  const char *name;             // Name passed to profiling_define_*
+  int kind;                     // PROFILING_POINT_*
+  void *var;                    // The struct or int of the point
+};
+
+
+// Formats of profiling_snapshot()
+#define PROFILING_SNAPSHOT_TEXT       0
+#define PROFILING_SNAPSHOT_BINARY     1
+
+#define PROFILING_SNAPSHOT_MAGIC      0x464f5250    // "PROF"
+#define PROFILING_SNAPSHOT_VERSION    1
+
+// Maximum number of values of a point in a snapshot
+#define PROFILING_SNAPSHOT_MAX_FIELDS 10
+
+
+/* @brief   Header of a binary snapshot
+ */
+struct profiling_snapshot_hdr
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t point_cnt;
+};
+
+
+/* @brief   Record of a point in a binary snapshot, followed by the name and
+ *          field_cnt int64_t values
+ */
+struct profiling_snapshot_rec
+{
+  uint8_t kind;
+  uint8_t name_len;
+  uint8_t field_cnt;
+  uint8_t reserved;
+};
+
+
+// Types of trace events
+#define PROFILING_TRACE_BEGIN       0
+#define PROFILING_TRACE_END         1
+#define PROFILING_TRACE_MARK        2
+
+// Maximum number of spans that can be traced
+#define PROFILING_TRACE_MAX_SPANS   256
+
+
+// Maximum number of PCs recorded per sample by the sampling profiler
+#define PROFILING_SAMPLER_MAX_DEPTH 32
+
+// Formats of profiling_sampler_dump()
+#define PROFILING_SAMPLER_FLAT      0
+#define PROFILING_SAMPLER_FOLDED    1
+
+
+/* @brief   A named span of the tracer, see profiling_define_span()
+ */
+struct profiling_span
+{
+  const char *name;
+  int id;                       // Index + 1 in the tracer's names, 0 if not yet traced
+};
+
+
+/* @brief   Event recorded by the tracer
+ */
+struct profiling_trace_event
+{
+  uint64_t ts;                  // profiling_timestamp()
+  uint32_t arg;
+  uint16_t name_id;             // Id of the span
+  uint8_t type;                 // PROFILING_TRACE_*
+  uint8_t reserved;
+};
+
+
+/* @brief   Ring buffer of events recorded by a thread
+ */
+struct profiling_trace_ring
+{
+  struct profiling_trace_event *event;
+  uint32_t head;                // Number of events recorded
+} __attribute__((aligned(PROFILING_CACHE_LINE)));
+
+
+// Default weight of a new sample in exponentially weighted moving averages
+#define PROFILING_EWMA_ALPHA        0.125
 
 
 /* @brief   Structure for recording profiling samples and statistics
+ *
+ * The statistics other than ewma are of the samples in the window, see
+ * profiling.c
  */
 struct profiling_samples
 {
-  struct timespec start_ts;
-  struct timespec end_ts;
-  int *window;          // [MAX_PROFILING_SAMPLES];
+  uint64_t start_tick;            // Timestamps of profiling_begin/end_*
+  uint64_t end_tick;
+  int64_t *window;                // Last window_size samples
+  int *deque;                     // Min and max deques, 2 * window_size
   int window_size;
-  int sample_cnt;
-  int i;
+  int sample_cnt;                 // Samples in the window
+  int i;                          // Next entry of the window
+  uint64_t total_cnt;             // Samples added since reset
   int64_t sum;
-  int avg;
-  int max;
-  int min;
+  int64_t avg;
+  int64_t max;
+  int64_t min;
+  double mean;                    // Welford mean and sum of squared differences
+  double m2;
+  double m2_err;                  // Bound on the rounding error of m2
+  double ewma;                    // EWMA of all samples
+  double ewma_alpha;              // Weight of a new sample, 0 for PROFILING_EWMA_ALPHA
+  double ewma_interval;           // EWMA of nanoseconds between timestamped samples
+  uint64_t last_ts;               // Timestamp of the last timestamped sample
+  int min_head;
+  int min_cnt;
+  int max_head;
+  int max_cnt;
+  struct profiling_hist *hist;    // Also counts every sample, or NULL
 };
 
 
 
+// profiling.c
 void profiling_init_samples(struct profiling_samples *ps);
-void profiling_add_sample(struct profiling_samples *ps, int val);
+int profiling_alloc_samples(struct profiling_samples *ps, int window_size, bool hist);
+void profiling_free_samples(struct profiling_samples *ps);
+void profiling_reset_samples(struct profiling_samples *ps);
+void profiling_add_sample(struct profiling_samples *ps, int64_t val);
+void profiling_add_sample_ts(struct profiling_samples *ps, int64_t val, uint64_t ts);
+double profiling_samples_variance(struct profiling_samples *ps);
+int64_t profiling_samples_stddev(struct profiling_samples *ps);
+double profiling_samples_rate(struct profiling_samples *ps);
 void profiling_microsecs(struct profiling_samples *ps, struct timespec *start, struct timespec *end);
 void profiling_millisecs(struct profiling_samples *ps, struct timespec *start, struct timespec *end);
 
+// profiling_hist.c
+void profiling_hist_init(struct profiling_hist *ph);
+void profiling_hist_add(struct profiling_hist *ph, uint64_t val);
+void profiling_hist_merge(struct profiling_hist *dst, const struct profiling_hist *src);
+uint64_t profiling_hist_percentile(const struct profiling_hist *ph, double pct);
+void profiling_hist_summary(const struct profiling_hist *ph, struct profiling_hist_summary *sum);
+
+// profiling_thread.c
+int profiling_thread_idx(void);
+uint64_t profiling_pcounter_read(struct profiling_pcounter *pc);
+void profiling_pcounter_reset(struct profiling_pcounter *pc);
+void profiling_psamples_add(struct profiling_psamples *pps, int64_t val);
+void profiling_psamples_microsecs(struct profiling_psamples *pps, struct timespec *start, struct timespec *end);
+void profiling_psamples_millisecs(struct profiling_psamples *pps, struct timespec *start, struct timespec *end);
+int profiling_psamples_collect(struct profiling_psamples *pps, struct profiling_samples *ps);
+void profiling_psamples_reset(struct profiling_psamples *pps);
+
+// profiling_clock.c
+uint64_t profiling_timestamp(void);
+void profiling_clock_calibrate(void);
+uint64_t profiling_elapsed_nsec(uint64_t start, uint64_t end);
+void profiling_add_elapsed(struct profiling_samples *ps, uint64_t start, uint64_t end, uint32_t unit_nsec);
+
+// profiling_registry.c
+int profiling_point_cnt(void);
+struct profiling_point *profiling_get_point(int idx);
+struct profiling_point *profiling_find_point(const char *name, int kind);
+size_t profiling_snapshot(void *buf, size_t size, int format);
+ssize_t profiling_snapshot_file(const char *path, int format);
+
+// profiling_trace.c
+int profiling_trace_init(int events_per_thread);
+void profiling_trace_free(void);
+void profiling_trace_reset(void);
+void profiling_trace_event(struct profiling_span *span, int type, uint32_t arg);
+int profiling_trace_dump(const char *path);
+
+// profiling_sampler.c
+int profiling_sampler_start(int hz, int max_samples, int depth);
+void profiling_sampler_stop(void);
+int profiling_sampler_cnt(int *dropped);
+int profiling_sampler_dump(const char *path, int format);
+
+
+/* @brief   Add to the calling thread's slot of a per-thread counter
+ */
+static inline void profiling_pcounter_add(struct profiling_pcounter *pc, uint64_t n)
+{
+  pc->slot[profiling_thread_idx()].val += n;
+}
+
 
 #define profiling_enable(enable)                                                  \
   __libprofiling_enable = enable
 
+// Macro used by the profiling_define_* macros to register a point
+#define profiling_register_point(type, varname, pkind, pvar)                      \
+    static struct profiling_point profiling_point_ ## type ## _ ## varname = {    \
+      .name = #varname,                                                           \
+      .kind = pkind,                                                              \
+      .var = pvar                                                                 \
+    };                                                                            \
+    static struct profiling_point *profiling_point_ptr_ ## type ## _ ## varname   \
+      __attribute__((section("profiling_points"), used)) =                        \
+      &profiling_point_ ## type ## _ ## varname
+
 // Macro for defining a structure and array to record profiling times
 #define profiling_define_ts(varname, sz)                                          \
-    int profiling_window_ ## varname[sz];                                         \
+    int64_t profiling_window_ ## varname[sz];                                     \
+    int profiling_deque_ ## varname[2 * (sz)];                                    \
     struct profiling_samples profiling_ts_ ## varname = {                         \
-      .window = &profiling_window_ ## varname,                                    \
+      .window = profiling_window_ ## varname,                                     \
+      .deque = profiling_deque_ ## varname,                                       \
       .window_size = sz,                                                          \
       .sample_cnt = 0,                                                            \
       .i = 0                                                                      \
-    }
+    };                                                                            \
+    profiling_register_point(ts, varname, PROFILING_POINT_TS,                     \
+                             &profiling_ts_ ## varname)
+
+// As profiling_define_ts, also counting every time in a histogram
+#define profiling_define_ts_hist(varname, sz)                                     \
+    int64_t profiling_window_ ## varname[sz];                                     \
+    int profiling_deque_ ## varname[2 * (sz)];                                    \
+    struct profiling_hist profiling_hist_ ## varname;                             \
+    struct profiling_samples profiling_ts_ ## varname = {                         \
+      .window = profiling_window_ ## varname,                                     \
+      .deque = profiling_deque_ ## varname,                                       \
+      .window_size = sz,                                                          \
+      .sample_cnt = 0,                                                            \
+      .i = 0,                                                                     \
+      .hist = &profiling_hist_ ## varname                                         \
+    };                                                                            \
+    profiling_register_point(ts, varname, PROFILING_POINT_TS,                     \
+                             &profiling_ts_ ## varname)
           
 #define profiling_extern_ts(varname);                                             \
   extern struct profiling_samples profiling_ts_ ## varname;
+
+#define profiling_extern_ts_hist(varname);                                        \
+  extern struct profiling_samples profiling_ts_ ## varname;                       \
+  extern struct profiling_hist profiling_hist_ ## varname;
   
 // Macro for defining a profiling counter  
 #define profiling_define_counter(varname)                                         \
-  int profiling_counter_ ## varname;
+  int profiling_counter_ ## varname;                                              \
+  profiling_register_point(counter, varname, PROFILING_POINT_COUNTER,             \
+                           &profiling_counter_ ## varname);
 
 #define profiling_extern_counter(varname);                                        \
   extern int profiling_counter_ ## varname;
 
 
-// Macros for recording the start and end of a section to profile
+// Macros for recording the start and end of a section to profile, timed
+// with profiling_timestamp()
 #define profiling_begin(varname)                                                  \
   if (__libprofiling_enable) {                                                    \
-    clock_gettime(CLOCK_MONOTONIC_RAW, &profiling_ts_ ## varname.start_ts);       \
+    profiling_ts_ ## varname.start_tick = profiling_timestamp();                  \
   }   
 
+#define profiling_end_nsec(varname)                                               \
+  profiling_end_unit(varname, 1)
+
 #define profiling_end_usec(varname)                                               \
-  if (__libprofiling_enable) {                                                    \
-    clock_gettime(CLOCK_MONOTONIC_RAW, &profiling_ts_ ## varname.end_ts);         \
-    profiling_microsecs(&profiling_ts_ ## varname ,                               \
-              &profiling_ts_ ## varname.start_ts,                                 \
-              &profiling_ts_ ## varname.end_ts);                                  \
-  }
+  profiling_end_unit(varname, 1000)
 
 #define profiling_end_msec(varname)                                               \
+  profiling_end_unit(varname, 1000000)
+
+#define profiling_end_unit(varname, unit_nsec)                                    \
   if (__libprofiling_enable) {                                                    \
-    clock_gettime(CLOCK_MONOTONIC_RAW, &profiling_ts_ ## varname.end_ts);         \
-    profiling_millisecs(&profiling_ts_ ## varname ,                               \
-              &profiling_ts_ ## varname.start_ts,                                 \
-              &profiling_ts_ ## varname.end_ts);                                  \
+    profiling_ts_ ## varname.end_tick = profiling_timestamp();                    \
+    profiling_add_elapsed(&profiling_ts_ ## varname,                              \
+              profiling_ts_ ## varname.start_tick,                                \
+              profiling_ts_ ## varname.end_tick, unit_nsec);                      \
   }
 
 
@@ -112,12 +407,28 @@ void profiling_millisecs(struct profiling_samples *ps, struct timespec *start, s
 #define profiling_ts_max(varname)                                                 \
   profiling_ts_ ## varname.max
 
+#define profiling_ts_variance(varname)                                            \
+  profiling_samples_variance(&profiling_ts_ ## varname)
+
+#define profiling_ts_stddev(varname)                                              \
+  profiling_samples_stddev(&profiling_ts_ ## varname)
+
+#define profiling_ts_ewma(varname)                                                \
+  profiling_ts_ ## varname.ewma
+
+#define profiling_ts_rate(varname)                                                \
+  profiling_samples_rate(&profiling_ts_ ## varname)
+
+// Macros to retrieve percentiles of a time defined with profiling_define_ts_hist
+#define profiling_ts_pct(varname, pct)                                            \
+  profiling_hist_percentile(&profiling_hist_ ## varname, pct)
+
+#define profiling_ts_summary(varname, sum)                                        \
+  profiling_hist_summary(&profiling_hist_ ## varname, sum)
+
 // Macro to reset profiling times and sample window    
 #define profiling_ts_reset(varname)                                               \
-  if (1) {                                                                        \
-    profiling_ts_ ## varname.sample_cnt = 0;                                      \
-    profiling_ts_ ## varname.i = 0;                                               \
-  } 
+  profiling_reset_samples(&profiling_ts_ ## varname);
     
  
 // Macro for incrementing a profiling counter
@@ -134,6 +445,104 @@ void profiling_millisecs(struct profiling_samples *ps, struct timespec *start, s
   profiling_counter_ ## varname = 0;
 
 
+// Macros for defining a counter and sample windows updated per-thread
+#define profiling_define_pcounter(varname)                                        \
+  struct profiling_pcounter profiling_pcounter_ ## varname;                       \
+  profiling_register_point(pcounter, varname, PROFILING_POINT_PCOUNTER,           \
+                           &profiling_pcounter_ ## varname);
+
+#define profiling_extern_pcounter(varname);                                       \
+  extern struct profiling_pcounter profiling_pcounter_ ## varname;
+
+#define profiling_define_pts(varname, sz)                                         \
+    int64_t profiling_pwindow_ ## varname[PROFILING_MAX_THREADS * (sz)];         \
+    struct profiling_psamples profiling_pts_ ## varname = {                       \
+      .window = profiling_pwindow_ ## varname,                                    \
+      .window_size = sz                                                           \
+    };                                                                            \
+    profiling_register_point(pts, varname, PROFILING_POINT_PTS,                   \
+                             &profiling_pts_ ## varname)
+
+#define profiling_extern_pts(varname);                                            \
+  extern struct profiling_psamples profiling_pts_ ## varname;
+
+// Macros for counting in the calling thread's slot of a per-thread counter
+#define profiling_pcount(varname)                                                 \
+  if (__libprofiling_enable) {                                                    \
+    profiling_pcounter_add(&profiling_pcounter_ ## varname, 1);                   \
+  }
+
+#define profiling_pcount_get(varname)                                             \
+  profiling_pcounter_read(&profiling_pcounter_ ## varname)
+
+#define profiling_pcount_reset(varname)                                           \
+  profiling_pcounter_reset(&profiling_pcounter_ ## varname);
+
+// Macros for timing a section in the calling thread, the start time is a
+// local variable so profiling_pbegin and profiling_pend_* must be in the
+// same block
+#define profiling_pbegin(varname)                                                 \
+  uint64_t profiling_pstart_ ## varname = 0;                                      \
+  if (__libprofiling_enable) {                                                    \
+    profiling_pstart_ ## varname = profiling_timestamp();                         \
+  }
+
+#define profiling_pend_nsec(varname)                                              \
+  profiling_pend_unit(varname, 1)
+
+#define profiling_pend_usec(varname)                                              \
+  profiling_pend_unit(varname, 1000)
+
+#define profiling_pend_msec(varname)                                              \
+  profiling_pend_unit(varname, 1000000)
+
+#define profiling_pend_unit(varname, unit_nsec)                                   \
+  if (__libprofiling_enable) {                                                    \
+    uint64_t profiling_pend_tick = profiling_timestamp();                         \
+    profiling_psamples_add(&profiling_pts_ ## varname,                            \
+              (int64_t)(profiling_elapsed_nsec(profiling_pstart_ ## varname,      \
+                                           profiling_pend_tick) / (unit_nsec)));  \
+  }
+
+// Macros for defining a span of the tracer
+#define profiling_define_span(varname)                                            \
+  struct profiling_span profiling_span_ ## varname = {                            \
+    .name = #varname,                                                             \
+    .id = 0                                                                       \
+  };
+
+#define profiling_extern_span(varname);                                           \
+  extern struct profiling_span profiling_span_ ## varname;
+
+// Macros for recording the begin and end of a span and instant marks in the
+// calling thread's trace ring, with an optional argument
+#define profiling_span_begin(varname)                                             \
+  profiling_span_begin_arg(varname, 0)
+
+#define profiling_span_begin_arg(varname, arg)                                    \
+  if (__libprofiling_enable) {                                                    \
+    profiling_trace_event(&profiling_span_ ## varname, PROFILING_TRACE_BEGIN, arg); \
+  }
+
+#define profiling_span_end(varname)                                               \
+  profiling_span_end_arg(varname, 0)
+
+#define profiling_span_end_arg(varname, arg)                                      \
+  if (__libprofiling_enable) {                                                    \
+    profiling_trace_event(&profiling_span_ ## varname, PROFILING_TRACE_END, arg); \
+  }
+
+#define profiling_span_mark(varname, arg)                                         \
+  if (__libprofiling_enable) {                                                    \
+    profiling_trace_event(&profiling_span_ ## varname, PROFILING_TRACE_MARK, arg); \
+  }
+
+
+// Macro to fold the per-thread windows into a struct profiling_samples
+#define profiling_pts_collect(varname, ps)                                        \
+  profiling_psamples_collect(&profiling_pts_ ## varname, ps)
+
+
 // Variable to control profiling
 extern int __libprofiling_enable;
 